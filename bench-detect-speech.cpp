@@ -0,0 +1,708 @@
+// Benchmark of the stages of detect-speech over synthetic inputs and/or a corpus of real files
+//
+// Every stage is timed on its own and reported as one line on stdout:
+//
+//   stage  mode  files  audio_s  wall_s  cpu_s  x_realtime  audio_h_per_cpu_h
+//
+// audio_s is the length of the files that went through the stage, also for the modes that
+// only decode part of them (decode/probe), so the modes of a stage compare directly.
+// The corpus is held decoded in memory for the VAD stages.
+
+#include "whisper.h"
+#include "common.h"
+#include "common-whisper.h"
+#include "common-simd.h"
+#include "ffmpeg-transcode.h"
+#include "resample.h"
+#include "speech-scan.h"
+#include "vad-model.h"
+
+extern "C" {
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+}
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static void whisper_log_callback(ggml_log_level level, const char * text, void * user_data) {
+    (void)user_data;
+    if (level == GGML_LOG_LEVEL_ERROR) {
+        fprintf(stderr, "%s", text);
+    }
+}
+
+// One file of the benchmark
+struct bench_input {
+    std::string path;
+    std::string label;           // kind/length/format for synthetic inputs, the path otherwise
+    double seconds = 0.0;        // length, known after the decode stage
+    std::vector<float> pcmf32;   // 16 kHz mono, filled by the decode stage
+};
+
+// Time fn() and print a result line
+static void bench_stage(const char * stage, const char * mode, size_t n_files, const std::function<double()> & fn) {
+    const double wall0 = wall_seconds();
+    const double cpu0 = cpu_seconds();
+    const double audio_seconds = fn();
+    const double wall = wall_seconds() - wall0;
+    const double cpu = cpu_seconds() - cpu0;
+
+    printf("%-10s %-8s %6zu %12.1f %10.3f %10.3f %12.1f %18.1f\n", stage, mode, n_files, audio_seconds, wall, cpu,
+           wall > 0.0 ? audio_seconds / wall : 0.0, cpu > 0.0 ? audio_seconds / cpu : 0.0);
+    fflush(stdout);
+}
+
+//
+// synthetic inputs
+//
+
+enum synth_kind {
+    SYNTH_SILENCE,
+    SYNTH_NOISE,
+    SYNTH_SPEECH, // voiced bursts with syllable and word rhythm, silence at both ends
+};
+
+static const char * synth_kind_str(synth_kind kind) {
+    switch (kind) {
+        case SYNTH_SILENCE: return "silence";
+        case SYNTH_NOISE:   return "noise";
+        case SYNTH_SPEECH:  return "speech";
+    }
+    return "unknown";
+}
+
+struct synth_format {
+    const char * ext;
+    const char * encoder;
+    int sample_rate;
+};
+
+static const synth_format synth_formats[] = {
+    { "wav",  "pcm_s16le",  16000 },
+    { "wav",  "pcm_s16le",  44100 },
+    { "flac", "flac",       48000 },
+    { "mp3",  "libmp3lame", 44100 },
+    { "m4a",  "aac",        44100 },
+    { "opus", "libopus",    48000 },
+};
+
+static std::vector<float> synth_signal(synth_kind kind, double seconds, int sample_rate, std::mt19937 & rng) {
+    const size_t n = (size_t)(seconds * sample_rate);
+    std::vector<float> pcm(n, 0.0f);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+
+    switch (kind) {
+        case SYNTH_SILENCE:
+            for (float & s : pcm) {
+                s = 3e-4f * noise(rng);
+            }
+            break;
+        case SYNTH_NOISE:
+            for (float & s : pcm) {
+                s = 0.05f * noise(rng);
+            }
+            break;
+        case SYNTH_SPEECH: {
+            std::uniform_real_distribution<float> uni(0.0f, 1.0f);
+            const size_t lead = n / 5;
+            const size_t tail = n - n / 5;
+            size_t i = lead;
+            double phase = 0.0;
+            while (i < tail) {
+                // a word of 1 to 5 syllables followed by a pause
+                const int n_syllables = 1 + (int)(uni(rng) * 5);
+                const float f0 = 90.0f + 130.0f * uni(rng);
+                for (int k = 0; k < n_syllables && i < tail; ++k) {
+                    const size_t len = (size_t)((0.12f + 0.2f * uni(rng)) * sample_rate);
+                    for (size_t j = 0; j < len && i + j < tail; ++j) {
+                        const float t = (float)j / len;
+                        const float env = sinf((float)M_PI * t);
+                        const float f = f0 * (1.0f + 0.05f * sinf(2.0f * (float)M_PI * 5.0f * (float)(i + j) / sample_rate));
+                        phase += 2.0 * M_PI * f / sample_rate;
+                        float v = 0.0f;
+                        for (int h = 1; h <= 8; ++h) {
+                            v += sinf((float)(h * phase)) / h;
+                        }
+                        pcm[i + j] = 0.2f * env * env * v;
+                    }
+                    i += len;
+                }
+                i += (size_t)((0.1f + 0.5f * uni(rng)) * sample_rate);
+            }
+            for (float & s : pcm) {
+                s += 3e-4f * noise(rng);
+            }
+        } break;
+    }
+
+    return pcm;
+}
+
+static bool encode_frame(AVCodecContext * codec, AVFrame * frame, AVPacket * packet, AVFormatContext * fmt_ctx, AVStream * stream) {
+    if (avcodec_send_frame(codec, frame) < 0) {
+        return false;
+    }
+    while (true) {
+        const int err = avcodec_receive_packet(codec, packet);
+        if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+            return true;
+        }
+        if (err < 0) {
+            return false;
+        }
+        av_packet_rescale_ts(packet, codec->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        if (av_interleaved_write_frame(fmt_ctx, packet) < 0) {
+            return false;
+        }
+    }
+}
+
+// Encode mono float samples into path, the container is chosen from the extension
+// Returns false if the encoder isn't available or anything fails
+static bool write_audio_file(const std::string & path, const char * encoder_name, int sample_rate, const std::vector<float> & pcm) {
+    const AVCodec * encoder = avcodec_find_encoder_by_name(encoder_name);
+    if (encoder == nullptr) {
+        return false;
+    }
+
+    AVFormatContext * fmt_ctx = nullptr;
+    AVCodecContext * codec = nullptr;
+    struct SwrContext * swr = nullptr;
+    AVFrame * frame = nullptr;
+    AVPacket * packet = nullptr;
+    AVStream * stream = nullptr;
+    std::vector<float> padded;
+    int frame_size = 0;
+    size_t pos = 0;
+    int64_t pts = 0;
+    bool fixed_size = false;
+    bool ok = false;
+
+    avformat_alloc_output_context2(&fmt_ctx, nullptr, nullptr, path.c_str());
+    if (fmt_ctx == nullptr) {
+        return false;
+    }
+
+    codec = avcodec_alloc_context3(encoder);
+    codec->sample_rate = sample_rate;
+    codec->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0] : AV_SAMPLE_FMT_FLT;
+    codec->bit_rate = 64000;
+    codec->time_base = AVRational{ 1, sample_rate };
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    {
+        AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+        av_channel_layout_copy(&codec->ch_layout, &mono);
+    }
+#else
+    codec->channels = 1;
+    codec->channel_layout = AV_CH_LAYOUT_MONO;
+#endif
+    if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(codec, encoder, nullptr) < 0) {
+        goto out;
+    }
+
+    stream = avformat_new_stream(fmt_ctx, nullptr);
+    avcodec_parameters_from_context(stream->codecpar, codec);
+    stream->time_base = codec->time_base;
+
+    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&fmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE) < 0) {
+        goto out;
+    }
+    if (avformat_write_header(fmt_ctx, nullptr) < 0) {
+        goto out;
+    }
+
+    // only the sample format changes
+    swr = swr_alloc();
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    av_opt_set_chlayout(swr, "in_chlayout", &codec->ch_layout, 0);
+    av_opt_set_chlayout(swr, "out_chlayout", &codec->ch_layout, 0);
+#else
+    av_opt_set_int(swr, "in_channel_layout", AV_CH_LAYOUT_MONO, 0);
+    av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
+#endif
+    av_opt_set_int(swr, "in_sample_rate", sample_rate, 0);
+    av_opt_set_int(swr, "out_sample_rate", sample_rate, 0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", codec->sample_fmt, 0);
+    if (swr_init(swr) < 0) {
+        goto out;
+    }
+
+    fixed_size = !(encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) && codec->frame_size > 0;
+    frame_size = fixed_size ? codec->frame_size : 1024;
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+
+    while (pos < pcm.size()) {
+        const int n = (int)std::min((size_t)frame_size, pcm.size() - pos);
+        const float * in = pcm.data() + pos;
+        if (fixed_size && n < frame_size) {
+            // fixed frame size encoders get a zero padded last frame
+            padded.assign(frame_size, 0.0f);
+            std::copy(in, in + n, padded.begin());
+            in = padded.data();
+        }
+
+        frame->nb_samples = fixed_size ? frame_size : n;
+        frame->format = codec->sample_fmt;
+        frame->sample_rate = sample_rate;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+        av_channel_layout_copy(&frame->ch_layout, &codec->ch_layout);
+#else
+        frame->channel_layout = AV_CH_LAYOUT_MONO;
+#endif
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            goto out;
+        }
+        const uint8_t * in_data = (const uint8_t *)in;
+        swr_convert(swr, frame->data, frame->nb_samples, &in_data, frame->nb_samples);
+        frame->pts = pts;
+        pts += frame->nb_samples;
+
+        if (!encode_frame(codec, frame, packet, fmt_ctx, stream)) {
+            goto out;
+        }
+        av_frame_unref(frame);
+        pos += n;
+    }
+
+    ok = encode_frame(codec, nullptr, packet, fmt_ctx, stream) && av_write_trailer(fmt_ctx) == 0;
+
+out:
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    swr_free(&swr);
+    avcodec_free_context(&codec);
+    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&fmt_ctx->pb);
+    }
+    avformat_free_context(fmt_ctx);
+    if (!ok) {
+        remove(path.c_str());
+    }
+
+    return ok;
+}
+
+static void generate_synthetic(const std::string & dir, const std::vector<double> & lengths, std::vector<bench_input> & inputs) {
+    std::mt19937 rng(1234);
+    const synth_kind kinds[] = { SYNTH_SILENCE, SYNTH_NOISE, SYNTH_SPEECH };
+
+    for (const synth_format & fmt : synth_formats) {
+        if (avcodec_find_encoder_by_name(fmt.encoder) == nullptr) {
+            fprintf(stderr, "Skipping %s inputs, encoder %s is not available\n", fmt.ext, fmt.encoder);
+            continue;
+        }
+        for (const double seconds : lengths) {
+            for (const synth_kind kind : kinds) {
+                char name[128];
+                snprintf(name, sizeof(name), "%s-%gs-%s-%d.%s", synth_kind_str(kind), seconds, fmt.encoder, fmt.sample_rate, fmt.ext);
+                const std::string path = dir + "/" + name;
+                if (!write_audio_file(path, fmt.encoder, fmt.sample_rate, synth_signal(kind, seconds, fmt.sample_rate, rng))) {
+                    fprintf(stderr, "Failed to write %s\n", path.c_str());
+                    continue;
+                }
+                bench_input input;
+                input.path = path;
+                input.label = name;
+                inputs.push_back(std::move(input));
+            }
+        }
+    }
+}
+
+static void collect_corpus(const std::string & dir, std::vector<bench_input> & inputs) {
+    DIR * d = opendir(dir.c_str());
+    if (d == nullptr) {
+        fprintf(stderr, "Failed to open corpus directory %s\n", dir.c_str());
+        return;
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent * e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            names.push_back(e->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string & name : names) {
+        const std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            collect_corpus(path, inputs);
+        } else if (S_ISREG(st.st_mode)) {
+            bench_input input;
+            input.path = path;
+            input.label = path;
+            inputs.push_back(std::move(input));
+        }
+    }
+}
+
+static std::string extension_of(const std::string & path) {
+    const size_t slash = path.find_last_of('/');
+    const size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return "";
+    }
+    return path.substr(dot);
+}
+
+//
+// stages
+//
+
+// resample interleaved stereo float at in_rate to 16 kHz mono, as the decoder does after decoding
+static double bench_swresample(int in_rate, double seconds) {
+    std::mt19937 rng(in_rate);
+    std::normal_distribution<float> noise(0.0f, 0.1f);
+    const int n_block = 1024;
+    std::vector<float> in(2 * n_block);
+    std::vector<float> out;
+    for (float & s : in) {
+        s = noise(rng);
+    }
+
+    struct SwrContext * swr = swr_alloc();
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+    AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+    av_opt_set_chlayout(swr, "in_chlayout", &stereo, 0);
+    av_opt_set_chlayout(swr, "out_chlayout", &mono, 0);
+#else
+    av_opt_set_int(swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
+#endif
+    av_opt_set_int(swr, "in_sample_rate", in_rate, 0);
+    av_opt_set_int(swr, "out_sample_rate", WHISPER_SAMPLE_RATE, 0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    if (swr_init(swr) < 0) {
+        swr_free(&swr);
+        return 0.0;
+    }
+
+    const int64_t n_total = (int64_t)(seconds * in_rate);
+    for (int64_t i = 0; i < n_total; i += n_block) {
+        // room for all the output of a block, from 8 kHz that is about twice as many
+        // samples, anything left over would pile up inside swr
+        const int n_out = swr_get_out_samples(swr, n_block);
+        if ((int)out.size() < n_out) {
+            out.resize(n_out);
+        }
+        const uint8_t * in_data = (const uint8_t *)in.data();
+        uint8_t * out_data = (uint8_t *)out.data();
+        swr_convert(swr, &out_data, (int)out.size(), &in_data, n_block);
+    }
+    swr_free(&swr);
+
+    return seconds;
+}
+
+// the same conversion with a downmix at in_rate and resampler_16k, as the decoder now does
+static double bench_polyphase(int in_rate, double seconds) {
+    std::mt19937 rng(in_rate);
+    std::normal_distribution<float> noise(0.0f, 0.1f);
+    const int n_block = 1024;
+    std::vector<float> in(2 * n_block);
+    std::vector<float> mono(n_block);
+    std::vector<float> out;
+    for (float & s : in) {
+        s = noise(rng);
+    }
+
+    resampler_16k rs;
+    if (!resampler_16k_init(rs, in_rate)) {
+        return 0.0;
+    }
+
+    const int64_t n_total = (int64_t)(seconds * in_rate);
+    for (int64_t i = 0; i < n_total; i += n_block) {
+        simd_downmix2(in.data(), n_block, mono.data());
+        out.clear();
+        resampler_16k_process(rs, mono.data(), n_block, out);
+    }
+
+    return seconds;
+}
+
+// Run the VAD over every input with n_ctx contexts working in parallel, splitting n_threads between them
+static double bench_vad(const std::string & model_path, std::vector<bench_input> & inputs, int n_ctx, int n_threads) {
+    struct whisper_vad_context_params vparams = whisper_vad_default_context_params();
+    vparams.n_threads = std::max(1, n_threads / n_ctx);
+
+    std::vector<struct whisper_vad_context *> vctxs;
+    for (int i = 0; i < n_ctx; ++i) {
+        struct whisper_vad_context * vctx = vad_model_init(model_path, vparams);
+        if (vctx == nullptr) {
+            break;
+        }
+        vctxs.push_back(vctx);
+    }
+    if ((int)vctxs.size() != n_ctx) {
+        fprintf(stderr, "Failed to initialize %d VAD contexts using model from %s\n", n_ctx, model_path.c_str());
+        for (struct whisper_vad_context * vctx : vctxs) {
+            whisper_vad_free(vctx);
+        }
+        return 0.0;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](struct whisper_vad_context * vctx) {
+        for (size_t i = next++; i < inputs.size(); i = next++) {
+            const std::vector<float> & pcm = inputs[i].pcmf32;
+            if (!pcm.empty()) {
+                whisper_vad_detect_speech(vctx, pcm.data(), (int)pcm.size());
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < n_ctx; ++i) {
+        threads.emplace_back(worker, vctxs[i]);
+    }
+    worker(vctxs[0]);
+    for (std::thread & t : threads) {
+        t.join();
+    }
+
+    for (struct whisper_vad_context * vctx : vctxs) {
+        whisper_vad_free(vctx);
+    }
+
+    double seconds = 0.0;
+    for (const bench_input & input : inputs) {
+        seconds += input.seconds;
+    }
+    return seconds;
+}
+
+static std::vector<double> parse_lengths(const std::string & str) {
+    std::vector<double> lengths;
+    size_t pos = 0;
+    while (pos < str.size()) {
+        const size_t comma = str.find(',', pos);
+        const double v = atof(str.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos).c_str());
+        if (v > 0.0) {
+            lengths.push_back(v);
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return lengths;
+}
+
+int main(int argc, char ** argv) {
+    whisper_log_set(whisper_log_callback, nullptr);
+    av_log_set_level(AV_LOG_ERROR);
+
+    std::string model_path = vad_model_embedded() ? "" : "/home/daniel/archivos/ggml-silero-v6.2.0.bin";
+    std::vector<std::string> corpus_dirs;
+    std::vector<double> lengths = { 10.0, 60.0, 300.0 };
+    std::string work_dir;
+    bool synthetic = true;
+    bool keep = false;
+    int n_pool = 4;
+    int n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--model" && i + 1 < argc) {
+            model_path = argv[++i];
+        } else if (arg == "--corpus" && i + 1 < argc) {
+            corpus_dirs.push_back(argv[++i]);
+        } else if (arg == "--no-synthetic") {
+            synthetic = false;
+        } else if (arg == "--lengths" && i + 1 < argc) {
+            lengths = parse_lengths(argv[++i]);
+        } else if (arg == "--pool" && i + 1 < argc) {
+            n_pool = std::max(1, atoi(argv[++i]));
+        } else if ((arg == "--threads" || arg == "-t") && i + 1 < argc) {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--work-dir" && i + 1 < argc) {
+            work_dir = argv[++i];
+        } else if (arg == "--keep") {
+            keep = true;
+        } else {
+            fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+            fprintf(stderr, "\nOptions:\n");
+            fprintf(stderr, "  --model <file>     Path to Silero VAD model\n");
+            fprintf(stderr, "  --corpus <dir>     Also benchmark the files in <dir>, recursively (can be repeated)\n");
+            fprintf(stderr, "  --no-synthetic     Don't generate synthetic inputs\n");
+            fprintf(stderr, "  --lengths <s,...>  Lengths of the synthetic inputs in seconds (default: 10,60,300)\n");
+            fprintf(stderr, "  --pool <n>         Number of VAD contexts of the pooled mode (default: 4)\n");
+            fprintf(stderr, "  --threads, -t <n>  Total number of inference threads (default: cores)\n");
+            fprintf(stderr, "  --work-dir <dir>   Where the synthetic inputs and remux outputs are written (default: a new dir in /tmp)\n");
+            fprintf(stderr, "  --keep             Keep the synthetic inputs\n");
+            return 1;
+        }
+    }
+
+    if (const char * env_model = getenv("WHISPER_VAD_MODEL")) {
+        model_path = env_model;
+    }
+
+    bool own_work_dir = false;
+    if (work_dir.empty()) {
+        char tmpl[] = "/tmp/bench-detect-speech-XXXXXX";
+        if (mkdtemp(tmpl) == nullptr) {
+            fprintf(stderr, "Failed to create a work directory\n");
+            return 1;
+        }
+        work_dir = tmpl;
+        own_work_dir = true;
+    } else if (mkdir(work_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create work directory %s\n", work_dir.c_str());
+        return 1;
+    }
+
+    std::vector<bench_input> inputs;
+    if (synthetic) {
+        generate_synthetic(work_dir, lengths, inputs);
+    }
+    std::vector<std::string> synthetic_paths;
+    for (const bench_input & input : inputs) {
+        synthetic_paths.push_back(input.path);
+    }
+    for (const std::string & dir : corpus_dirs) {
+        collect_corpus(dir, inputs);
+    }
+    if (inputs.empty()) {
+        fprintf(stderr, "No inputs to benchmark\n");
+        return 1;
+    }
+
+    printf("%-10s %-8s %6s %12s %10s %10s %12s %18s\n", "stage", "mode", "files", "audio_s", "wall_s", "cpu_s", "x_realtime", "audio_h_per_cpu_h");
+
+    // full decode also finds the length of every input and keeps the samples for the VAD stages
+    bench_stage("decode", "full", inputs.size(), [&]() {
+        double seconds = 0.0;
+        for (bench_input & input : inputs) {
+            if (ffmpeg_decode_audio(input.path, input.pcmf32) != 0) {
+                fprintf(stderr, "Skipping %s, it can't be decoded\n", input.label.c_str());
+                input.pcmf32.clear();
+            }
+            input.seconds = (double)input.pcmf32.size() / WHISPER_SAMPLE_RATE;
+            seconds += input.seconds;
+        }
+        return seconds;
+    });
+
+    inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [](const bench_input & input) {
+        return input.pcmf32.empty();
+    }), inputs.end());
+
+    // what --probe decodes: a 30 s window at the head and one at the tail
+    bench_stage("decode", "probe", inputs.size(), [&]() {
+        std::vector<float> pcmf32;
+        double seconds = 0.0;
+        for (const bench_input & input : inputs) {
+            ffmpeg_audio_reader * reader = ffmpeg_reader_open(input.path);
+            if (reader == nullptr) {
+                continue;
+            }
+            const double window = std::min(30.0, input.seconds);
+            ffmpeg_reader_read_range(reader, 0.0, window, pcmf32);
+            ffmpeg_reader_read_range(reader, std::max(0.0, input.seconds - window), -1.0, pcmf32);
+            ffmpeg_reader_close(reader);
+            seconds += input.seconds;
+        }
+        return seconds;
+    });
+
+    // the formats miniaudio decodes itself, it converts to 16 kHz mono on its own
+    std::vector<const bench_input *> ma_inputs;
+    for (const bench_input & input : inputs) {
+        const std::string ext = extension_of(input.path);
+        if (ext == ".wav" || ext == ".flac" || ext == ".mp3") {
+            ma_inputs.push_back(&input);
+        }
+    }
+    bench_stage("miniaudio", "full", ma_inputs.size(), [&]() {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        double seconds = 0.0;
+        for (const bench_input * input : ma_inputs) {
+            if (read_audio_data(input->path, pcmf32, pcmf32s, false)) {
+                seconds += input->seconds;
+            }
+        }
+        return seconds;
+    });
+
+    const int swr_rates[] = { 8000, 22050, 44100, 48000 };
+    for (const int rate : swr_rates) {
+        char mode[16];
+        snprintf(mode, sizeof(mode), "%dk", rate / 1000);
+        bench_stage("swresample", mode, 1, [&]() {
+            return bench_swresample(rate, 600.0);
+        });
+        bench_stage("polyphase", mode, 1, [&]() {
+            return bench_polyphase(rate, 600.0);
+        });
+    }
+
+    bench_stage("vad", "single", inputs.size(), [&]() {
+        return bench_vad(model_path, inputs, 1, n_threads);
+    });
+
+    char pooled[16];
+    snprintf(pooled, sizeof(pooled), "pool%d", n_pool);
+    bench_stage("vad", pooled, inputs.size(), [&]() {
+        return bench_vad(model_path, inputs, n_pool, n_threads);
+    });
+
+    // stream copy everything but the first and last second
+    bench_stage("remux", "copy", inputs.size(), [&]() {
+        double seconds = 0.0;
+        for (const bench_input & input : inputs) {
+            const std::string out = work_dir + "/remux-output" + extension_of(input.path);
+            const double t1 = input.seconds > 2.0 ? input.seconds - 1.0 : -1.0;
+            if (ffmpeg_trim_copy(input.path, out, input.seconds > 2.0 ? 1.0 : 0.0, t1) == 0) {
+                seconds += input.seconds;
+            }
+            remove(out.c_str());
+        }
+        return seconds;
+    });
+
+    if (!keep) {
+        for (const std::string & path : synthetic_paths) {
+            remove(path.c_str());
+        }
+        if (own_work_dir) {
+            rmdir(work_dir.c_str());
+        }
+    }
+
+    return 0;
+}
@@ -1,5 +1,13 @@
 #include "whisper.h"
+#include "common.h"
 #include "common-whisper.h"
+#include "ffmpeg-transcode.h"
+#include "resample.h"
+#include "vad-cache.h"
+#include "speech-scan.h"
+#include "detect-speech.h"
+#include "vad-model.h"
+#include "serve.h"
 
 extern "C" {
 #include <libavutil/log.h>
@@ -9,8 +17,16 @@ extern "C" {
 #include <string>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <cerrno>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <map>
 
 void whisper_log_callback(ggml_log_level level, const char * text, void * user_data) {
     (void)user_data;
@@ -23,21 +39,831 @@ void whisper_log_callback(ggml_log_level level, const char * text, void * user_d
     }
 }
 
+enum output_format {
+    OUTPUT_TRIM, // trim the files, the default
+    OUTPUT_JSON, // only print the edges of every file as a JSON line
+    OUTPUT_CSV,  // only print the edges of every file as a CSV record
+};
+
+// Options shared by every file of a run
+struct detect_speech_params {
+    std::string output_file;
+    bool replace_input = true;
+    bool call_trim_start = true;
+    bool call_trim_end = true;
+    bool stream_decode = false;
+    bool probe_edges = false;
+    // decode only around the ranges the packet sizes show sound in, see detect_speech_hinted()
+    bool packet_hints = false;
+    bool per_channel = false;
+    output_format format = OUTPUT_TRIM;
+    // also report every speech segment, found by a VAD pass over the whole file
+    bool list_segments = false;
+    // print timings and throughput of every file on stderr
+    bool stats = false;
+    // directory of the VAD probability cache, empty to disable it
+    std::string cache_dir;
+    uint64_t model_hash = 0;
+    struct whisper_vad_params vad_params = whisper_vad_default_params();
+    float vad_overlap_seconds = 1.0f;
+    float window_min_seconds = 2.0f;
+    float window_max_seconds = 30.0f;
+    bool pregate = false;
+    float pregate_thold = 0.001f;
+    // files scanned in lockstep on one context, see process_batch()
+    int batch_files = 1;
+    // re-encode the packets a cut falls inside of when it is farther than
+    // cut_tolerance seconds from a packet boundary, see ffmpeg_trim_smart()
+    bool smart_cut = false;
+    float cut_tolerance = 0.01f;
+    // also cut the silences longer than drop_silence_seconds out of the middle of the
+    // file, found by a speech map of all of it, see detect_speech_map(). < 0 only trims
+    // the edges.
+    float drop_silence_seconds = -1.0f;
+    // contexts the speech maps of --drop-silence and --segments run on at once
+    int map_workers = 1;
+};
+
+enum detect_speech_result {
+    DETECT_SPEECH_TRIMMED,
+    DETECT_SPEECH_NO_SPEECH,
+    DETECT_SPEECH_NO_SILENCE,
+    DETECT_SPEECH_DETECTED, // speech found, analysis only
+    DETECT_SPEECH_FAILED,
+};
+
+static const char * detect_speech_result_str(detect_speech_result result) {
+    switch (result) {
+        case DETECT_SPEECH_TRIMMED:    return "trimmed";
+        case DETECT_SPEECH_NO_SPEECH:  return "no-speech";
+        case DETECT_SPEECH_NO_SILENCE: return "no-silence";
+        case DETECT_SPEECH_DETECTED:   return "speech";
+        case DETECT_SPEECH_FAILED:     return "failed";
+    }
+    return "unknown";
+}
+
+// Create an empty temporary file in the same directory as path and with the same
+// extension, so it can replace path with an atomic rename() and the muxer can pick
+// the output format from its name. The file gets the permissions of path.
+// Returns an empty string on error.
+static std::string make_temp_file_next_to(const std::string & path) {
+    const size_t slash = path.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    const std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    const size_t dot = base.find_last_of('.');
+    const std::string ext = dot == std::string::npos || dot == 0 ? "" : base.substr(dot);
+
+    std::string tmp = dir + ".detect-speech-XXXXXX" + ext;
+    int fd = mkstemps(&tmp[0], (int)ext.size());
+    if (fd == -1) {
+        return "";
+    }
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    close(fd);
+
+    return tmp;
+}
+
+// Copy of a "-" input, the trim needs to read it again after the scan. open() creates
+// it in $TMPDIR, finish() appends what is left on stdin and the file is removed when
+// it goes out of scope.
+struct stdin_spool {
+    std::string path;
+    int fd = -1;
+
+    stdin_spool() = default;
+    stdin_spool(const stdin_spool &) = delete;
+    stdin_spool & operator=(const stdin_spool &) = delete;
+
+    ~stdin_spool() {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (!path.empty()) {
+            remove(path.c_str());
+        }
+    }
+
+    bool open() {
+        const char * tmpdir = getenv("TMPDIR");
+        std::string tmp = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/detect-speech-stdin-XXXXXX";
+        fd = mkstemp(&tmp[0]);
+        if (fd == -1) {
+            return false;
+        }
+        path = tmp;
+        return true;
+    }
+
+    bool finish() {
+        std::vector<char> buf(256 * 1024);
+        bool ok = true;
+        while (ok) {
+            const ssize_t n = read(STDIN_FILENO, buf.data(), buf.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = n == 0;
+                break;
+            }
+            for (ssize_t off = 0; off < n; ) {
+                const ssize_t w = write(fd, buf.data() + off, n - off);
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w <= 0) {
+                    ok = false;
+                    break;
+                }
+                off += w;
+            }
+        }
+        ok = close(fd) == 0 && ok;
+        fd = -1;
+        return ok;
+    }
+};
+
+// What was found in one file
+struct file_report {
+    speech_edges edges;
+    std::vector<vad_segment> segments; // only with detect_speech_params::list_segments or drop_silence_seconds
+    std::vector<vad_segment> keep;     // the ranges concatenated by --drop-silence
+    run_stats stats;                   // only with detect_speech_params::stats
+    double wall = 0.0;
+    double cpu = 0.0;
+};
+
+static scan_params make_scan_params(const detect_speech_params & params, file_report & report) {
+    scan_params sp;
+    sp.vad_params = params.vad_params;
+    sp.overlap_samples = (int)(params.vad_overlap_seconds * WHISPER_SAMPLE_RATE);
+    sp.min_window_samples = (int)(params.window_min_seconds * WHISPER_SAMPLE_RATE);
+    sp.max_window_samples = (int)(params.window_max_seconds * WHISPER_SAMPLE_RATE);
+    sp.pregate = params.pregate;
+    sp.pregate_thold = params.pregate_thold;
+    sp.call_trim_start = params.call_trim_start;
+    sp.call_trim_end = params.call_trim_end;
+    sp.stop_at_onset = params.format == OUTPUT_TRIM;
+    sp.stats = params.stats ? &report.stats : nullptr;
+    return sp;
+}
+
+static detect_speech_result finish_file(
+        const std::string & audio_file,
+        const std::string & trim_source,
+        const detect_speech_params & params,
+        file_report & report);
+
+// What --drop-silence leaves of every silence it cuts, on either side
+static const float DROP_SILENCE_MARGIN_SECONDS = 0.25f;
+
+// a worker keeps up to an hour of samples per buffer for the next file, more than
+// that is given back once the file is done
+static const size_t MAX_KEPT_SAMPLES = (size_t)60*60*WHISPER_SAMPLE_RATE;
+
+// Detect the speech edges of one file and trim it, unless only the analysis is
+// wanted. The contexts are reused across files.
+static detect_speech_result process_file(
+        const std::string & audio_file,
+        const detect_speech_params & params,
+        vad_contexts & ctxs,
+        file_report & report) {
+    struct whisper_vad_context * vctx = ctxs.vctxs[0];
+    scan_params sp = make_scan_params(params, report);
+    sp.work_buffer = &ctxs.work;
+    sp.decoder = &ctxs.decoder;
+    speech_edges & edges = report.edges;
+
+    // stdin is scanned while it arrives, to trim it a copy is kept on the side.
+    // The whole-file modes read it from that copy once stdin is closed.
+    const bool from_stdin = audio_file == "-";
+    const bool speech_map = params.drop_silence_seconds >= 0.0f;
+    const bool stream_stdin = from_stdin && !params.per_channel && !params.list_segments && !speech_map;
+    // when only the onset is trimmed there is no need to decode past it, the whole-file
+    // scan becomes a decoder thread feeding the VAD that is stopped at the first speech
+    const bool onset_only = params.format == OUTPUT_TRIM && params.call_trim_start && !params.call_trim_end &&
+                            !params.per_channel && params.cache_dir.empty() && !speech_map;
+    sp.decode_thread = onset_only || stream_stdin;
+    stdin_spool spool;
+    std::string scan_file = audio_file;
+    if (from_stdin && params.format == OUTPUT_TRIM) {
+        if (!spool.open()) {
+            fprintf(stderr, "Error: Failed to create a temporary file for stdin\n");
+            return DETECT_SPEECH_FAILED;
+        }
+        if (!stream_stdin) {
+            if (!spool.finish()) {
+                fprintf(stderr, "Error: Failed to read stdin\n");
+                return DETECT_SPEECH_FAILED;
+            }
+            scan_file = spool.path;
+        }
+    }
+
+    bool cached = false;
+    if (!params.cache_dir.empty() && !from_stdin) {
+        if (!detect_speech_cached(audio_file, params.cache_dir, params.model_hash, vctx, sp, edges, report.segments)) {
+            return DETECT_SPEECH_FAILED;
+        }
+        cached = true;
+    }
+
+    bool probed = false;
+    if (!cached && params.packet_hints && !from_stdin) {
+        probed = detect_speech_hinted(audio_file, vctx, sp, edges);
+        if (!probed) {
+            fprintf(stderr, "Warning: Failed to read the packets of %s, scanning it as usual\n", audio_file.c_str());
+            edges = speech_edges();
+        }
+    }
+    if (!cached && !probed && params.probe_edges && !from_stdin) {
+        probed = detect_speech_probing(audio_file, vctx, sp, edges);
+        if (!probed) {
+            fprintf(stderr, "Warning: Failed to probe %s, decoding the whole file\n", audio_file.c_str());
+            edges = speech_edges();
+        }
+    }
+
+    if (cached || probed) {
+        // both edges are known already
+    } else if (params.stream_decode || stream_stdin || onset_only) {
+        if (!detect_speech_streaming(audio_file, vctx, sp, edges, spool.fd)) {
+            fprintf(stderr, "Error: Failed to read audio data from %s or to run the VAD on it\n", audio_file.c_str());
+            return DETECT_SPEECH_FAILED;
+        }
+        if (spool.fd != -1 && !spool.finish()) {
+            fprintf(stderr, "Error: Failed to read stdin\n");
+            return DETECT_SPEECH_FAILED;
+        }
+    } else if (params.per_channel) {
+        // Decode once into one buffer per channel
+        std::vector<std::vector<float>> & channels = ctxs.channels;
+        {
+            phase_timer timer(sp.stats ? &sp.stats->decode : nullptr);
+            if (!read_audio_channels(scan_file, channels)) {
+                fprintf(stderr, "Error: Failed to read audio data from %s\n", audio_file.c_str());
+                return DETECT_SPEECH_FAILED;
+            }
+            if (sp.stats) {
+                for (const std::vector<float> & channel : channels) {
+                    sp.stats->samples_decoded += channel.size();
+                }
+                sp.stats->resample_path = resample_last_path();
+            }
+        }
+
+        if (!detect_speech_per_channel(channels, ctxs, sp, edges)) {
+            return DETECT_SPEECH_FAILED;
+        }
+    } else {
+        // Load audio data
+        std::vector<float> & pcmf32 = ctxs.pcm;
+        if (!read_audio_timed(scan_file, pcmf32, sp.stats)) {
+            fprintf(stderr, "Error: Failed to read audio data from %s\n", audio_file.c_str());
+            return DETECT_SPEECH_FAILED;
+        }
+
+        if (speech_map || (params.list_segments && params.map_workers > 1)) {
+            if (!detect_speech_map(pcmf32.data(), pcmf32.size(), ctxs, params.map_workers, sp, edges, report.segments)) {
+                fprintf(stderr, "Error: Failed to run the VAD on %s\n", audio_file.c_str());
+                return DETECT_SPEECH_FAILED;
+            }
+        } else if (params.list_segments) {
+            if (!detect_speech_segments(pcmf32, vctx, sp, edges, report.segments)) {
+                fprintf(stderr, "Error: Failed to run the VAD on %s\n", audio_file.c_str());
+                return DETECT_SPEECH_FAILED;
+            }
+        } else if (!detect_speech_in_memory(pcmf32.data(), pcmf32.size(), vctx, sp, edges)) {
+            fprintf(stderr, "Error: Failed to run the VAD on %s\n", audio_file.c_str());
+            return DETECT_SPEECH_FAILED;
+        }
+    }
+
+    return finish_file(audio_file, from_stdin ? spool.path : audio_file, params, report);
+}
+
+// Report or trim a file whose edges are known. trim_source is where the input is read
+// from again, the spool of stdin or the file itself.
+static detect_speech_result finish_file(
+        const std::string & audio_file,
+        const std::string & trim_source,
+        const detect_speech_params & params,
+        file_report & report) {
+    const speech_edges & edges = report.edges;
+    run_stats * stats = params.stats ? &report.stats : nullptr;
+    const bool replace_input = params.replace_input;
+    std::string output_file = params.output_file;
+
+    if (params.format != OUTPUT_TRIM) {
+        return edges.speech_detected ? DETECT_SPEECH_DETECTED : DETECT_SPEECH_NO_SPEECH;
+    }
+
+    const float total_duration_seconds = edges.total_duration_seconds;
+    const float final_start_seconds = edges.final_start_seconds;
+    const float final_end_seconds = edges.final_end_seconds;
+
+    if (!edges.speech_detected) {
+        fprintf(stderr, "No speech detected. Not creating an output file.\n");
+        return DETECT_SPEECH_NO_SPEECH;
+    }
+
+    const bool to_eof = !edges.duration_known || final_end_seconds >= total_duration_seconds;
+
+    // with a single range left there is nothing to cut in the middle, it is an edge trim
+    std::vector<vad_segment> & keep = report.keep;
+    if (params.drop_silence_seconds >= 0.0f) {
+        speech_keep_ranges(report.segments, edges, params.drop_silence_seconds, DROP_SILENCE_MARGIN_SECONDS, keep);
+    }
+    if (keep.size() < 2) {
+        keep.clear();
+    } else if (to_eof) {
+        keep.back().t1 = -1.0f;
+    }
+
+    if (keep.empty() && !speech_edges_has_silence(edges)) {
+        fprintf(stderr, "No significant silence detected. Not creating an output file.\n");
+        return DETECT_SPEECH_NO_SILENCE;
+    }
+
+    if (replace_input) {
+        output_file = make_temp_file_next_to(audio_file);
+        if (output_file.empty()) {
+            fprintf(stderr, "Error: Failed to create temporary file.\n");
+            return DETECT_SPEECH_FAILED;
+        }
+    }
+
+    if (!keep.empty()) {
+        float kept = 0.0f;
+        for (const vad_segment & k : keep) {
+            kept += (k.t1 < 0.0f ? total_duration_seconds : k.t1) - k.t0;
+        }
+        fprintf(stderr, "Keeping %zu ranges of speech, %.3f of %.3f seconds.\n", keep.size(), kept, total_duration_seconds);
+    } else if (!to_eof) {
+        fprintf(stderr, "Detected speech from %.3f to %.3f (duration: %.3f).\n", 
+                final_start_seconds, final_end_seconds, final_end_seconds - final_start_seconds);
+    } else {
+        fprintf(stderr, "Detected speech from %.3f.\n", final_start_seconds);
+    }
+
+    fprintf(stderr, "Trimming audio and saving to %s...\n", output_file.c_str());
+    bool trimmed;
+    {
+        phase_timer timer(stats ? &stats->trim : nullptr);
+        trimmed = keep.empty() ? detect_speech_trim(trim_source, output_file, edges, params.smart_cut ? params.cut_tolerance : -1.0f)
+                               : detect_speech_concat(trim_source, output_file, keep);
+    }
+    if (!trimmed) {
+        fprintf(stderr, "Error: Failed to trim audio.\n");
+        if (replace_input) remove(output_file.c_str());
+        return DETECT_SPEECH_FAILED;
+    }
+
+    fprintf(stderr, "Successfully created %s.\n", output_file.c_str());
+
+    if (replace_input) {
+        int rename_err;
+        {
+            phase_timer timer(stats ? &stats->replace : nullptr);
+            rename_err = rename(output_file.c_str(), audio_file.c_str());
+        }
+        if (rename_err != 0) {
+            fprintf(stderr, "Error: Failed to replace original file %s with %s.\n", audio_file.c_str(), output_file.c_str());
+            remove(output_file.c_str());
+            return DETECT_SPEECH_FAILED;
+        }
+        fprintf(stderr, "Original file %s has been overwritten.\n", audio_file.c_str());
+    }
+
+    return DETECT_SPEECH_TRIMMED;
+}
+
+// Whether files can be scanned in batches: only the default whole-file scan is
+// batched, the other modes have their own decoding
+static bool batch_scannable(const detect_speech_params & params) {
+    const bool onset_only = params.format == OUTPUT_TRIM && params.call_trim_start && !params.call_trim_end;
+    return params.batch_files > 1 && !params.stream_decode && !params.probe_edges && !params.packet_hints && !params.per_channel &&
+           !params.list_segments && params.cache_dir.empty() && params.drop_silence_seconds < 0.0f && !onset_only;
+}
+
+// Decode a group of files, scan them together with detect_speech_in_memory_batch() on
+// one context and report or trim each of them. Files that can't be decoded fail on
+// their own. The wall and CPU time of the group are split evenly between its files.
+static void process_batch(
+        const std::vector<std::string> & audio_files,
+        const detect_speech_params & params,
+        vad_contexts & ctxs,
+        std::vector<file_report> & reports,
+        std::vector<detect_speech_result> & results) {
+    const double wall0 = wall_seconds();
+    const double cpu0 = cpu_seconds();
+
+    reports.assign(audio_files.size(), file_report());
+    results.assign(audio_files.size(), DETECT_SPEECH_FAILED);
+
+    std::vector<std::vector<float>> & pcms = ctxs.batch;
+    if (pcms.size() < audio_files.size()) {
+        pcms.resize(audio_files.size());
+    }
+    std::vector<const std::vector<float> *> batch_pcms;
+    std::vector<run_stats *> batch_stats;
+    std::vector<size_t> batch_files;
+    for (size_t f = 0; f < audio_files.size(); ++f) {
+        run_stats * stats = params.stats ? &reports[f].stats : nullptr;
+        if (!read_audio_timed(audio_files[f], pcms[f], stats)) {
+            fprintf(stderr, "Error: Failed to read audio data from %s\n", audio_files[f].c_str());
+            continue;
+        }
+        batch_pcms.push_back(&pcms[f]);
+        batch_stats.push_back(stats);
+        batch_files.push_back(f);
+    }
+
+    file_report unused;
+    const scan_params sp = make_scan_params(params, unused);
+    std::vector<speech_edges> edges;
+    if (!detect_speech_in_memory_batch(batch_pcms, ctxs.vctxs[0], sp, batch_stats, edges)) {
+        fprintf(stderr, "Error: Failed to run the VAD on a batch of %zu files\n", batch_pcms.size());
+        batch_files.clear();
+    }
+
+    for (size_t b = 0; b < batch_files.size(); ++b) {
+        const size_t f = batch_files[b];
+        reports[f].edges = edges[b];
+        results[f] = finish_file(audio_files[f], audio_files[f], params, reports[f]);
+    }
+
+    const double wall = (wall_seconds() - wall0) / audio_files.size();
+    const double cpu = (cpu_seconds() - cpu0) / audio_files.size();
+    for (file_report & report : reports) {
+        report.wall = wall;
+        report.cpu = cpu;
+    }
+}
+
+static std::string csv_escape(const std::string & str) {
+    if (str.find_first_of(",\"\r\n") == std::string::npos) {
+        return str;
+    }
+    std::string out = "\"";
+    for (const char c : str) {
+        if (c == '"') {
+            out += '"';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void print_csv_header(bool list_segments) {
+    printf("file,result,total_duration_seconds,final_start_seconds,final_end_seconds%s\n", list_segments ? ",segments" : "");
+}
+
+// The analysis of one file as a JSON object, without a trailing newline. The
+// duration and end are null when the scan stopped before the end of the input.
+static std::string report_json(
+        const std::string & audio_file,
+        detect_speech_result result,
+        const file_report & report,
+        bool list_segments) {
+    const speech_edges & edges = report.edges;
+    const bool found = result == DETECT_SPEECH_DETECTED || result == DETECT_SPEECH_TRIMMED;
+
+    std::string out = "{\"file\": \"" + json_escape(audio_file) + "\", \"result\": \"" + detect_speech_result_str(result) + "\"";
+    if (result != DETECT_SPEECH_FAILED) {
+        out += edges.duration_known ? string_printf(", \"total_duration_seconds\": %.3f", edges.total_duration_seconds)
+                                    : ", \"total_duration_seconds\": null";
+    }
+    if (found) {
+        out += string_printf(", \"final_start_seconds\": %.3f", edges.final_start_seconds);
+        out += edges.duration_known ? string_printf(", \"final_end_seconds\": %.3f", edges.final_end_seconds)
+                                    : ", \"final_end_seconds\": null";
+    }
+    if (result == DETECT_SPEECH_TRIMMED && !report.keep.empty()) {
+        out += ", \"kept\": [";
+        for (size_t i = 0; i < report.keep.size(); ++i) {
+            const vad_segment & k = report.keep[i];
+            out += string_printf("%s[%.3f, %.3f]", i > 0 ? ", " : "", k.t0, k.t1 < 0.0f ? edges.total_duration_seconds : k.t1);
+        }
+        out += "]";
+    }
+    if (list_segments && result != DETECT_SPEECH_FAILED) {
+        out += ", \"segments\": [";
+        for (size_t i = 0; i < report.segments.size(); ++i) {
+            out += string_printf("%s[%.3f, %.3f]", i > 0 ? ", " : "", report.segments[i].t0, report.segments[i].t1);
+        }
+        out += "]";
+    }
+    return out + "}";
+}
+
+// Print the analysis of one file on stdout. CSV segments are "t0:t1" pairs separated by ';'.
+// The CSV duration and end are empty where the JSON ones are null.
+static void print_report(
+        const std::string & audio_file,
+        detect_speech_result result,
+        const file_report & report,
+        const detect_speech_params & params) {
+    const speech_edges & edges = report.edges;
+    const bool found = result == DETECT_SPEECH_DETECTED;
+
+    if (params.format == OUTPUT_JSON) {
+        printf("%s\n", report_json(audio_file, result, report, params.list_segments).c_str());
+    } else {
+        printf("%s,%s,", csv_escape(audio_file).c_str(), detect_speech_result_str(result));
+        if (result != DETECT_SPEECH_FAILED && edges.duration_known) {
+            printf("%.3f", edges.total_duration_seconds);
+        }
+        if (found) {
+            printf(",%.3f,", edges.final_start_seconds);
+            if (edges.duration_known) {
+                printf("%.3f", edges.final_end_seconds);
+            }
+        } else {
+            printf(",,");
+        }
+        if (params.list_segments) {
+            printf(",");
+            for (size_t i = 0; i < report.segments.size(); ++i) {
+                printf("%s%.3f:%.3f", i > 0 ? ";" : "", report.segments[i].t0, report.segments[i].t1);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+// One JSON line on stderr with where the time for a file went.
+// rtf is the wall time over the audio duration, below 1 is faster than realtime.
+static void print_stats(const std::string & audio_file, detect_speech_result result, const file_report & report) {
+    const run_stats & st = report.stats;
+    const double audio_seconds = report.edges.total_duration_seconds;
+
+    fprintf(stderr, "{\"stats\": \"file\", \"file\": \"%s\", \"result\": \"%s\"", json_escape(audio_file).c_str(), detect_speech_result_str(result));
+    const std::pair<const char *, const phase_time *> phases[] = {
+        { "hash", &st.hash }, { "decode", &st.decode }, { "vad", &st.vad }, { "trim", &st.trim }, { "replace", &st.replace },
+    };
+    for (const auto & phase : phases) {
+        fprintf(stderr, ", \"%s_wall\": %.6f, \"%s_cpu\": %.6f", phase.first, phase.second->wall, phase.first, phase.second->cpu);
+    }
+    fprintf(stderr, ", \"total_wall\": %.6f, \"total_cpu\": %.6f", report.wall, report.cpu);
+    fprintf(stderr, ", \"samples_decoded\": %llu, \"samples_inferred\": %llu, \"samples_pregated\": %llu, \"vad_calls\": %d, \"resample\": \"%s\"",
+            (unsigned long long)st.samples_decoded, (unsigned long long)st.samples_inferred,
+            (unsigned long long)st.samples_pregated, st.vad_calls, json_escape(st.resample_path).c_str());
+    if (st.cache_hits + st.cache_misses > 0) {
+        fprintf(stderr, ", \"cache\": \"%s\"", st.cache_hits > 0 ? "hit" : "miss");
+    }
+    fprintf(stderr, ", \"audio_seconds\": %.3f, \"rtf\": %.6f, \"peak_rss_kb\": %ld}\n",
+            audio_seconds, audio_seconds > 0.0 ? report.wall / audio_seconds : 0.0, peak_rss_kb());
+}
+
+// Append the paths listed one per line in fname ("-" for stdin) to audio_files
+static bool read_file_list(const std::string & fname, std::vector<std::string> & audio_files) {
+    FILE * f = fname == "-" ? stdin : fopen(fname.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+
+    char * line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            audio_files.emplace_back(line, len);
+        }
+    }
+    free(line);
+
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    return true;
+}
+
+// One job of --serve: the file and its own copy of the parameters
+struct serve_request {
+    std::string file;
+    detect_speech_params params;
+};
+
+// Turn one line of NDJSON into a job and its id, a JSON value. The fields are
+// "file" (required), "id" (any scalar, echoed back), "output" to trim into a new file,
+// "replace": true to trim in place, "trim_start", "trim_end" and "smart_cut" booleans,
+// "drop_silence" in seconds (null to only trim the edges) and for analysis "segments": true.
+// Without "output" or "replace" the file is only analyzed. A field of the wrong type
+// fails the job.
+// There is no authentication: every client that can connect to the socket can read any
+// file the server can and, with "output" or "replace", write or rewrite any file the
+// server can write. Restrict who can connect with the permissions of the socket.
+static bool parse_serve_job(
+        const std::string & line,
+        const detect_speech_params & defaults,
+        std::string & id,
+        serve_request & job,
+        std::string & error) {
+    std::map<std::string, json_value> fields;
+    if (!parse_json_object(line, fields)) {
+        error = "expected a JSON object with scalar values";
+        return false;
+    }
+
+    // the id goes back out as it came, strings escaped again
+    auto it = fields.find("id");
+    if (it != fields.end()) {
+        id = it->second.is_string ? "\"" + json_escape(it->second.str) + "\"" : it->second.raw;
+    }
+
+    bool bad_flag = false;
+    auto flag = [&](const char * key, bool def) {
+        auto f = fields.find(key);
+        if (f == fields.end()) {
+            return def;
+        }
+        if (f->second.is_string || (f->second.raw != "true" && f->second.raw != "false")) {
+            if (!bad_flag) {
+                error = std::string("\"") + key + "\" must be true or false";
+            }
+            bad_flag = true;
+            return def;
+        }
+        return f->second.raw == "true";
+    };
+
+    it = fields.find("file");
+    if (it == fields.end() || !it->second.is_string || it->second.str.empty()) {
+        error = "missing \"file\"";
+        return false;
+    }
+    job.file = it->second.str;
+    if (job.file == "-") {
+        error = "stdin can't be used as a job file";
+        return false;
+    }
+
+    job.params = defaults;
+    detect_speech_params & p = job.params;
+    it = fields.find("output");
+    if (it != fields.end() && it->second.is_string && !it->second.str.empty()) {
+        p.format = OUTPUT_TRIM;
+        p.output_file = it->second.str;
+        p.replace_input = false;
+    } else if (flag("replace", false)) {
+        p.format = OUTPUT_TRIM;
+        p.replace_input = true;
+    } else {
+        p.format = OUTPUT_JSON;
+    }
+
+    p.smart_cut = flag("smart_cut", defaults.smart_cut);
+    it = fields.find("drop_silence");
+    if (it != fields.end()) {
+        const std::string & raw = it->second.raw;
+        if (it->second.is_string || raw == "true" || raw == "false") {
+            error = "\"drop_silence\" must be a number or null";
+            return false;
+        }
+        p.drop_silence_seconds = raw == "null" ? -1.0f : std::max(0.0f, (float)atof(raw.c_str()));
+    }
+    if (p.drop_silence_seconds >= 0.0f && p.format != OUTPUT_TRIM) {
+        error = "\"drop_silence\" needs \"output\" or \"replace\"";
+        return false;
+    }
+    if (p.drop_silence_seconds >= 0.0f && (p.stream_decode || p.probe_edges || p.packet_hints || p.per_channel)) {
+        error = "\"drop_silence\" can't be used with --stream, --probe, --packet-hints or --per-channel";
+        return false;
+    }
+
+    const bool trim_start = flag("trim_start", false);
+    const bool trim_end = flag("trim_end", false);
+    p.call_trim_start = trim_start || !trim_end;
+    p.call_trim_end = trim_end || !trim_start;
+
+    p.list_segments = flag("segments", p.format != OUTPUT_TRIM && defaults.list_segments);
+    if (bad_flag) {
+        return false;
+    }
+    if (p.list_segments && p.format == OUTPUT_TRIM) {
+        error = "\"segments\" is only for analysis";
+        return false;
+    }
+    if (p.list_segments && (p.stream_decode || p.probe_edges || p.packet_hints || p.per_channel)) {
+        error = "\"segments\" can't be used with --stream, --probe, --packet-hints or --per-channel";
+        return false;
+    }
+
+    return true;
+}
+
+// Run a job of --serve on the contexts of a worker. collect_stats is set when the
+// metrics need the stats, printing them is still up to the job.
+static serve_result run_serve_job(const std::string & id, const serve_request & job, vad_contexts & ctxs, bool collect_stats) {
+    detect_speech_params params = job.params;
+    params.stats = job.params.stats || collect_stats;
+
+    file_report report;
+    const double wall0 = wall_seconds();
+    const double cpu0 = cpu_seconds();
+    const detect_speech_result result = process_file(job.file, params, ctxs, report);
+    report.wall = wall_seconds() - wall0;
+    report.cpu = cpu_seconds() - cpu0;
+    ctxs.trim_buffers(MAX_KEPT_SAMPLES);
+
+    if (job.params.stats) {
+        print_stats(job.file, result, report);
+    }
+
+    serve_result out;
+    out.line = "{\"id\": " + id + ", " + report_json(job.file, result, report, params.list_segments).substr(1);
+    if (result == DETECT_SPEECH_TRIMMED) {
+        const std::string & output = params.replace_input ? job.file : params.output_file;
+        out.line.insert(out.line.size() - 1, ", \"output\": \"" + json_escape(output) + "\"");
+    }
+    out.result = result;
+    out.failed = result == DETECT_SPEECH_FAILED;
+    out.trimmed = result == DETECT_SPEECH_TRIMMED;
+    out.audio_seconds = report.edges.total_duration_seconds;
+    out.duration_known = report.edges.duration_known;
+    out.wall = report.wall;
+    out.stats = report.stats;
+    return out;
+}
+
+// --serve: keep the VAD contexts warm and run the jobs read from stdin, or from every
+// client of the Unix socket at socket_path, with one worker per context, see
+// serve_run(). With metrics_addr the stats of every job are collected and served to
+// Prometheus on that TCP address.
+static int run_server(
+        const detect_speech_params & defaults,
+        std::vector<vad_contexts> & ctxs,
+        const std::string & socket_path,
+        int queue_capacity,
+        const std::string & metrics_addr) {
+    serve_config config;
+    config.socket_path = socket_path;
+    config.n_workers = ctxs.size();
+    config.queue_capacity = queue_capacity;
+    config.metrics_addr = metrics_addr;
+    for (int r = 0; r <= DETECT_SPEECH_FAILED; ++r) {
+        config.result_names.push_back(detect_speech_result_str((detect_speech_result)r));
+    }
+
+    return serve_run(config, [&](const std::string & line, serve_job & job, std::string & error) {
+        serve_request request;
+        if (!parse_serve_job(line, defaults, job.id, request, error)) {
+            return false;
+        }
+        const std::string id = job.id;
+        job.run = [&ctxs, id, request](size_t worker, bool collect_stats) {
+            return run_serve_job(id, request, ctxs[worker], collect_stats);
+        };
+        return true;
+    });
+}
+
 int main(int argc, char ** argv) {
     whisper_log_set(whisper_log_callback, nullptr);
     av_log_set_level(AV_LOG_ERROR);
 
-    std::string audio_file = "";
-    std::string output_file = "";
-    std::string model_path = "/home/daniel/archivos/ggml-silero-v6.2.0.bin";
+    std::vector<std::string> audio_files;
+    // a binary with an embedded model uses it unless told otherwise
+    std::string model_path = vad_model_embedded() ? "" : "/home/daniel/archivos/ggml-silero-v6.2.0.bin";
     bool trim_start_requested = false;
     bool trim_end_requested = false;
     bool output_specified = false;
+    int n_jobs = 1;
+    int n_threads = 0;
+    int use_gpu = -1; // -1 keeps the whisper default
+    int gpu_device = -1;
+    bool serve = false;
+    std::string socket_path;
+    int queue_capacity = 0;
+    std::string metrics_addr;
+    int map_workers = 0; // 0 for the cores of a job
+
+    detect_speech_params params;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
-        if (arg == "--output" && i + 1 < argc) {
-            output_file = argv[++i];
+        if ((arg == "--output" || arg == "-o") && i + 1 < argc) {
+            params.output_file = argv[++i];
             output_specified = true;
         } else if (arg == "--trim-start" || arg == "-s") {
             trim_start_requested = true;
@@ -45,167 +871,374 @@ int main(int argc, char ** argv) {
             trim_end_requested = true;
         } else if (arg == "--replace" || arg == "-i") {
             output_specified = false;
+        } else if (arg == "--stream") {
+            params.stream_decode = true;
+        } else if (arg == "--probe") {
+            params.probe_edges = true;
+        } else if (arg == "--packet-hints") {
+            params.packet_hints = true;
+        } else if (arg == "--per-channel") {
+            params.per_channel = true;
+        } else if (arg == "--analyze" && i + 1 < argc) {
+            const std::string format = argv[++i];
+            if (format == "json") {
+                params.format = OUTPUT_JSON;
+            } else if (format == "csv") {
+                params.format = OUTPUT_CSV;
+            } else {
+                fprintf(stderr, "Error: Unknown analysis format %s, expected json or csv\n", format.c_str());
+                return 1;
+            }
+        } else if (arg == "--segments") {
+            params.list_segments = true;
+        } else if (arg == "--stats") {
+            params.stats = true;
         } else if (arg == "--model" && i + 1 < argc) {
             model_path = argv[++i];
-        } else if (arg[0] != '-') {
-            if (audio_file.empty()) {
-                audio_file = arg;
-            } else {
-                fprintf(stderr, "Error: Multiple audio files specified: %s and %s\n", audio_file.c_str(), arg.c_str());
+        } else if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+            n_jobs = std::max(1, atoi(argv[++i]));
+        } else if ((arg == "--threads" || arg == "-t") && i + 1 < argc) {
+            n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--gpu") {
+            use_gpu = 1;
+        } else if (arg == "--no-gpu") {
+            use_gpu = 0;
+        } else if (arg == "--gpu-device" && i + 1 < argc) {
+            gpu_device = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--batch" && i + 1 < argc) {
+            params.batch_files = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--vad-overlap" && i + 1 < argc) {
+            params.vad_overlap_seconds = std::max(0.0f, (float)atof(argv[++i]));
+        } else if (arg == "--window-min" && i + 1 < argc) {
+            params.window_min_seconds = (float)atof(argv[++i]);
+        } else if (arg == "--window-max" && i + 1 < argc) {
+            params.window_max_seconds = (float)atof(argv[++i]);
+        } else if (arg == "--vad-thold" && i + 1 < argc) {
+            params.vad_params.threshold = (float)atof(argv[++i]);
+        } else if (arg == "--min-speech-ms" && i + 1 < argc) {
+            params.vad_params.min_speech_duration_ms = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--min-silence-ms" && i + 1 < argc) {
+            params.vad_params.min_silence_duration_ms = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--speech-pad-ms" && i + 1 < argc) {
+            params.vad_params.speech_pad_ms = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            params.cache_dir = argv[++i];
+        } else if (arg == "--pregate") {
+            params.pregate = true;
+        } else if (arg == "--pregate-thold" && i + 1 < argc) {
+            params.pregate = true;
+            params.pregate_thold = (float)atof(argv[++i]);
+        } else if (arg == "--smart-cut") {
+            params.smart_cut = true;
+        } else if (arg == "--cut-tolerance" && i + 1 < argc) {
+            params.smart_cut = true;
+            params.cut_tolerance = std::max(0.0f, (float)atof(argv[++i]));
+        } else if (arg == "--drop-silence" && i + 1 < argc) {
+            params.drop_silence_seconds = std::max(0.0f, (float)atof(argv[++i]));
+        } else if (arg == "--map-workers" && i + 1 < argc) {
+            map_workers = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--socket" && i + 1 < argc) {
+            serve = true;
+            socket_path = argv[++i];
+        } else if (arg == "--queue" && i + 1 < argc) {
+            queue_capacity = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_addr = argv[++i];
+        } else if (arg == "--files-from" && i + 1 < argc) {
+            const std::string list = argv[++i];
+            if (!read_file_list(list, audio_files)) {
+                fprintf(stderr, "Error: Failed to read file list %s\n", list.c_str());
                 return 1;
             }
+        } else if (arg == "-" || arg[0] != '-') {
+            audio_files.push_back(arg);
         } else {
             fprintf(stderr, "Error: Unknown option %s\n", arg.c_str());
             return 1;
         }
     }
 
-    if (audio_file.empty()) {
-        fprintf(stderr, "Usage: %s <audio_file> [options]\n", argv[0]);
+    if (audio_files.empty() && !serve) {
+        fprintf(stderr, "Usage: %s <audio_file>... [options]\n", argv[0]);
+        fprintf(stderr, "       %s - --output <file> [options], to read the audio from stdin\n", argv[0]);
+        fprintf(stderr, "       %s --serve [--socket <path>] [options]\n", argv[0]);
         fprintf(stderr, "\nOptions:\n");
-        fprintf(stderr, "  --output <file>    Output file path (default: overwrites input file)\n");
-        fprintf(stderr, "  --trim-start, -s   Trim only the silence at the beginning\n");
+        fprintf(stderr, "  --output, -o <file> Output file path (default: overwrites input file)\n");
+        fprintf(stderr, "  --trim-start, -s   Trim only the silence at the beginning, decoding stops at the first speech\n");
         fprintf(stderr, "  --trim-end, -e     Trim only the silence at the end\n");
-        fprintf(stderr, "  --model <file>     Path to Silero VAD model\n");
+        fprintf(stderr, "  --model <file>     Path to Silero VAD model, mapped shared and read-only (default: the embedded model if built with one)\n");
+        fprintf(stderr, "  --stream           Decode and scan in chunks, using fixed memory for any input length\n");
+        fprintf(stderr, "  --probe            Seek and decode only windows at the head and tail of the file\n");
+        fprintf(stderr, "  --packet-hints     Find the audible ranges from the packet sizes (Opus DTX, VBR silence) and decode only those\n");
+        fprintf(stderr, "  --analyze <fmt>    Only print the edges of every file on stdout as json lines or csv, nothing is trimmed\n");
+        fprintf(stderr, "  --segments         With --analyze, also print every speech segment (runs the VAD over the whole file)\n");
+        fprintf(stderr, "  --stats            Print the time spent in every phase, sample counts and peak RSS of every file as json on stderr\n");
+        fprintf(stderr, "  --per-channel      Run the VAD on every channel concurrently and keep the speech of all of them\n");
+        fprintf(stderr, "  --vad-overlap <s>  Seconds of audio before each window fed to the VAD as context (default: 1.0)\n");
+        fprintf(stderr, "  --window-min <s>   Length of the first VAD window of the edge search (default: 2)\n");
+        fprintf(stderr, "  --window-max <s>   Cap for the VAD window, which doubles while no speech is found (default: 30)\n");
+        fprintf(stderr, "  --vad-thold <p>    Speech probability threshold (default: %.2f)\n", params.vad_params.threshold);
+        fprintf(stderr, "  --min-speech-ms <n> Shortest speech segment kept (default: %d)\n", params.vad_params.min_speech_duration_ms);
+        fprintf(stderr, "  --min-silence-ms <n> Shortest silence that ends a segment (default: %d)\n", params.vad_params.min_silence_duration_ms);
+        fprintf(stderr, "  --speech-pad-ms <n> Padding the VAD adds around each segment (default: %d)\n", params.vad_params.speech_pad_ms);
+        fprintf(stderr, "  --cache-dir <dir>  Cache the VAD probabilities of whole files in <dir>, reruns only apply the thresholds\n");
+        fprintf(stderr, "  --pregate          Skip the VAD on audio that is obviously silent by energy and zero-crossing rate\n");
+        fprintf(stderr, "  --pregate-thold <rms> RMS below which a frame is silent, implies --pregate (default: 0.001)\n");
+        fprintf(stderr, "  --smart-cut        Cut on the exact sample, re-encoding only the packets a cut falls inside of\n");
+        fprintf(stderr, "                     (Opus and AAC drop the samples outside of the cut instead)\n");
+        fprintf(stderr, "  --cut-tolerance <s> Seconds from a packet boundary a cut may move to keep the copy, implies --smart-cut (default: 0.01)\n");
+        fprintf(stderr, "  --drop-silence <s> Also cut the silences longer than <s> seconds out of the middle, from a VAD pass over the whole file\n");
+        fprintf(stderr, "  --map-workers <n>  VAD contexts the pass over the whole file of --drop-silence and --segments runs on (default: cores / jobs)\n");
+        fprintf(stderr, "  --files-from <file> Read the audio files to process from <file>, one per line (- for stdin)\n");
+        fprintf(stderr, "  --jobs, -j <n>     Number of files processed in parallel, each with its own VAD context (default: 1)\n");
+        fprintf(stderr, "  --threads, -t <n>  Number of threads per VAD context (default: cores / jobs)\n");
+        fprintf(stderr, "  --gpu, --no-gpu    Run the VAD on the GPU backend whisper was built with, or on the CPU\n");
+        fprintf(stderr, "  --gpu-device <n>   GPU device of the VAD contexts (default: 0)\n");
+        fprintf(stderr, "  --batch <n>        Decode <n> files at a time and scan them in lockstep on one VAD context, same edges as without\n");
+        fprintf(stderr, "  --serve            Keep running and process JSON jobs read from stdin, one per line\n");
+        fprintf(stderr, "  --socket <path>    With --serve, read the jobs from clients of a Unix socket at <path> instead\n");
+        fprintf(stderr, "                     No authentication: any client that can connect can rewrite any file the server can write\n");
+        fprintf(stderr, "  --queue <n>        With --serve, jobs waiting for a worker before clients are held back (default: 2 * jobs)\n");
+        fprintf(stderr, "  --metrics <[host:]port> With --serve, export Prometheus metrics of the jobs on GET /metrics at that TCP address\n");
         return 1;
     }
 
-    if (const char* env_model = getenv("WHISPER_VAD_MODEL")) {
-        model_path = env_model;
+    if (serve && (!audio_files.empty() || output_specified || params.format != OUTPUT_TRIM)) {
+        fprintf(stderr, "Error: --serve takes the files, outputs and formats from its jobs\n");
+        return 1;
     }
 
-    bool replace_input = !output_specified;
+    if (params.drop_silence_seconds >= 0.0f && params.format != OUTPUT_TRIM) {
+        fprintf(stderr, "Error: --drop-silence can't be used with --analyze\n");
+        return 1;
+    }
 
-    if (replace_input) {
-        char tmp_template[] = "/tmp/detect-speech-XXXXXX.opus";
-        int fd = mkstemps(tmp_template, 5);
-        if (fd == -1) {
-            fprintf(stderr, "Error: Failed to create temporary file.\n");
-            return 1;
-        }
-        close(fd);
-        output_file = tmp_template;
+    if (params.drop_silence_seconds >= 0.0f && (params.stream_decode || params.probe_edges || params.packet_hints || params.per_channel)) {
+        fprintf(stderr, "Error: --drop-silence can't be used with --stream, --probe, --packet-hints or --per-channel\n");
+        return 1;
     }
 
-    bool call_trim_start = trim_start_requested || (!trim_start_requested && !trim_end_requested);
-    bool call_trim_end = trim_end_requested || (!trim_start_requested && !trim_end_requested);
+    if (params.drop_silence_seconds >= 0.0f && params.smart_cut) {
+        fprintf(stderr, "Warning: the silences cut by --drop-silence are cut on packets, --smart-cut only applies to plain edge trims\n");
+    }
 
-    // Load audio data
-    std::vector<float> pcmf32;
-    std::vector<std::vector<float>> pcmf32s;
-    if (!read_audio_data(audio_file, pcmf32, pcmf32s, false)) {
-        fprintf(stderr, "Error: Failed to read audio data from %s\n", audio_file.c_str());
+    if (!metrics_addr.empty() && !serve) {
+        fprintf(stderr, "Error: --metrics is only for --serve\n");
         return 1;
     }
 
-    // Initialize VAD context
-    struct whisper_vad_context_params vparams = whisper_vad_default_context_params();
-    
-    struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(model_path.c_str(), vparams);
-    if (vctx == nullptr) {
-        fprintf(stderr, "Error: Failed to initialize VAD context using model from %s\n", model_path.c_str());
+    if (params.stream_decode && params.probe_edges) {
+        fprintf(stderr, "Error: --stream and --probe can't be used together\n");
         return 1;
     }
 
-    // Detect speech segments
-    struct whisper_vad_params vad_params = whisper_vad_default_params();
+    if (params.per_channel && (params.stream_decode || params.probe_edges)) {
+        fprintf(stderr, "Error: --per-channel can't be used with --stream or --probe\n");
+        return 1;
+    }
 
-    float total_duration_seconds = (float)pcmf32.size() / (float)WHISPER_SAMPLE_RATE;
-    float final_start_seconds = 0.0f;
-    float final_end_seconds = total_duration_seconds;
-    bool speech_detected = false;
-
-    // Process in 30s chunks to find start and end
-    const int chunk_size_samples = 30 * WHISPER_SAMPLE_RATE;
-
-    if (call_trim_start) {
-        for (int i = 0; i < (int)pcmf32.size(); i += chunk_size_samples) {
-            int n_samples = std::min(chunk_size_samples, (int)pcmf32.size() - i);
-            struct whisper_vad_segments * segments = whisper_vad_segments_from_samples(vctx, vad_params, pcmf32.data() + i, n_samples);
-            if (segments) {
-                if (whisper_vad_segments_n_segments(segments) > 0) {
-                    final_start_seconds = (float)i / (float)WHISPER_SAMPLE_RATE + whisper_vad_segments_get_segment_t0(segments, 0) * 0.01f;
-                    final_start_seconds = std::max(0.0f, final_start_seconds - 0.5f);
-                    speech_detected = true;
-                    whisper_vad_free_segments(segments);
-                    break;
-                }
-                whisper_vad_free_segments(segments);
-            }
+    if (params.packet_hints && (params.stream_decode || params.per_channel || params.list_segments || !params.cache_dir.empty())) {
+        fprintf(stderr, "Error: --packet-hints can't be used with --stream, --per-channel, --segments or --cache-dir\n");
+        return 1;
+    }
+
+    if (params.list_segments && params.format == OUTPUT_TRIM) {
+        params.format = OUTPUT_JSON;
+    }
+
+    if (params.list_segments && (params.stream_decode || params.probe_edges || params.per_channel)) {
+        fprintf(stderr, "Error: --segments can't be used with --stream, --probe or --per-channel\n");
+        return 1;
+    }
+
+    if (!params.cache_dir.empty() && (params.stream_decode || params.probe_edges || params.per_channel)) {
+        fprintf(stderr, "Error: --cache-dir can't be used with --stream, --probe or --per-channel\n");
+        return 1;
+    }
+
+    if (params.window_min_seconds < 0.1f || params.window_max_seconds < params.window_min_seconds) {
+        fprintf(stderr, "Error: Invalid VAD window sizes, expected 0.1 <= --window-min <= --window-max\n");
+        return 1;
+    }
+
+    if (output_specified && audio_files.size() > 1) {
+        fprintf(stderr, "Error: --output can only be used with a single audio file\n");
+        return 1;
+    }
+
+    if (std::find(audio_files.begin(), audio_files.end(), "-") != audio_files.end()) {
+        if (audio_files.size() > 1) {
+            fprintf(stderr, "Error: stdin (-) can only be used as the only audio file\n");
+            return 1;
+        }
+        if (params.format == OUTPUT_TRIM && !output_specified) {
+            fprintf(stderr, "Error: stdin (-) can't be replaced, use --output\n");
+            return 1;
         }
     }
 
-    if (call_trim_end && (speech_detected || !call_trim_start)) {
-        bool end_found = false;
-        for (int i = (int)pcmf32.size(); i > 0; i -= chunk_size_samples) {
-            int start_sample = std::max(0, i - chunk_size_samples);
-            int n_samples = i - start_sample;
-            struct whisper_vad_segments * segments = whisper_vad_segments_from_samples(vctx, vad_params, pcmf32.data() + start_sample, n_samples);
-            if (segments) {
-                int n_seg = whisper_vad_segments_n_segments(segments);
-                if (n_seg > 0) {
-                    final_end_seconds = (float)start_sample / (float)WHISPER_SAMPLE_RATE + whisper_vad_segments_get_segment_t1(segments, n_seg - 1) * 0.01f;
-                    final_end_seconds = std::min(total_duration_seconds, final_end_seconds + 0.5f);
-                    speech_detected = true;
-                    end_found = true;
-                    whisper_vad_free_segments(segments);
-                    break;
-                }
-                whisper_vad_free_segments(segments);
-            }
-            if (call_trim_start && start_sample <= (int)(final_start_seconds * WHISPER_SAMPLE_RATE)) {
-                break;
-            }
+    if (const char* env_model = getenv("WHISPER_VAD_MODEL")) {
+        model_path = env_model;
+    }
+
+    if (!params.cache_dir.empty()) {
+        if (mkdir(params.cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Failed to create cache directory %s\n", params.cache_dir.c_str());
+            return 1;
+        }
+        // entries are only valid for the model that produced them
+        if (!vad_model_hash(model_path, params.model_hash)) {
+            fprintf(stderr, "Error: Failed to read VAD model %s\n", model_path.c_str());
+            return 1;
         }
     }
 
-    whisper_vad_free(vctx);
+    params.replace_input = !output_specified;
+    params.call_trim_start = trim_start_requested || (!trim_start_requested && !trim_end_requested);
+    params.call_trim_end = trim_end_requested || (!trim_start_requested && !trim_end_requested);
 
-    if (!speech_detected) {
-        fprintf(stderr, "No speech detected. Not creating an output file.\n");
-        return 0;
+    if (!serve) {
+        n_jobs = std::min(n_jobs, (int)audio_files.size());
     }
 
-    if (final_start_seconds <= 0.01f && final_end_seconds >= total_duration_seconds - 0.01f) {
-        fprintf(stderr, "No significant silence detected. Not creating an output file.\n");
-        if (replace_input) {
-            remove(output_file.c_str());
+    if (params.batch_files > 1 && (serve || !batch_scannable(params))) {
+        fprintf(stderr, "Warning: --batch only applies to the whole-file scan without --serve, -s alone or other scan modes\n");
+    }
+
+    // Initialize one VAD context per worker, once for all files
+    struct whisper_vad_context_params vparams = whisper_vad_default_context_params();
+    if (n_threads > 0) {
+        vparams.n_threads = n_threads;
+    } else if (n_jobs > 1) {
+        // split the cores between the workers instead of oversubscribing them
+        vparams.n_threads = std::max(1, (int)std::thread::hardware_concurrency() / n_jobs);
+    }
+    // the passes over whole files are split between contexts of their own, each of a
+    // single thread unless told otherwise, when they share the cores of a job
+    if (map_workers == 0 && (params.drop_silence_seconds >= 0.0f || params.list_segments) && params.cache_dir.empty()) {
+        const int cores = std::max(1, (int)std::thread::hardware_concurrency() / n_jobs);
+        map_workers = std::max(1, cores / std::max(1, n_threads));
+        if (n_threads == 0 && map_workers > 1) {
+            vparams.n_threads = 1;
         }
-        return 0;
+    }
+    params.map_workers = std::max(1, map_workers);
+    if (use_gpu >= 0) {
+        vparams.use_gpu = use_gpu == 1;
+    }
+    if (gpu_device >= 0) {
+        vparams.gpu_device = gpu_device;
     }
 
-    // FFmpeg command construction
-    // We use -ss before -i for faster seeking if it's a long file
-    std::string trim_cmd = "ffmpeg -hide_banner -loglevel error -nostdin -y -ss " + std::to_string(final_start_seconds) + " -i \"" + audio_file + "\"";
-    
-    if (final_end_seconds < total_duration_seconds) {
-        trim_cmd += " -to " + std::to_string(final_end_seconds - final_start_seconds);
-        fprintf(stderr, "Detected speech from %.3f to %.3f (duration: %.3f).\n", 
-                final_start_seconds, final_end_seconds, final_end_seconds - final_start_seconds);
-    } else {
-        fprintf(stderr, "Detected speech from %.3f.\n", final_start_seconds);
+    phase_time init_time;
+    std::vector<vad_contexts> ctxs(n_jobs);
+    {
+        phase_timer timer(&init_time);
+        for (vad_contexts & c : ctxs) {
+            c.model_path = model_path;
+            c.vparams = vparams;
+            if (c.get(0) == nullptr) {
+                return 1;
+            }
+        }
+    }
+    if (params.stats) {
+        fprintf(stderr, "{\"stats\": \"vad_init\", \"contexts\": %d, \"wall\": %.6f, \"cpu\": %.6f, \"peak_rss_kb\": %ld}\n",
+                n_jobs, init_time.wall, init_time.cpu, peak_rss_kb());
     }
 
-    trim_cmd += " -c copy \"" + output_file + "\"";
+    if (serve) {
+        return run_server(params, ctxs, socket_path, queue_capacity > 0 ? queue_capacity : 2 * n_jobs, metrics_addr);
+    }
 
-    fprintf(stderr, "Trimming audio and saving to %s...\n", output_file.c_str());
-    if (system(trim_cmd.c_str()) != 0) {
-        fprintf(stderr, "Error: Failed to trim audio using ffmpeg.\n");
-        if (replace_input) remove(output_file.c_str());
-        return 1;
+    const bool batch = audio_files.size() > 1;
+    const bool analyze = params.format != OUTPUT_TRIM;
+    int n_results[DETECT_SPEECH_FAILED + 1] = {};
+
+    if (params.format == OUTPUT_CSV) {
+        print_csv_header(params.list_segments);
     }
 
-    fprintf(stderr, "Successfully created %s.\n", output_file.c_str());
+    // Every worker pulls the next file as soon as it is done with the previous one,
+    // so decoding, inference and trimming of different files overlap
+    std::atomic<size_t> next_file(0);
+    std::mutex results_mutex;
 
-    if (replace_input) {
-        std::string mv_cmd = "mv \"" + output_file + "\" \"" + audio_file + "\"";
-        if (system(mv_cmd.c_str()) != 0) {
-            fprintf(stderr, "Error: Failed to replace original file %s with %s.\n", audio_file.c_str(), output_file.c_str());
-            return 1;
+    auto record = [&](const std::string & audio_file, detect_speech_result result, const file_report & report) {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        n_results[result]++;
+        if (params.stats) {
+            print_stats(audio_file, result, report);
         }
-        fprintf(stderr, "Original file %s has been overwritten.\n", audio_file.c_str());
+        if (analyze) {
+            print_report(audio_file, result, report, params);
+            fflush(stdout);
+        } else if (batch) {
+            printf("%s\t%s\n", detect_speech_result_str(result), audio_file.c_str());
+            fflush(stdout);
+        }
+    };
+
+    // with --batch every worker takes that many files at a time and scans them together
+    const size_t files_per_take = batch_scannable(params) ? (size_t)params.batch_files : 1;
+
+    auto worker = [&](vad_contexts & wctxs) {
+        while (true) {
+            const size_t i = next_file.fetch_add(files_per_take);
+            if (i >= audio_files.size()) {
+                break;
+            }
+            if (files_per_take > 1) {
+                const std::vector<std::string> group(audio_files.begin() + i,
+                                                     audio_files.begin() + std::min(audio_files.size(), i + files_per_take));
+                if (batch) {
+                    fprintf(stderr, "Processing %zu files from %s\n", group.size(), group[0].c_str());
+                }
+                std::vector<file_report> reports;
+                std::vector<detect_speech_result> results;
+                process_batch(group, params, wctxs, reports, results);
+                for (size_t f = 0; f < group.size(); ++f) {
+                    record(group[f], results[f], reports[f]);
+                }
+                wctxs.trim_buffers(MAX_KEPT_SAMPLES);
+                continue;
+            }
+
+            const std::string & audio_file = audio_files[i];
+            if (batch) {
+                fprintf(stderr, "Processing %s\n", audio_file.c_str());
+            }
+            file_report report;
+            const double wall0 = wall_seconds();
+            const double cpu0 = cpu_seconds();
+            const detect_speech_result result = process_file(audio_file, params, wctxs, report);
+            report.wall = wall_seconds() - wall0;
+            report.cpu = cpu_seconds() - cpu0;
+            record(audio_file, result, report);
+            wctxs.trim_buffers(MAX_KEPT_SAMPLES);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_jobs; ++i) {
+        workers.emplace_back(worker, std::ref(ctxs[i]));
+    }
+    worker(ctxs[0]);
+    for (std::thread & t : workers) {
+        t.join();
     }
 
-    return 0;
-}
+    if (batch && analyze) {
+        fprintf(stderr, "Analyzed %zu files: %d with speech, %d without speech, %d failed\n",
+                audio_files.size(), n_results[DETECT_SPEECH_DETECTED], n_results[DETECT_SPEECH_NO_SPEECH],
+                n_results[DETECT_SPEECH_FAILED]);
+    } else if (batch) {
+        fprintf(stderr, "Processed %zu files: %d trimmed, %d without speech, %d without silence, %d failed\n",
+                audio_files.size(), n_results[DETECT_SPEECH_TRIMMED], n_results[DETECT_SPEECH_NO_SPEECH],
+                n_results[DETECT_SPEECH_NO_SILENCE], n_results[DETECT_SPEECH_FAILED]);
+    }
 
+    return n_results[DETECT_SPEECH_FAILED] > 0 ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// Vectorized kernels for long-form audio processing
+// The implementation is picked at runtime: AVX2 on x86-64 CPUs that have it, NEON on ARM64,
+// plain C++ everywhere else
+
+#include <cstddef>
+
+// sum of |x[i]|
+float simd_sum_abs(const float * x, size_t n);
+
+// sum of x[i]^2
+float simd_sum_sq(const float * x, size_t n);
+
+// number of sign changes between consecutive samples
+size_t simd_zero_crossings(const float * x, size_t n);
+
+// RMS of each n_frame long frame of x, the last frame may be shorter
+// rms must have room for (n + n_frame - 1) / n_frame values
+void simd_frame_rms(const float * x, size_t n, size_t n_frame, float * rms);
+
+// split n_frames interleaved stereo frames into the left and right channels
+void simd_deinterleave2(const float * x, size_t n_frames, float * left, float * right);
+
+// mix n_frames interleaved stereo frames down to mono as left + right
+void simd_downmix2(const float * x, size_t n_frames, float * mono);
+
+// sum of a[i]*b[i]
+float simd_dot(const float * a, const float * b, size_t n);
+
+// name of the selected implementation: "avx2", "neon" or "scalar"
+const char * simd_backend();
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
 
 // Read WAV audio file and store the PCM data into pcmf32
 // fname can be a buffer of WAV data instead of a filename
@@ -14,6 +15,23 @@ bool read_audio_data(
         std::vector<std::vector<float>> & pcmf32s,
         bool stereo);
 
+// Decode the audio file as mono 16 kHz PCM and pass it to cb in chunks of n_chunk samples
+// (the last chunk may be shorter). cb returns false to stop decoding early.
+// Memory use is bounded by the chunk size regardless of the length of the input.
+// With fname "-" stdin is decoded as it arrives and, if tee_fd isn't -1, everything
+// read from it is also written to tee_fd.
+bool read_audio_data_chunked(
+        const std::string & fname,
+        size_t n_chunk,
+        const std::function<bool(const float *, size_t)> & cb,
+        int tee_fd = -1);
+
+// Decode the whole audio file as 16 kHz PCM, one vector per channel of the file
+// Stdin is read as a single mono channel
+bool read_audio_channels(
+        const std::string & fname,
+        std::vector<std::vector<float>> & channels);
+
 // convert timestamp to string, 6000 -> 01:00.000
 std::string to_timestamp(int64_t t, bool comma = false);
 
@@ -248,6 +248,23 @@ bool vad_simple(
         float freq_thold,
         bool  verbose);
 
+// Cheap energy based pre-gate for a real VAD
+// Splits the audio in frame_ms frames, high-pass filtered at freq_thold Hz, and marks a frame as
+// obviously silent if its RMS is below energy_thold, or below twice that with a zero-crossing
+// rate above zcr_thold (low level broadband noise)
+// first/last are set to the bounds of the samples of the frames that are not silent
+// Returns false if every frame is silent
+bool vad_energy_gate(
+        const float * pcmf32,
+        size_t n_samples,
+        int    sample_rate,
+        int    frame_ms,
+        float  energy_thold,
+        float  zcr_thold,
+        float  freq_thold,
+        size_t & first,
+        size_t & last);
+
 // compute similarity between two strings using Levenshtein distance
 float similarity(const std::string & s0, const std::string & s1);
 
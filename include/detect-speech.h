@@ -0,0 +1,64 @@
+#pragma once
+
+// Embeddable speech edge detection, the library behind the detect-speech tool, see
+// src/detect-speech.cpp
+// A detect_speech_context holds the loaded Silero model and the buffers of a scan. It
+// is used by one thread at a time, to detect in parallel create one per thread. Once a
+// context has seen inputs of a given length its own scan buffers don't grow again, but
+// calls still allocate: whisper builds a new segment list for every VAD window, and
+// detect_edges_file() opens the libav demuxer, decoder and resampler of every file.
+
+#include "speech-scan.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct detect_speech_config {
+    struct whisper_vad_params vad_params = whisper_vad_default_params();
+    int   n_threads = 0;            // threads of the VAD, 0 for the whisper default
+    bool  use_gpu = false;          // run the VAD on the GPU backend whisper was built with
+    int   gpu_device = 0;
+    bool  trim_start = true;        // search for the first speech onset
+    bool  trim_end = true;          // search for the last speech offset
+    float overlap_seconds = 1.0f;   // audio fed to the VAD before each window as context
+    float window_min_seconds = 2.0f;
+    float window_max_seconds = 30.0f;
+    bool  pregate = false;          // skip the VAD on audio that is obviously silent by energy
+    float pregate_thold = 0.001f;
+    bool  probe = false;            // detect_edges_file() seeks to the head and tail instead of decoding it all
+    bool  packet_hints = false;     // detect_edges_file() decodes only where the packet sizes show sound
+};
+
+struct detect_speech_context;
+
+// model_path nullptr or "" for the model embedded in the binary, see vad-model.h
+// returns nullptr if the model can't be loaded or the config is invalid: window_min_seconds
+// must be at least 0.1, window_max_seconds at least window_min_seconds and
+// overlap_seconds not negative
+struct detect_speech_context * detect_speech_init(const char * model_path, const detect_speech_config & config);
+void detect_speech_free(struct detect_speech_context * ctx);
+
+// Speech edges of 16 kHz mono samples, padded by half a second
+// returns false if the VAD fails
+bool detect_edges(struct detect_speech_context * ctx, const float * samples, size_t n_samples, speech_edges & edges);
+
+// Speech edges of an audio file in any format ffmpeg reads. The file is decoded in
+// windows, so memory doesn't grow with its length.
+// returns false if the file can't be read or the VAD fails
+bool detect_edges_file(struct detect_speech_context * ctx, const std::string & path, speech_edges & edges);
+
+// Stream copy the part of ifname between the edges into ofname, the same as
+// `ffmpeg -ss <start> -i <in> -to <end> -c copy <out>`. Check speech_edges_has_silence()
+// first, there is no point in copying the whole file.
+// With smart_cut_tolerance >= 0 the cuts are sample accurate where the codec allows it,
+// see ffmpeg_trim_smart().
+// returns false on error
+bool detect_speech_trim(const std::string & ifname, const std::string & ofname, const speech_edges & edges,
+                        float smart_cut_tolerance = -1.0f);
+
+// Stream copy the ranges of ifname, e.g. from speech_keep_ranges(), back to back into
+// ofname, dropping everything in between. The cuts land on packets, a last range
+// with t1 < 0 runs until the end of the file.
+// returns false on error
+bool detect_speech_concat(const std::string & ifname, const std::string & ofname, const std::vector<vad_segment> & keep);
@@ -0,0 +1,79 @@
+#pragma once
+
+// Audio decoding through libavformat/libavcodec, see src/ffmpeg-transcode.cpp
+// All output is 16 kHz PCM, mono unless stated otherwise
+// The decode functions also accept "-" for stdin and pipes, which are read as a stream.
+// FFMPEG_AVIO_BUF_SZ sets the size of the reads from the input (default 256 KiB).
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+// decode the whole file
+// return 0 on success
+int ffmpeg_decode_audio(const std::string & ifname, std::vector<float> & pcmf32);
+
+// decode the whole file into one vector per channel of the input
+// return 0 on success
+int ffmpeg_decode_audio_channels(const std::string & ifname, std::vector<std::vector<float>> & channels);
+
+// decode the file and pass the samples to cb in chunks of n_chunk samples
+// cb returns false to stop decoding
+// when ifname is "-" or a pipe, everything read from it is also written to tee_fd if it isn't -1
+// return 0 on success
+int ffmpeg_decode_audio_chunked(const std::string & ifname, size_t n_chunk, const std::function<bool(const float *, size_t)> & cb, int tee_fd = -1);
+
+// seekable reader for decoding only selected time ranges of a file
+struct ffmpeg_audio_reader;
+
+// return nullptr on error
+ffmpeg_audio_reader * ffmpeg_reader_open(const std::string & ifname);
+void ffmpeg_reader_close(ffmpeg_audio_reader * reader);
+
+// duration of the audio stream in seconds, negative if unknown
+double ffmpeg_reader_duration(const ffmpeg_audio_reader * reader);
+
+// decode the [t0, t1) seconds range, t1 < 0 reads until the end of the stream
+// pcmf32[0] is the sample at t0, zeros fill the front when the seek can only land after it
+// return 0 on success
+int ffmpeg_reader_read_range(ffmpeg_audio_reader * reader, double t0, double t1, std::vector<float> & pcmf32);
+
+// time range of a file, in seconds
+struct ffmpeg_time_range {
+    double t0;
+    double t1;
+};
+
+// Walk the packets of the first audio stream without decoding them and find the ranges
+// whose packets are large enough to hold sound. Opus DTX and comfort noise frames, and
+// the near-empty frames VBR encoders spend on silence, are far smaller than those of
+// speech: a packet is quiet when its bitrate is under a quarter of the 95th percentile
+// of the file, and DTX frames of at most 2 bytes always are. Active ranges less than
+// min_gap seconds apart are merged. duration is where the last packet ends.
+// A constant bitrate stream comes out as one range over the whole file.
+// return 0 on success
+int ffmpeg_packet_activity(const std::string & ifname, double min_gap, std::vector<ffmpeg_time_range> & active, double & duration);
+
+// stream copy the [t0, t1) seconds range of the audio of ifname into ofname without
+// re-encoding, the output container is chosen from the extension of ofname or,
+// failing that, is the same as the input one
+// t1 < 0 copies until the end of the stream
+// return 0 on success
+int ffmpeg_trim_copy(const std::string & ifname, const std::string & ofname, double t0, double t1);
+
+// like ffmpeg_trim_copy(), but a cut more than tolerance seconds away from a packet
+// boundary is sample accurate: the packet it falls in is decoded and the part that is
+// kept encoded again, all the other packets are stream copied. Codecs whose encoder
+// can't be spliced with the copied packets keep the packets around the cut and mark
+// the samples outside of it to be dropped, for Opus in Matroska, WebM, MP4 and Ogg and
+// AAC in MP4. Any other of them (MP3, Vorbis, ...) is cut on packets, with a warning.
+// return 0 on success
+int ffmpeg_trim_smart(const std::string & ifname, const std::string & ofname, double t0, double t1, double tolerance);
+
+// stream copy the ranges of the audio of ifname, in order and not overlapping, into
+// ofname back to back, the timestamps close the gaps between them. As with
+// ffmpeg_trim_copy() the cuts land on packets, a range ending at t1 < 0 runs until
+// the end of the stream.
+// return 0 on success
+int ffmpeg_concat_ranges(const std::string & ifname, const std::string & ofname, const std::vector<ffmpeg_time_range> & ranges);
@@ -0,0 +1,44 @@
+#pragma once
+
+// Polyphase FIR resampler of mono float audio to 16 kHz, see src/resample.cpp
+// Decoders hand it the samples at the rate of the file, after downmixing and format
+// conversion, so the audio is resampled once, straight into the float output.
+// Integer ratios (48 and 32 kHz) take a decimating kernel without phase tables, every
+// other rate a table of phases built for its exact ratio, 441:160 for 44.1 kHz. Rates
+// whose exact ratio would need more than 640 phases use the closest ratio that doesn't.
+
+#include <cstddef>
+#include <vector>
+
+struct resampler_16k {
+    int in_rate = 0;
+    int up = 1;   // the output is up * in_rate / down
+    int down = 1;
+    int n_taps = 0;              // taps of each phase, in input samples
+    int delay = 0;               // group delay of the filter, in input samples
+    std::vector<float> taps;     // up phases of n_taps, reversed for a forward dot product
+    std::vector<int> phase;      // phase of output k, for k modulo up
+    std::vector<int> step;       // input samples from output k to k + 1, for k modulo up
+    std::vector<float> buf;      // n_taps - 1 samples of history, then the unread input
+    size_t next = 0;             // index in buf of the newest input sample of the next output
+    int k = 0;                   // next output modulo up
+    unsigned long long n_in = 0;
+    unsigned long long n_out = 0;
+    char path[32] = "";          // in:out ratio, "3:1", "441:160", ... "1:1" when in_rate is 16 kHz
+};
+
+// set up the resampler from in_rate, which also resets it for a new stream
+// returns false if in_rate isn't a usable sample rate
+bool resampler_16k_init(resampler_16k & rs, int in_rate);
+
+// append the output of n input samples to out
+void resampler_16k_process(resampler_16k & rs, const float * in, size_t n, std::vector<float> & out);
+
+// append the output still held back by the filter delay at the end of the stream, out
+// then holds ceil(n_in * 16000 / in_rate) samples in total
+void resampler_16k_flush(resampler_16k & rs, std::vector<float> & out);
+
+// Resampling path of the last file decoded on this thread: the path of the resampler_16k
+// or the library that resampled, "swr" or "miniaudio"
+void resample_note_path(const char * path);
+const char * resample_last_path();
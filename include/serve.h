@@ -0,0 +1,75 @@
+#pragma once
+
+// The NDJSON job server of detect-speech --serve and its Prometheus metrics, see
+// src/serve.cpp. The server owns the transport: it reads one JSON job per line from
+// stdin or from the clients of a Unix socket, queues them for a fixed set of workers
+// and sends every result line back to where its job came from. What a job is and how
+// it runs is up to the caller, see serve_parse_fn.
+
+#include "speech-scan.h"
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// str with what a JSON string can't hold as is escaped, without the quotes
+std::string json_escape(const std::string & str);
+
+std::string string_printf(const char * fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// A value of a flat JSON object: strings are unescaped into str, the other scalars
+// (numbers, true, false, null) are kept verbatim in raw
+struct json_value {
+    bool is_string = false;
+    std::string str;
+    std::string raw;
+};
+
+// Parse a JSON object whose values are all scalars, as the jobs of --serve are.
+// Anything else, bare words, nested values and trailing text included, is rejected.
+// returns false on error
+bool parse_json_object(const std::string & text, std::map<std::string, json_value> & fields);
+
+// What a job sends back and what it adds to the metrics
+struct serve_result {
+    std::string line;            // JSON object, without the newline
+    int result = 0;              // index into serve_config::result_names
+    bool failed = false;         // only the job time and its result are recorded
+    bool trimmed = false;        // the trim and replace time is recorded as remux time
+    double audio_seconds = 0.0;  // length of the file, 0 if unknown
+    bool duration_known = false; // the scan reached the end of the file
+    double wall = 0.0;           // of the whole job
+    run_stats stats;             // filled when run was asked to collect stats
+};
+
+// One job of the server. id is a JSON value the result lines start with, run does the
+// work on worker 0 <= worker < serve_config::n_workers and collects the stats the
+// metrics need if collect_stats is set.
+struct serve_job {
+    std::string id = "null";
+    std::function<serve_result(size_t worker, bool collect_stats)> run;
+};
+
+// Turn one line into a job. On error it returns false with error set, and the client
+// gets an error line with whatever job.id was set to.
+typedef std::function<bool(const std::string & line, serve_job & job, std::string & error)> serve_parse_fn;
+
+struct serve_config {
+    std::string socket_path;               // Unix socket the clients connect to, stdin and stdout if empty
+    size_t n_workers = 1;
+    int queue_capacity = 2;                // jobs waiting for a worker before the clients are held back
+    std::string metrics_addr;              // "port", "host:port" or "[v6 host]:port" to serve metrics on, none if empty
+    std::vector<std::string> result_names; // the values of the result label of the jobs counter
+};
+
+// Run the jobs of stdin or of every client of the socket, each on the first free
+// worker. Every job gets one JSON line back on the connection it came from (stdout for
+// stdin), in the order the jobs finish. With stdin the server returns at EOF once all
+// jobs are done, with a socket it runs until it is killed or accept() fails; then the
+// jobs still queued are answered with an error and the clients' reads are shut down and
+// joined before the workers finish the jobs they hold.
+// There is no authentication, every client that can connect can have its jobs run.
+// returns the exit code
+int serve_run(const serve_config & config, const serve_parse_fn & parse);
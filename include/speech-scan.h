@@ -0,0 +1,337 @@
+#pragma once
+
+// Search for the speech edges of a file with the Silero VAD, see src/speech-scan.cpp
+// These are the scans behind every mode of detect-speech. Everything takes the
+// whisper_vad_context to run on, a context must only be used by one thread at a time.
+
+#include "whisper.h"
+#include "vad-cache.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Speech boundaries found in a file, in seconds
+struct speech_edges {
+    float total_duration_seconds = 0.0f;
+    float final_start_seconds = 0.0f;
+    float final_end_seconds = 0.0f;
+    bool speech_detected = false;
+    // false when the scan stopped before the end of the input, total_duration_seconds
+    // and final_end_seconds are then only how far it got
+    bool duration_known = true;
+};
+
+// Wall and CPU time spent in one phase. The CPU time is that of the whole process,
+// including the inference threads, so it is only attributable with a single job.
+struct phase_time {
+    double wall = 0.0;
+    double cpu = 0.0;
+};
+
+// What --stats reports for one file
+struct run_stats {
+    phase_time hash;    // content hash for the VAD cache
+    phase_time decode;  // decoding and resampling
+    phase_time vad;     // Silero inference and segment extraction
+    phase_time trim;    // stream copy into the output file
+    phase_time replace; // rename() over the input
+    uint64_t samples_decoded = 0;
+    uint64_t samples_inferred = 0;
+    uint64_t samples_pregated = 0; // dropped by the energy pre-gate without inference
+    int vad_calls = 0;
+    int cache_hits = 0;
+    int cache_misses = 0;
+    // how the decoder got to 16 kHz, see resample_last_path()
+    std::string resample_path;
+};
+
+double wall_seconds();
+// CPU time of the whole process
+double cpu_seconds();
+// CPU time of the calling thread
+double thread_cpu_seconds();
+
+// Adds the time until it goes out of scope to a phase, does nothing for nullptr
+struct phase_timer {
+    phase_time * phase;
+    double wall0 = 0.0;
+    double cpu0 = 0.0;
+
+    explicit phase_timer(phase_time * phase) : phase(phase) {
+        if (phase) {
+            wall0 = wall_seconds();
+            cpu0 = cpu_seconds();
+        }
+    }
+
+    ~phase_timer() {
+        if (phase) {
+            phase->wall += wall_seconds() - wall0;
+            phase->cpu += cpu_seconds() - cpu0;
+        }
+    }
+};
+
+// How the edges are searched for
+struct scan_params {
+    struct whisper_vad_params vad_params = whisper_vad_default_params();
+    // the edge search starts with windows of min_window_samples and doubles them,
+    // up to max_window_samples, while no speech is found
+    int  min_window_samples = 2 * WHISPER_SAMPLE_RATE;
+    int  max_window_samples = 30 * WHISPER_SAMPLE_RATE;
+    // audio before each window that is fed to the VAD as well, so the LSTM state has
+    // settled when the window starts and speech right at a boundary isn't missed
+    int  overlap_samples = WHISPER_SAMPLE_RATE;
+    bool call_trim_start = true;
+    bool call_trim_end = true;
+    // energy pre-gate: audio that is obviously silent by RMS and zero-crossing rate
+    // never reaches Silero
+    bool  pregate = false;
+    float pregate_thold = 0.001f;
+    // the streaming scan stops decoding once the onset is found if the end edge isn't
+    // wanted, at the cost of the total duration
+    bool stop_at_onset = false;
+    // decode on a thread of its own, ahead of the VAD by up to decode_queue_chunks chunks
+    bool decode_thread = false;
+    int  decode_queue_chunks = 4;
+    // the thread to decode on, one is started for the file if not set
+    struct decoder_thread * decoder = nullptr;
+    // collects the timings and sample counts if set
+    run_stats * stats = nullptr;
+    // the streaming scan keeps its window in here if set, so a caller scanning many
+    // files reuses one allocation
+    std::vector<float> * work_buffer = nullptr;
+};
+
+// Bounded queue between producer and consumer threads, e.g. a decoder thread and the
+// VAD. Producers block while the queue is full and give up once it has been stopped.
+template <typename T>
+struct bounded_queue {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<T> items;
+    size_t capacity = 4;
+    bool done = false;    // no more items will be pushed
+    bool stopped = false; // the consumers don't want more items
+
+    // returns false if the queue has been stopped
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return stopped || items.size() < capacity; });
+        if (stopped) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        cond.notify_all();
+        return true;
+    }
+
+    // returns false once the queue is drained and the producers are done
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return done || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        cond.notify_all();
+        return true;
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cond.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+    // returns the items that were still queued, for the caller to answer or drop
+    std::deque<T> stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        std::deque<T> dropped;
+        dropped.swap(items);
+        cond.notify_all();
+        return dropped;
+    }
+};
+
+// A thread running the decoding of one file after the other for the streaming scan
+// of a worker. It outlives the files, so the decoder state ffmpeg-transcode keeps per
+// thread is reused and no thread is created per file. It is started with the first job.
+struct decoder_thread {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::function<void()> job;
+    bool busy = false;
+    bool quit = false;
+    std::thread thread;
+
+    decoder_thread() = default;
+    decoder_thread(const decoder_thread &) = delete;
+    decoder_thread & operator=(const decoder_thread &) = delete;
+    ~decoder_thread();
+
+    // run fn on the thread, after the job before it is done
+    void start(std::function<void()> fn);
+    // wait until the job given to start() is done
+    void wait();
+};
+
+// The VAD contexts of one worker. The first one is created up front, the others
+// only when a file has more channels than there are contexts, and are then kept
+// for the following files. The PCM buffers of the worker live here too, they keep
+// their capacity from one file to the next so the decoder writes into memory that
+// is already allocated and faulted in.
+struct vad_contexts {
+    std::string model_path; // empty for the model embedded in the binary
+    struct whisper_vad_context_params vparams;
+    std::vector<struct whisper_vad_context *> vctxs;
+
+    std::vector<float> pcm;
+    std::vector<std::vector<float>> channels;
+    std::vector<std::vector<float>> batch; // one per file of a batch
+    std::vector<float> work;               // window of the streaming scan
+    decoder_thread decoder;                // decodes for the streaming scan
+
+    vad_contexts() = default;
+    vad_contexts(const vad_contexts &) = delete;
+    vad_contexts & operator=(const vad_contexts &) = delete;
+
+    ~vad_contexts() {
+        for (struct whisper_vad_context * vctx : vctxs) {
+            whisper_vad_free(vctx);
+        }
+    }
+
+    // returns nullptr if the context can't be created
+    struct whisper_vad_context * get(size_t i);
+
+    // drop buffers that grew past max_samples for an unusually long file, instead of
+    // holding on to that memory for the rest of the run
+    void trim_buffers(size_t max_samples);
+};
+
+// true if the edges leave significant silence to trim at either end
+bool speech_edges_has_silence(const speech_edges & edges);
+
+// Scan decoded samples from both ends, growing the window while no speech is found
+// returns false if the VAD fails
+bool detect_speech_in_memory(
+        const float * pcmf32,
+        size_t n_samples,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges);
+
+// The scan of detect_speech_in_memory() over many files in lockstep: every round
+// runs the next window of each of them on vctx. Every window is a call of its own,
+// with the LSTM state reset, so the edges are the same as those of the files scanned
+// one by one; only the context is shared, not the per-call overhead.
+// stats, if not empty, holds the stats of every file (entries may be nullptr).
+// returns false if the VAD fails
+bool detect_speech_in_memory_batch(
+        const std::vector<const std::vector<float> *> & pcms,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        const std::vector<run_stats *> & stats,
+        std::vector<speech_edges> & edges);
+
+// Scan the file while it is decoded, holding one window at a time.
+// Everything read from a "-" input is copied to tee_fd if it isn't -1.
+// returns false if the file can't be read or the VAD fails
+bool detect_speech_streaming(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        int tee_fd = -1);
+
+// Seek to and decode only windows at the head and tail of the file
+// returns false if the file can't be probed, e.g. its duration is unknown, or the VAD fails
+bool detect_speech_probing(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges);
+
+// Find the ranges that can hold sound from the packet sizes alone, see
+// ffmpeg_packet_activity(), then seek to and decode only those, forward from the first
+// for the onset and backward from the last for the offset. For Opus with DTX or VBR
+// silence the edges cost little more than reading the packets.
+// returns false if the packets can't be read, the caller then scans the usual way, or
+// if the VAD fails
+bool detect_speech_hinted(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges);
+
+// Decode the whole file as mono, accounting the time to stats if set
+bool read_audio_timed(const std::string & audio_file, std::vector<float> & pcmf32, run_stats * stats);
+
+// Run the VAD over the whole file at once and keep every segment
+bool detect_speech_segments(
+        const std::vector<float> & pcmf32,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments);
+
+// The same as detect_speech_segments(), with the file split into windows of
+// sp.max_window_samples that are inferred in parallel on n_workers contexts of ctxs,
+// handed out by work stealing. The probabilities of the windows are stitched back
+// together before the segments are taken from them, so segments don't break at the
+// window boundaries.
+// returns false if a context can't be created or the VAD fails
+bool detect_speech_map(
+        const float * pcmf32,
+        size_t n_samples,
+        vad_contexts & ctxs,
+        int n_workers,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments);
+
+// The ranges to keep to cut the silences longer than min_silence_seconds out of a file,
+// given all its segments and its edges. margin_seconds of every dropped silence stay on
+// either side of it. Empty when there is no speech.
+void speech_keep_ranges(
+        const std::vector<vad_segment> & segments,
+        const speech_edges & edges,
+        float min_silence_seconds,
+        float margin_seconds,
+        std::vector<vad_segment> & keep);
+
+// Derive the edges from the cached VAD probabilities of the whole file, computing and
+// storing them on a miss
+// returns false if the file can't be read
+bool detect_speech_cached(
+        const std::string & audio_file,
+        const std::string & cache_dir,
+        uint64_t model_hash,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments);
+
+// Scan every channel concurrently, each on its own context of ctxs, and keep the
+// speech of all of them
+// returns false if a context can't be created or the VAD fails
+bool detect_speech_per_channel(
+        const std::vector<std::vector<float>> & channels,
+        vad_contexts & ctxs,
+        const scan_params & sp,
+        speech_edges & edges);
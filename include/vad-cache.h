@@ -0,0 +1,83 @@
+#pragma once
+
+// On-disk cache of the per-frame VAD probabilities of whole files, see src/vad-cache.cpp
+// An entry is keyed by the hash of the file content and the hash of the model, and stores
+// the probabilities quantized to u8 so it can be memory-mapped and read back as is.
+// Segments are rebuilt from an entry with any whisper_vad_params, without decoding or
+// inferring the file again.
+
+#include "whisper.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Silero produces one probability per 512 samples at 16 kHz
+#define VAD_CACHE_FRAME_SAMPLES 512
+
+// XXH64 of a buffer
+uint64_t vad_hash_bytes(const void * data, size_t size, uint64_t seed = 0);
+
+// XXH64 of the content of a file
+// returns false if the file can't be read
+bool vad_hash_file(const std::string & path, uint64_t & hash);
+
+// quantize probabilities in [0, 1] to u8
+void vad_quantize_probs(const float * probs, size_t n_probs, std::vector<uint8_t> & probs_q);
+
+// Speech segment, in seconds
+struct vad_segment {
+    float t0;
+    float t1;
+};
+
+// Approximately the segments whisper_vad_segments_from_probs() builds, but from quantized
+// probabilities that don't have to live in a whisper_vad_context. This is a port of the
+// whisper segmenter (thresholds, the split of overlong speech at a 98 ms silence, the
+// merge of gaps under 200 ms, the padding) and isn't checked against it, so it can drift
+// from the linked whisper version. Known differences:
+//  - quantization moves a probability by up to 1/510, a frame that close to threshold
+//    or to threshold - 0.15 can flip and move an edge by a frame (32 ms)
+//  - the times are computed in seconds, whisper's in centiseconds, they can differ in
+//    the last float digit
+// The cache and the map modes build their edges with these, so they can differ from
+// those of a plain scan by those amounts.
+void vad_segments_from_probs_u8(
+        const uint8_t * probs_q,
+        size_t n_probs,
+        const struct whisper_vad_params & params,
+        std::vector<vad_segment> & segments);
+
+// The same from unquantized probabilities, e.g. a slice of whisper_vad_probs(), only the
+// port differences above apply
+void vad_segments_from_probs_f32(
+        const float * probs,
+        size_t n_probs,
+        const struct whisper_vad_params & params,
+        std::vector<vad_segment> & segments);
+
+// A memory-mapped cache entry
+struct vad_cache_entry {
+    uint64_t n_samples = 0;       // length of the decoded file, 16 kHz samples
+    const uint8_t * probs = nullptr;
+    size_t n_probs = 0;
+
+    void * map = nullptr;
+    size_t map_size = 0;
+};
+
+// path of the entry for the given hashes inside dir
+std::string vad_cache_path(const std::string & dir, uint64_t content_hash, uint64_t model_hash);
+
+// map the entry at path, returns false if it is missing, truncated or doesn't match the hashes
+bool vad_cache_open(const std::string & path, uint64_t content_hash, uint64_t model_hash, vad_cache_entry & entry);
+void vad_cache_close(vad_cache_entry & entry);
+
+// write an entry, atomically replacing any previous one at path
+// returns false on error
+bool vad_cache_store(
+        const std::string & path,
+        uint64_t content_hash,
+        uint64_t model_hash,
+        uint64_t n_samples,
+        const std::vector<uint8_t> & probs_q);
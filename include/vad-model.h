@@ -0,0 +1,28 @@
+#pragma once
+
+// Loading of the Silero VAD model from a shared read-only mapping, see src/vad-model.cpp
+// The model file is mapped once per process with MAP_SHARED. The contexts created
+// after the first one don't open or read the file again, and all processes map the
+// same page-cache pages of it. What is shared is only the file image: the whisper
+// loader copies the weights out of it into the private ggml buffers of every context,
+// so each context still holds its own resident copy of the tensors. The whisper loader
+// API has no way to build a context on top of weights that already exist, so sharing
+// those is out of reach here. A model can also be linked into the binary
+// (cmake -DDETECT_SPEECH_EMBED_MODEL=<file>), it is then used when the path is empty.
+
+#include "whisper.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// true if the binary carries an embedded model
+bool vad_model_embedded();
+
+// Create a VAD context from the model at path, or from the embedded model if path is empty
+// returns nullptr on error
+struct whisper_vad_context * vad_model_init(const std::string & path, struct whisper_vad_context_params params);
+
+// XXH64 of the model at path, or of the embedded model if path is empty
+// returns false if the model can't be read
+bool vad_model_hash(const std::string & path, uint64_t & hash);
@@ -0,0 +1,324 @@
+#include "common-simd.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+//
+// scalar reference implementations, also used for the tails of the vector loops
+//
+
+static float sum_abs_scalar(const float * x, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += fabsf(x[i]);
+    }
+    return sum;
+}
+
+static float sum_sq_scalar(const float * x, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += x[i]*x[i];
+    }
+    return sum;
+}
+
+static float dot_scalar(const float * a, const float * b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += a[i]*b[i];
+    }
+    return sum;
+}
+
+static size_t zero_crossings_scalar(const float * x, size_t n) {
+    size_t count = 0;
+    for (size_t i = 1; i < n; i++) {
+        count += (x[i] >= 0.0f) != (x[i - 1] >= 0.0f);
+    }
+    return count;
+}
+
+static void deinterleave2_scalar(const float * x, size_t n_frames, float * left, float * right) {
+    for (size_t i = 0; i < n_frames; i++) {
+        left[i]  = x[2*i];
+        right[i] = x[2*i + 1];
+    }
+}
+
+static void downmix2_scalar(const float * x, size_t n_frames, float * mono) {
+    for (size_t i = 0; i < n_frames; i++) {
+        mono[i] = x[2*i] + x[2*i + 1];
+    }
+}
+
+//
+// AVX2
+//
+
+#if defined(SIMD_X86)
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+static float sum_abs_avx2(const float * x, size_t n) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i + 8)));
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + sum_abs_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float sum_sq_avx2(const float * x, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256 v0 = _mm256_loadu_ps(x + i);
+        const __m256 v1 = _mm256_loadu_ps(x + i + 8);
+        acc0 = _mm256_fmadd_ps(v0, v0, acc0);
+        acc1 = _mm256_fmadd_ps(v1, v1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(x + i);
+        acc0 = _mm256_fmadd_ps(v, v, acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + sum_sq_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float * a, const float * b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma,popcnt")))
+static size_t zero_crossings_avx2(const float * x, size_t n) {
+    if (n < 2) {
+        return 0;
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    size_t count = 0;
+    size_t i = 1;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 cur  = _mm256_cmp_ps(_mm256_loadu_ps(x + i),     zero, _CMP_GE_OQ);
+        const __m256 prev = _mm256_cmp_ps(_mm256_loadu_ps(x + i - 1), zero, _CMP_GE_OQ);
+        count += _mm_popcnt_u32((unsigned) _mm256_movemask_ps(_mm256_xor_ps(cur, prev)));
+    }
+    return count + zero_crossings_scalar(x + i - 1, n - i + 1);
+}
+
+// a = L0 R0 L1 R1 L2 R2 L3 R3, b = L4 R4 ... L7 R7
+__attribute__((target("avx2,fma")))
+static inline void split_avx2(const float * x, __m256 & l, __m256 & r) {
+    const __m256 a = _mm256_loadu_ps(x);
+    const __m256 b = _mm256_loadu_ps(x + 8);
+    // in-lane shuffles give L0 L1 L4 L5 | L2 L3 L6 L7, then fix the 64-bit lane order
+    const __m256 lo = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m256 hi = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(lo), _MM_SHUFFLE(3, 1, 2, 0)));
+    r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(hi), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+__attribute__((target("avx2,fma")))
+static void deinterleave2_avx2(const float * x, size_t n_frames, float * left, float * right) {
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256 l, r;
+        split_avx2(x + 2*i, l, r);
+        _mm256_storeu_ps(left + i, l);
+        _mm256_storeu_ps(right + i, r);
+    }
+    deinterleave2_scalar(x + 2*i, n_frames - i, left + i, right + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void downmix2_avx2(const float * x, size_t n_frames, float * mono) {
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256 l, r;
+        split_avx2(x + 2*i, l, r);
+        _mm256_storeu_ps(mono + i, _mm256_add_ps(l, r));
+    }
+    downmix2_scalar(x + 2*i, n_frames - i, mono + i);
+}
+
+#endif // SIMD_X86
+
+//
+// NEON
+//
+
+#if defined(SIMD_NEON)
+
+static float sum_abs_neon(const float * x, size_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vaddq_f32(acc0, vabsq_f32(vld1q_f32(x + i)));
+        acc1 = vaddq_f32(acc1, vabsq_f32(vld1q_f32(x + i + 4)));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + sum_abs_scalar(x + i, n - i);
+}
+
+static float sum_sq_neon(const float * x, size_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const float32x4_t v0 = vld1q_f32(x + i);
+        const float32x4_t v1 = vld1q_f32(x + i + 4);
+        acc0 = vfmaq_f32(acc0, v0, v0);
+        acc1 = vfmaq_f32(acc1, v1, v1);
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + sum_sq_scalar(x + i, n - i);
+}
+
+static float dot_neon(const float * a, const float * b, size_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+static size_t zero_crossings_neon(const float * x, size_t n) {
+    if (n < 2) {
+        return 0;
+    }
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i = 1;
+    for (; i + 4 <= n; i += 4) {
+        const uint32x4_t cur  = vcgeq_f32(vld1q_f32(x + i),     zero);
+        const uint32x4_t prev = vcgeq_f32(vld1q_f32(x + i - 1), zero);
+        // all ones where the sign changed, shift down to 0/1 and accumulate
+        acc = vaddq_u32(acc, vshrq_n_u32(veorq_u32(cur, prev), 31));
+    }
+    return vaddvq_u32(acc) + zero_crossings_scalar(x + i - 1, n - i + 1);
+}
+
+static void deinterleave2_neon(const float * x, size_t n_frames, float * left, float * right) {
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        const float32x4x2_t v = vld2q_f32(x + 2*i);
+        vst1q_f32(left + i, v.val[0]);
+        vst1q_f32(right + i, v.val[1]);
+    }
+    deinterleave2_scalar(x + 2*i, n_frames - i, left + i, right + i);
+}
+
+static void downmix2_neon(const float * x, size_t n_frames, float * mono) {
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        const float32x4x2_t v = vld2q_f32(x + 2*i);
+        vst1q_f32(mono + i, vaddq_f32(v.val[0], v.val[1]));
+    }
+    downmix2_scalar(x + 2*i, n_frames - i, mono + i);
+}
+
+#endif // SIMD_NEON
+
+//
+// runtime dispatch
+//
+
+struct simd_kernels {
+    const char * name;
+    float  (*sum_abs)(const float *, size_t);
+    float  (*sum_sq)(const float *, size_t);
+    float  (*dot)(const float *, const float *, size_t);
+    size_t (*zero_crossings)(const float *, size_t);
+    void   (*deinterleave2)(const float *, size_t, float *, float *);
+    void   (*downmix2)(const float *, size_t, float *);
+};
+
+static simd_kernels simd_select() {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("popcnt")) {
+        return { "avx2", sum_abs_avx2, sum_sq_avx2, dot_avx2, zero_crossings_avx2, deinterleave2_avx2, downmix2_avx2 };
+    }
+#elif defined(SIMD_NEON)
+    return { "neon", sum_abs_neon, sum_sq_neon, dot_neon, zero_crossings_neon, deinterleave2_neon, downmix2_neon };
+#endif
+    return { "scalar", sum_abs_scalar, sum_sq_scalar, dot_scalar, zero_crossings_scalar, deinterleave2_scalar, downmix2_scalar };
+}
+
+static const simd_kernels & simd() {
+    static const simd_kernels kernels = simd_select();
+    return kernels;
+}
+
+float simd_sum_abs(const float * x, size_t n) {
+    return simd().sum_abs(x, n);
+}
+
+float simd_sum_sq(const float * x, size_t n) {
+    return simd().sum_sq(x, n);
+}
+
+float simd_dot(const float * a, const float * b, size_t n) {
+    return simd().dot(a, b, n);
+}
+
+size_t simd_zero_crossings(const float * x, size_t n) {
+    return simd().zero_crossings(x, n);
+}
+
+void simd_frame_rms(const float * x, size_t n, size_t n_frame, float * rms) {
+    const simd_kernels & k = simd();
+    for (size_t i = 0; i < n; i += n_frame) {
+        const size_t len = n - i < n_frame ? n - i : n_frame;
+        *rms++ = sqrtf(k.sum_sq(x + i, len) / len);
+    }
+}
+
+void simd_deinterleave2(const float * x, size_t n_frames, float * left, float * right) {
+    simd().deinterleave2(x, n_frames, left, right);
+}
+
+void simd_downmix2(const float * x, size_t n_frames, float * mono) {
+    simd().downmix2(x, n_frames, mono);
+}
+
+const char * simd_backend() {
+    return simd().name;
+}
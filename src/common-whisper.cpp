@@ -3,6 +3,8 @@
 #include "common-whisper.h"
 
 #include "common.h"
+#include "common-simd.h"
+#include "resample.h"
 
 #include "whisper.h"
 
@@ -31,36 +33,57 @@
 #include <io.h>
 #endif
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <functional>
 
 #ifdef WHISPER_FFMPEG
 // as implemented in ffmpeg_trancode.cpp only embedded in common lib if whisper built with ffmpeg support
-extern int ffmpeg_decode_audio(const std::string & ifname, std::vector<uint8_t> & wav_data);
+#include "ffmpeg-transcode.h"
 #endif
 
 bool read_audio_data(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
-    std::vector<uint8_t> audio_data; // used for pipe input from stdin or ffmpeg decoding output
+    std::vector<uint8_t> audio_data; // used for pipe input from stdin
 
     ma_result result;
     ma_decoder_config decoder_config;
     ma_decoder decoder;
 
-    decoder_config = ma_decoder_config_init(ma_format_f32, stereo ? 2 : 1, WHISPER_SAMPLE_RATE);
+    // mono is decoded at the rate of the file and resampled by resampler_16k, miniaudio
+    // itself only resamples linearly
+    decoder_config = ma_decoder_config_init(ma_format_f32, stereo ? 2 : 1, stereo ? WHISPER_SAMPLE_RATE : 0);
 
     if (fname == "-") {
+#if defined(WHISPER_FFMPEG)
+		// decode the pipe as it arrives, in any format ffmpeg knows
+		if (ffmpeg_decode_audio(fname, pcmf32) != 0) {
+			fprintf(stderr, "error: failed to ffmpeg decode stdin\n");
+
+			return false;
+		}
+
+		if (stereo) {
+			pcmf32s.assign(2, pcmf32);
+			for (float & s : pcmf32) {
+				s *= 2.0f;
+			}
+		}
+
+		return true;
+#else
 		#ifdef _WIN32
 		_setmode(_fileno(stdin), _O_BINARY);
 		#endif
 
-		uint8_t buf[1024];
+		std::vector<uint8_t> buf(64*1024);
 		while (true)
 		{
-			const size_t n = fread(buf, 1, sizeof(buf), stdin);
+			const size_t n = fread(buf.data(), 1, buf.size(), stdin);
 			if (n == 0) {
 				break;
 			}
-			audio_data.insert(audio_data.end(), buf, buf + n);
+			audio_data.insert(audio_data.end(), buf.data(), buf.data() + n);
 		}
 
 		if ((result = ma_decoder_init_memory(audio_data.data(), audio_data.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
@@ -71,20 +94,26 @@ bool read_audio_data(const std::string & fname, std::vector<float>& pcmf32, std:
 		}
 
 		fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, audio_data.size());
+#endif
     }
     else if (((result = ma_decoder_init_file(fname.c_str(), &decoder_config, &decoder)) != MA_SUCCESS)) {
 #if defined(WHISPER_FFMPEG)
-		if (ffmpeg_decode_audio(fname, audio_data) != 0) {
+		// ffmpeg already produces mono 16 kHz float, no need to go through miniaudio
+		if (ffmpeg_decode_audio(fname, pcmf32) != 0) {
 			fprintf(stderr, "error: failed to ffmpeg decode '%s'\n", fname.c_str());
 
 			return false;
 		}
 
-		if ((result = ma_decoder_init_memory(audio_data.data(), audio_data.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
-			fprintf(stderr, "error: failed to read audio data as wav (%s)\n", ma_result_description(result));
-
-			return false;
+		if (stereo) {
+			// same as miniaudio's mono to stereo conversion: both channels carry the mono signal
+			pcmf32s.assign(2, pcmf32);
+			for (float & s : pcmf32) {
+				s *= 2.0f;
+			}
 		}
+
+		return true;
 #else
 		if ((result = ma_decoder_init_memory(fname.c_str(), fname.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
 			fprintf(stderr, "error: failed to read audio data as wav (%s)\n", ma_result_description(result));
@@ -103,33 +132,276 @@ bool read_audio_data(const std::string & fname, std::vector<float>& pcmf32, std:
 		return false;
     }
 
-    pcmf32.resize(stereo ? frame_count*2 : frame_count);
+    if (stereo) {
+        // decode a block of interleaved frames at a time and split it straight into the outputs,
+        // so the whole interleaved file never has to be held next to the three planar copies
+        const ma_uint64 n_block = 4096;
+        std::vector<float> block(2*n_block);
 
-    if ((result = ma_decoder_read_pcm_frames(&decoder, pcmf32.data(), frame_count, &frames_read)) != MA_SUCCESS) {
-		fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+        pcmf32.resize(frame_count);
+        pcmf32s.resize(2);
+        pcmf32s[0].resize(frame_count);
+        pcmf32s[1].resize(frame_count);
 
-		return false;
-    }
+        frames_read = 0;
+        while (frames_read < frame_count) {
+            ma_uint64 n_read = 0;
+            if ((result = ma_decoder_read_pcm_frames(&decoder, block.data(), std::min(n_block, frame_count - frames_read), &n_read)) != MA_SUCCESS) {
+                fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
 
-    if (stereo) {
-        std::vector<float> stereo_data = pcmf32;
+                return false;
+            }
+
+            simd_deinterleave2(block.data(), n_read, pcmf32s[0].data() + frames_read, pcmf32s[1].data() + frames_read);
+            simd_downmix2(block.data(), n_read, pcmf32.data() + frames_read);
+            frames_read += n_read;
+        }
+        resample_note_path("miniaudio");
+    } else if (decoder.outputSampleRate != WHISPER_SAMPLE_RATE) {
+        resampler_16k rs;
+        if (!resampler_16k_init(rs, decoder.outputSampleRate)) {
+            fprintf(stderr, "error: can't resample audio data from %u Hz\n", decoder.outputSampleRate);
+            ma_decoder_uninit(&decoder);
+
+            return false;
+        }
+        resample_note_path(rs.path);
+
+        // resample a block at a time, straight into the output
+        const ma_uint64 n_block = 16384;
+        std::vector<float> block(n_block);
+
+        pcmf32.clear();
+        pcmf32.reserve(frame_count*WHISPER_SAMPLE_RATE/decoder.outputSampleRate + 1);
+        while (true) {
+            ma_uint64 n_read = 0;
+            result = ma_decoder_read_pcm_frames(&decoder, block.data(), n_block, &n_read);
+            if (n_read == 0) {
+                break;
+            }
+            resampler_16k_process(rs, block.data(), n_read, pcmf32);
+            if (result != MA_SUCCESS) {
+                break;
+            }
+        }
+        resampler_16k_flush(rs, pcmf32);
+
+        if (result != MA_SUCCESS && result != MA_AT_END) {
+            fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+            ma_decoder_uninit(&decoder);
+
+            return false;
+        }
+    } else {
+        resample_note_path("1:1");
         pcmf32.resize(frame_count);
 
-        for (uint64_t i = 0; i < frame_count; i++) {
-            pcmf32[i] = (stereo_data[2*i] + stereo_data[2*i + 1]);
+        if ((result = ma_decoder_read_pcm_frames(&decoder, pcmf32.data(), frame_count, &frames_read)) != MA_SUCCESS) {
+            fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+
+            return false;
         }
+    }
 
-        pcmf32s.resize(2);
-        pcmf32s[0].resize(frame_count);
-        pcmf32s[1].resize(frame_count);
-        for (uint64_t i = 0; i < frame_count; i++) {
-            pcmf32s[0][i] = stereo_data[2*i];
-            pcmf32s[1][i] = stereo_data[2*i + 1];
+    ma_decoder_uninit(&decoder);
+
+    return true;
+}
+
+bool read_audio_data_chunked(const std::string & fname, size_t n_chunk, const std::function<bool(const float *, size_t)> & cb, int tee_fd) {
+    if (n_chunk == 0) {
+        return false;
+    }
+
+    if (fname == "-") {
+#if defined(WHISPER_FFMPEG)
+        // decode the pipe as it arrives, cb sees the first chunk long before stdin is closed
+        if (ffmpeg_decode_audio_chunked(fname, n_chunk, cb, tee_fd) != 0) {
+            fprintf(stderr, "error: failed to ffmpeg decode stdin\n");
+
+            return false;
+        }
+
+        return true;
+#else
+        if (tee_fd >= 0) {
+            fprintf(stderr, "error: copying stdin while decoding it needs ffmpeg support\n");
+
+            return false;
+        }
+
+        // stdin has to be buffered before miniaudio can parse it anyway
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_audio_data(fname, pcmf32, pcmf32s, false)) {
+            return false;
         }
+        for (size_t i = 0; i < pcmf32.size(); i += n_chunk) {
+            if (!cb(pcmf32.data() + i, std::min(n_chunk, pcmf32.size() - i))) {
+                break;
+            }
+        }
+        return true;
+#endif
+    }
+
+    ma_result result;
+    ma_decoder_config decoder_config;
+    ma_decoder decoder;
+
+    // at the rate of the file, see read_audio_data()
+    decoder_config = ma_decoder_config_init(ma_format_f32, 1, 0);
+
+    if ((result = ma_decoder_init_file(fname.c_str(), &decoder_config, &decoder)) != MA_SUCCESS) {
+#if defined(WHISPER_FFMPEG)
+        if (ffmpeg_decode_audio_chunked(fname, n_chunk, cb) != 0) {
+            fprintf(stderr, "error: failed to ffmpeg decode '%s'\n", fname.c_str());
+
+            return false;
+        }
+
+        return true;
+#else
+        fprintf(stderr, "error: failed to open '%s' as audio (%s)\n", fname.c_str(), ma_result_description(result));
+
+        return false;
+#endif
+    }
+
+    resampler_16k rs;
+    if (!resampler_16k_init(rs, decoder.outputSampleRate)) {
+        fprintf(stderr, "error: can't resample audio data from %u Hz\n", decoder.outputSampleRate);
+        ma_decoder_uninit(&decoder);
+
+        return false;
+    }
+    resample_note_path(rs.path);
+
+    std::vector<float> block(n_chunk);
+    std::vector<float> chunk;
+    chunk.reserve(2*n_chunk);
+    ma_uint64 frames_read = 0;
+    bool keep_going = true;
+
+    // hand out the complete chunks, and with last the short one at the end
+    auto drain = [&](bool last) {
+        size_t off = 0;
+        while (keep_going && (chunk.size() - off >= n_chunk || (last && off < chunk.size()))) {
+            const size_t n = std::min(n_chunk, chunk.size() - off);
+            keep_going = cb(chunk.data() + off, n);
+            off += n;
+        }
+        chunk.erase(chunk.begin(), chunk.begin() + off);
+    };
+
+    while (keep_going) {
+        result = ma_decoder_read_pcm_frames(&decoder, block.data(), n_chunk, &frames_read);
+        if (frames_read == 0) {
+            break;
+        }
+        resampler_16k_process(rs, block.data(), frames_read, chunk);
+        drain(false);
+        if (result != MA_SUCCESS) {
+            break;
+        }
+    }
+    if (keep_going) {
+        resampler_16k_flush(rs, chunk);
+        drain(true);
+    }
+
+    ma_decoder_uninit(&decoder);
+
+    if (result != MA_SUCCESS && result != MA_AT_END) {
+        fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool read_audio_channels(const std::string & fname, std::vector<std::vector<float>> & channels) {
+    if (fname == "-") {
+        // only the mono mix is kept for stdin
+        std::vector<std::vector<float>> pcmf32s;
+        channels.resize(1);
+        return read_audio_data(fname, channels[0], pcmf32s, false);
+    }
+
+    ma_result result;
+    ma_decoder_config decoder_config;
+    ma_decoder decoder;
+
+    // 0 channels keeps the channel count of the file
+    decoder_config = ma_decoder_config_init(ma_format_f32, 0, WHISPER_SAMPLE_RATE);
+
+    if ((result = ma_decoder_init_file(fname.c_str(), &decoder_config, &decoder)) != MA_SUCCESS) {
+#if defined(WHISPER_FFMPEG)
+        if (ffmpeg_decode_audio_channels(fname, channels) != 0 || channels.empty()) {
+            fprintf(stderr, "error: failed to ffmpeg decode '%s'\n", fname.c_str());
+
+            return false;
+        }
+
+        return true;
+#else
+        fprintf(stderr, "error: failed to open '%s' as audio (%s)\n", fname.c_str(), ma_result_description(result));
+
+        return false;
+#endif
+    }
+
+    ma_uint64 frame_count;
+    if ((result = ma_decoder_get_length_in_pcm_frames(&decoder, &frame_count)) != MA_SUCCESS) {
+        fprintf(stderr, "error: failed to retrieve the length of the audio data (%s)\n", ma_result_description(result));
+        ma_decoder_uninit(&decoder);
+
+        return false;
+    }
+
+    const ma_uint32 n_channels = decoder.outputChannels;
+    const ma_uint64 n_block = 4096;
+    std::vector<float> block(n_channels*n_block);
+
+    // resize in place, so buffers kept from the previous file are reused
+    channels.resize(n_channels);
+    for (std::vector<float> & channel : channels) {
+        channel.resize(frame_count);
+    }
+
+    ma_uint64 frames_read = 0;
+    while (frames_read < frame_count) {
+        ma_uint64 n_read = 0;
+        if ((result = ma_decoder_read_pcm_frames(&decoder, block.data(), std::min(n_block, frame_count - frames_read), &n_read)) != MA_SUCCESS || n_read == 0) {
+            break;
+        }
+
+        if (n_channels == 2) {
+            simd_deinterleave2(block.data(), n_read, channels[0].data() + frames_read, channels[1].data() + frames_read);
+        } else {
+            for (ma_uint64 i = 0; i < n_read; i++) {
+                for (ma_uint32 c = 0; c < n_channels; c++) {
+                    channels[c][frames_read + i] = block[i*n_channels + c];
+                }
+            }
+        }
+        frames_read += n_read;
     }
 
     ma_decoder_uninit(&decoder);
 
+    if (result != MA_SUCCESS && result != MA_AT_END) {
+        fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+
+        return false;
+    }
+
+    resample_note_path("miniaudio");
+    for (std::vector<float> & channel : channels) {
+        channel.resize(frames_read);
+    }
+
     return true;
 }
 
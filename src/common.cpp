@@ -1,7 +1,9 @@
 #define _USE_MATH_DEFINES // for M_PI
 
 #include "common.h"
+#include "common-simd.h"
 
+#include <algorithm>
 #include <cmath>
 #include <codecvt>
 #include <cstring>
@@ -620,16 +622,8 @@ bool vad_simple(std::vector<float> & pcmf32, int sample_rate, int last_ms, float
         high_pass_filter(pcmf32, freq_thold, sample_rate);
     }
 
-    float energy_all  = 0.0f;
-    float energy_last = 0.0f;
-
-    for (int i = 0; i < n_samples; i++) {
-        energy_all += fabsf(pcmf32[i]);
-
-        if (i >= n_samples - n_samples_last) {
-            energy_last += fabsf(pcmf32[i]);
-        }
-    }
+    float energy_all  = simd_sum_abs(pcmf32.data(), n_samples);
+    float energy_last = simd_sum_abs(pcmf32.data() + n_samples - n_samples_last, n_samples_last);
 
     energy_all  /= n_samples;
     energy_last /= n_samples_last;
@@ -645,6 +639,38 @@ bool vad_simple(std::vector<float> & pcmf32, int sample_rate, int last_ms, float
     return true;
 }
 
+bool vad_energy_gate(const float * pcmf32, size_t n_samples, int sample_rate, int frame_ms, float energy_thold, float zcr_thold, float freq_thold, size_t & first, size_t & last) {
+    const size_t n_frame = std::max(1, (sample_rate * frame_ms) / 1000);
+
+    std::vector<float> frame;
+    frame.reserve(n_frame);
+
+    bool found = false;
+
+    for (size_t i = 0; i < n_samples; i += n_frame) {
+        const size_t n = std::min(n_frame, n_samples - i);
+
+        frame.assign(pcmf32 + i, pcmf32 + i + n);
+        if (freq_thold > 0.0f && n > 1) {
+            high_pass_filter(frame, freq_thold, sample_rate);
+        }
+
+        const float rms = sqrtf(simd_sum_sq(frame.data(), n) / n);
+        const float zcr = (float) simd_zero_crossings(frame.data(), n) / n;
+
+        const bool silent = rms < energy_thold || (rms < 2.0f*energy_thold && zcr > zcr_thold);
+        if (!silent) {
+            if (!found) {
+                first = i;
+                found = true;
+            }
+            last = i + n - 1;
+        }
+    }
+
+    return found;
+}
+
 float similarity(const std::string & s0, const std::string & s1) {
     const size_t len0 = s0.size() + 1;
     const size_t len1 = s1.size() + 1;
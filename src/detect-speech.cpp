@@ -0,0 +1,105 @@
+#include "detect-speech.h"
+#include "ffmpeg-transcode.h"
+#include "vad-model.h"
+
+#include <cstdio>
+
+struct detect_speech_context {
+    struct whisper_vad_context * vctx = nullptr;
+    scan_params sp;
+    bool probe = false;
+    bool packet_hints = false;
+    // window of the streaming scan, kept between files
+    std::vector<float> work;
+};
+
+struct detect_speech_context * detect_speech_init(const char * model_path, const detect_speech_config & config) {
+    // the same limits as the tool, a window of no samples would never advance the scan
+    if (!(config.window_min_seconds >= 0.1f) || !(config.window_max_seconds >= config.window_min_seconds) ||
+        !(config.overlap_seconds >= 0.0f)) {
+        fprintf(stderr, "%s: invalid VAD windows, expected 0.1 <= window_min_seconds <= window_max_seconds and overlap_seconds >= 0\n", __func__);
+        return nullptr;
+    }
+
+    struct whisper_vad_context_params vparams = whisper_vad_default_context_params();
+    if (config.n_threads > 0) {
+        vparams.n_threads = config.n_threads;
+    }
+    vparams.use_gpu = config.use_gpu;
+    vparams.gpu_device = config.gpu_device;
+
+    struct whisper_vad_context * vctx = vad_model_init(model_path ? model_path : "", vparams);
+    if (vctx == nullptr) {
+        fprintf(stderr, "%s: failed to initialize VAD context using model from %s\n", __func__, model_path ? model_path : "the binary");
+        return nullptr;
+    }
+
+    detect_speech_context * ctx = new detect_speech_context;
+    ctx->vctx = vctx;
+    ctx->probe = config.probe;
+    ctx->packet_hints = config.packet_hints;
+
+    scan_params & sp = ctx->sp;
+    sp.vad_params = config.vad_params;
+    sp.overlap_samples = (int)(config.overlap_seconds * WHISPER_SAMPLE_RATE);
+    sp.min_window_samples = (int)(config.window_min_seconds * WHISPER_SAMPLE_RATE);
+    sp.max_window_samples = (int)(config.window_max_seconds * WHISPER_SAMPLE_RATE);
+    sp.pregate = config.pregate;
+    sp.pregate_thold = config.pregate_thold;
+    sp.call_trim_start = config.trim_start;
+    sp.call_trim_end = config.trim_end;
+    sp.work_buffer = &ctx->work;
+
+    // the window can hold up to max_window_samples next to the context
+    ctx->work.reserve(sp.max_window_samples + sp.min_window_samples + sp.overlap_samples);
+
+    return ctx;
+}
+
+void detect_speech_free(struct detect_speech_context * ctx) {
+    if (ctx == nullptr) {
+        return;
+    }
+    whisper_vad_free(ctx->vctx);
+    delete ctx;
+}
+
+bool detect_edges(struct detect_speech_context * ctx, const float * samples, size_t n_samples, speech_edges & edges) {
+    edges = speech_edges();
+    return detect_speech_in_memory(samples, n_samples, ctx->vctx, ctx->sp, edges);
+}
+
+bool detect_edges_file(struct detect_speech_context * ctx, const std::string & path, speech_edges & edges) {
+    edges = speech_edges();
+    if (ctx->packet_hints && path != "-") {
+        if (detect_speech_hinted(path, ctx->vctx, ctx->sp, edges)) {
+            return true;
+        }
+        edges = speech_edges();
+    }
+    if (ctx->probe && path != "-") {
+        if (detect_speech_probing(path, ctx->vctx, ctx->sp, edges)) {
+            return true;
+        }
+        edges = speech_edges();
+    }
+    return detect_speech_streaming(path, ctx->vctx, ctx->sp, edges);
+}
+
+bool detect_speech_trim(const std::string & ifname, const std::string & ofname, const speech_edges & edges,
+                        float smart_cut_tolerance) {
+    const bool to_eof = !edges.duration_known || edges.final_end_seconds >= edges.total_duration_seconds;
+    const double t1 = to_eof ? -1.0 : edges.final_end_seconds;
+    if (smart_cut_tolerance >= 0.0f) {
+        return ffmpeg_trim_smart(ifname, ofname, edges.final_start_seconds, t1, smart_cut_tolerance) == 0;
+    }
+    return ffmpeg_trim_copy(ifname, ofname, edges.final_start_seconds, t1) == 0;
+}
+
+bool detect_speech_concat(const std::string & ifname, const std::string & ofname, const std::vector<vad_segment> & keep) {
+    std::vector<ffmpeg_time_range> ranges;
+    for (const vad_segment & k : keep) {
+        ranges.push_back({ k.t0, k.t1 });
+    }
+    return ffmpeg_concat_ranges(ifname, ofname, ranges) == 0;
+}
@@ -10,6 +10,8 @@
 // Just for conveninent C++ API
 #include <vector>
 #include <string>
+#include <functional>
+#include <algorithm>
 
 // C
 #include <stdio.h>
@@ -22,6 +24,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <errno.h>
+
+#include "ffmpeg-transcode.h"
+#include "resample.h"
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -40,120 +46,332 @@ typedef uint8_t   u8;
 typedef int8_t    s8;
 
 #define WAVE_SAMPLE_RATE	16000
-#define AVIO_CTX_BUF_SZ		 4096
+#define AVIO_CTX_BUF_SZ		(256 * 1024)
 
 static const char* ffmpegLog = getenv("FFMPEG_LOG");
+/* size of the AVIOContext buffer, i.e. of every read from the input */
+static const char* ffmpegAvioBufSz = getenv("FFMPEG_AVIO_BUF_SZ");
 // Todo: add __FILE__ __LINE__
 #define LOG(...) \
   do { if (ffmpegLog) fprintf(stderr, __VA_ARGS__); } while(0) // C99
 
 /*
- * WAVE file header based on definition from
- * https://gist.github.com/Jon-Schneider/8b7c53d27a7a13346a643dac9c19d34f
- *
- * We must ensure this structure doesn't have any holes or
- * padding so we can just map it straight to the WAVE data.
+ * Input of the custom AVIOContext: either a read only mapping of a regular
+ * file, which can seek, or a descriptor that is read from as a stream, for
+ * pipes and stdin.
  */
-struct wave_hdr {
-	/* RIFF Header: "RIFF" */
-	char riff_header[4];
-	/* size of audio data + sizeof(struct wave_hdr) - 8 */
-	int wav_size;
-	/* "WAVE" */
-	char wav_header[4];
-
-	/* Format Header */
-	/* "fmt " (includes trailing space) */
-	char fmt_header[4];
-	/* Should be 16 for PCM */
-	int fmt_chunk_size;
-	/* Should be 1 for PCM. 3 for IEEE Float */
-	s16 audio_format;
-	s16 num_channels;
-	int sample_rate;
-	/*
-	 * Number of bytes per second
-	 * sample_rate * num_channels * bit_depth/8
-	 */
-	int byte_rate;
-	/* num_channels * bytes per sample */
-	s16 sample_alignment;
-	/* bits per sample */
-	s16 bit_depth;
-
-	/* Data Header */
-	/* "data" */
-	char data_header[4];
-	/*
-	 * size of audio
-	 * number of samples * num_channels * bit_depth/8
-	 */
-	int data_bytes;
-} __attribute__((__packed__));
-
 struct audio_buffer {
-	u8 *ptr;
-	int size; /* size left in the buffer */
+	const u8 *base; /* NULL when reading from fd */
+	size_t size;
+	size_t pos;
+	int fd;
+	int tee_fd; /* when reading from fd, everything read is copied here too */
 };
 
-static void set_wave_hdr(wave_hdr& wh, size_t size) {
-    memcpy(&wh.riff_header, "RIFF", 4);
-    wh.wav_size = size + sizeof(struct wave_hdr) - 8;
-    memcpy(&wh.wav_header, "WAVE", 4);
-    memcpy(&wh.fmt_header, "fmt ", 4);
-    wh.fmt_chunk_size = 16;
-    wh.audio_format = 1;
-    wh.num_channels = 1;
-    wh.sample_rate = WAVE_SAMPLE_RATE;
-    wh.sample_alignment = 2;
-    wh.bit_depth = 16;
-    wh.byte_rate = wh.sample_rate * wh.sample_alignment;
-    memcpy(&wh.data_header, "data", 4);
-    wh.data_bytes = size;
+static int write_all(int fd, const u8 *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		size -= n;
+	}
+
+	return 0;
 }
 
-static void write_wave_hdr(int fd, size_t size) {
-	struct wave_hdr wh;
-    set_wave_hdr(wh, size);
-	write(fd, &wh, sizeof(struct wave_hdr));
+static int avio_buffer_size(void)
+{
+	long size = ffmpegAvioBufSz ? atol(ffmpegAvioBufSz) : 0;
+
+	if (size < 4096 || size > (64 << 20))
+		return AVIO_CTX_BUF_SZ;
+
+	return (int)size;
 }
 
-static int map_file(int fd, u8 **ptr, size_t *size)
+static int map_file(int fd, const u8 **ptr, size_t *size)
 {
 	struct stat sb;
 
-	fstat(fd, &sb);
+	if (fstat(fd, &sb) == -1) {
+		perror("fstat");
+		return -1;
+	}
+	if (sb.st_size <= 0) {
+		LOG("Input file is empty\n");
+		return -1;
+	}
 	*size = sb.st_size;
 
-    *ptr = (u8*)mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-	if (*ptr == MAP_FAILED) {
+	void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
 		perror("mmap");
 		return -1;
 	}
+	/* the demuxer reads front to back apart from the odd seek for an index */
+	madvise(map, *size, MADV_SEQUENTIAL);
+	*ptr = (const u8 *)map;
 
 	return 0;
 }
 
 static int read_packet(void *opaque, u8 *buf, int buf_size)
 {
-    struct audio_buffer *audio_buf = (audio_buffer*)opaque;
+	struct audio_buffer *audio_buf = (audio_buffer*)opaque;
+
+	if (!audio_buf->base) {
+		ssize_t n;
+
+		do {
+			n = read(audio_buf->fd, buf, buf_size);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0)
+			return AVERROR(errno);
+		if (n > 0 && audio_buf->tee_fd >= 0 && write_all(audio_buf->tee_fd, buf, n) != 0)
+			return AVERROR(errno);
+
+		return n == 0 ? AVERROR_EOF : (int)n;
+	}
+
+	const size_t n = FFMIN((size_t)buf_size, audio_buf->size - audio_buf->pos);
+	if (n == 0)
+		return AVERROR_EOF;
+
+	memcpy(buf, audio_buf->base + audio_buf->pos, n);
+	audio_buf->pos += n;
+
+	return (int)n;
+}
+
+/* only installed for mapped files, a pipe can't seek */
+static s64 seek_packet(void *opaque, s64 offset, int whence)
+{
+	struct audio_buffer *audio_buf = (audio_buffer*)opaque;
+	s64 pos;
+
+	if (whence & AVSEEK_SIZE)
+		return audio_buf->size;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = (s64)audio_buf->pos + offset;
+		break;
+	case SEEK_END:
+		pos = (s64)audio_buf->size + offset;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (pos < 0 || pos > (s64)audio_buf->size)
+		return AVERROR(EINVAL);
+
+	audio_buf->pos = pos;
+
+	return pos;
+}
+
+/*
+ * Input format a resampler was set up for
+ */
+struct swr_key {
+	int sample_rate;
+	int sample_fmt;
+	bool keep_channels;
+	/* output at the input rate, for resampler_16k */
+	bool native_rate;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	AVChannelLayout ch_layout;
+#else
+	int channels;
+	u64 channel_layout;
+#endif
+};
+
+static bool swr_key_equal(const struct swr_key *a, const struct swr_key *b)
+{
+	if (a->sample_rate != b->sample_rate || a->sample_fmt != b->sample_fmt ||
+	    a->keep_channels != b->keep_channels || a->native_rate != b->native_rate)
+		return false;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	return av_channel_layout_compare(&a->ch_layout, &b->ch_layout) == 0;
+#else
+	return a->channels == b->channels && a->channel_layout == b->channel_layout;
+#endif
+}
+
+/*
+ * Decoder state kept per thread from one file to the next: the packet and
+ * frame, the output pointers of planar conversion, the chunk remainder of
+ * the chunked decoder, the polyphase resampler with its scratch buffer and
+ * the last swr resampler with the format it converts from. A file in the
+ * same format as the previous one gets that resampler back, reset by
+ * swr_init(), instead of a new one. Decoding isn't reentrant within a
+ * thread, so one set per thread is enough.
+ */
+struct decoder_cache {
+	AVPacket *packet = NULL;
+	AVFrame *frame = NULL;
+	struct SwrContext *swr = NULL;
+	struct swr_key key;
+	bool swr_key_valid = false;
+	std::vector<u8 *> planes;
+	std::vector<float> chunk_data;
+	struct resampler_16k resampler;
+	std::vector<float> native;
+
+	~decoder_cache()
+	{
+		av_packet_free(&packet);
+		av_frame_free(&frame);
+		swr_free(&swr);
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+		if (swr_key_valid)
+			av_channel_layout_uninit(&key.ch_layout);
+#endif
+	}
+};
+
+static thread_local struct decoder_cache g_decoder_cache;
+
+static void decoder_cache_get(AVPacket **packet, AVFrame **frame)
+{
+	struct decoder_cache *cache = &g_decoder_cache;
+
+	if (!cache->packet)
+		cache->packet = av_packet_alloc();
+	if (!cache->frame)
+		cache->frame = av_frame_alloc();
+	*packet = cache->packet;
+	*frame = cache->frame;
+}
+
+static void decoder_cache_put(AVPacket *packet, AVFrame *frame)
+{
+	if (packet)
+		av_packet_unref(packet);
+	if (frame)
+		av_frame_unref(frame);
+}
+
+static void swr_key_from_codec(const AVCodecContext *codec, bool keep_channels, bool native_rate,
+			       struct swr_key *key)
+{
+	key->sample_rate = codec->sample_rate;
+	key->sample_fmt = codec->sample_fmt;
+	key->keep_channels = keep_channels;
+	key->native_rate = native_rate;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	memset(&key->ch_layout, 0, sizeof(key->ch_layout));
+	av_channel_layout_copy(&key->ch_layout, &codec->ch_layout);
+#else
+	key->channels = codec->channels;
+	key->channel_layout = codec->channel_layout;
+#endif
+}
+
+static void swr_key_free(struct swr_key *key)
+{
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	av_channel_layout_uninit(&key->ch_layout);
+#else
+	(void)key;
+#endif
+}
+
+/*
+ * Take the cached resampler if it converts from the format key describes,
+ * reset so no samples of the previous file are left in it
+ */
+static struct SwrContext *swr_cache_take(const struct swr_key *key)
+{
+	struct decoder_cache *cache = &g_decoder_cache;
+	struct SwrContext *swr;
 
-	buf_size = FFMIN(buf_size, audio_buf->size);
+	if (!cache->swr || !cache->swr_key_valid || !swr_key_equal(&cache->key, key))
+		return NULL;
 
-	/* copy internal buffer data to buf */
-	memcpy(buf, audio_buf->ptr, buf_size);
-	audio_buf->ptr += buf_size;
-	audio_buf->size -= buf_size;
+	swr = cache->swr;
+	cache->swr = NULL;
+	if (swr_init(swr) < 0 || !swr_is_initialized(swr)) {
+	    swr_free(&swr);
+	    return NULL;
+	}
+
+	return swr;
+}
+
+/*
+ * Keep a resampler for the next file, replacing the cached one
+ */
+static void swr_cache_put(struct SwrContext *swr, const AVCodecContext *codec, bool keep_channels,
+			  bool native_rate)
+{
+	struct decoder_cache *cache = &g_decoder_cache;
 
-	return buf_size;
+	swr_free(&cache->swr);
+	if (cache->swr_key_valid)
+		swr_key_free(&cache->key);
+	cache->swr = swr;
+	swr_key_from_codec(codec, keep_channels, native_rate, &cache->key);
+	cache->swr_key_valid = true;
 }
 
+/*
+ * Resample one frame and append it to data. The resampler writes straight
+ * into the spare capacity at the end of data, so there is no intermediate
+ * buffer to copy from. With rs set swr only mixes down and converts to float
+ * at the input rate, into the scratch buffer rs resamples from.
+ */
 static void convert_frame(struct SwrContext *swr, AVCodecContext *codec,
-			  AVFrame *frame, std::vector<s16> &data, bool flush)
+			  AVFrame *frame, std::vector<float> &data, bool flush,
+			  struct resampler_16k *rs = NULL)
+{
+	int nr_samples;
+	s64 delay;
+	u8 *out;
+	const int out_rate = rs ? codec->sample_rate : WAVE_SAMPLE_RATE;
+	std::vector<float> &dst = rs ? g_decoder_cache.native : data;
+
+	delay = swr_get_delay(swr, codec->sample_rate);
+	nr_samples = av_rescale_rnd(delay + (flush ? 0 : frame->nb_samples),
+				    out_rate, codec->sample_rate,
+				    AV_ROUND_UP);
+    if (nr_samples > 0) {
+        const size_t old_size = rs ? 0 : dst.size();
+        dst.resize(old_size + nr_samples);
+        out = (u8 *)(dst.data() + old_size);
+
+        /*
+         * !flush is used to check if we are flushing any remaining
+         * conversion buffers...
+         */
+        int converted = swr_convert(swr, &out, nr_samples,
+                                    !flush ? (const u8 **)frame->data : NULL,
+                                    !flush ? frame->nb_samples : 0);
+
+        dst.resize(old_size + std::max(converted, 0));
+        if (rs)
+            resampler_16k_process(*rs, dst.data(), dst.size(), data);
+    }
+    if (rs && flush)
+        resampler_16k_flush(*rs, data);
+}
+
+/*
+ * Same as convert_frame for planar output, one vector per channel.
+ */
+static void convert_frame_planar(struct SwrContext *swr, AVCodecContext *codec,
+				 AVFrame *frame, std::vector<std::vector<float>> &channels, bool flush)
 {
 	int nr_samples;
 	s64 delay;
-	u8 *buffer;
 
 	delay = swr_get_delay(swr, codec->sample_rate);
 	nr_samples = av_rescale_rnd(delay + (flush ? 0 : frame->nb_samples),
@@ -161,22 +379,44 @@ static void convert_frame(struct SwrContext *swr, AVCodecContext *codec,
 				    AV_ROUND_UP);
     if (nr_samples <= 0) return;
 
-	av_samples_alloc(&buffer, NULL, 1, nr_samples, AV_SAMPLE_FMT_S16, 0);
+    const size_t old_size = channels[0].size();
+    std::vector<u8 *> &out = g_decoder_cache.planes;
+    out.resize(channels.size());
+    for (size_t c = 0; c < channels.size(); c++) {
+        channels[c].resize(old_size + nr_samples);
+        out[c] = (u8 *)(channels[c].data() + old_size);
+    }
 
-	/*
-	 * !flush is used to check if we are flushing any remaining
-	 * conversion buffers...
-	 */
-	int converted = swr_convert(swr, &buffer, nr_samples,
-				 !flush ? (const u8 **)frame->data : NULL,
+	int converted = swr_convert(swr, out.data(), nr_samples,
+				 !flush ? (const u8 **)frame->extended_data : NULL,
 				 !flush ? frame->nb_samples : 0);
 
-    if (converted > 0) {
-        size_t old_size = data.size();
-        data.resize(old_size + converted);
-        memcpy(data.data() + old_size, buffer, converted * sizeof(s16));
+    for (std::vector<float> &channel : channels) {
+        channel.resize(old_size + std::max(converted, 0));
     }
-	av_freep(&buffer);
+}
+
+/*
+ * Hand out complete chunks from the front of data and keep the remainder
+ * for the next call. With flush set the final, possibly short, chunk is
+ * delivered too.
+ * Returns false when the consumer asked to stop decoding.
+ */
+static bool drain_chunks(std::vector<float> &data, size_t n_chunk,
+			 const std::function<bool(const float *, size_t)> &cb, bool flush)
+{
+	size_t off = 0;
+	bool keep_going = true;
+
+	while (keep_going && (data.size() - off >= n_chunk || (flush && off < data.size()))) {
+		const size_t n = std::min(n_chunk, data.size() - off);
+
+		keep_going = cb(data.data() + off, n);
+		off += n;
+	}
+	data.erase(data.begin(), data.begin() + off);
+
+	return keep_going;
 }
 
 static bool is_audio_stream(const AVStream *stream)
@@ -187,41 +427,25 @@ static bool is_audio_stream(const AVStream *stream)
 	return false;
 }
 
+// Find the first audio stream of an opened input and set up its decoder and a
+// resampler to 16 kHz mono, or to 16 kHz planar float with the channels of the
+// input when keep_channels is set. On failure nothing is left allocated except fmt_ctx,
+// which stays owned by the caller.
+// With rs set, mono input at another rate is left at its rate by swr and rs is set up
+// to resample it, rs->in_rate is 0 if swr resamples instead.
 // Return non zero on error, 0 on success
-// audio_buffer: input memory
-// data: decoded output audio data (vector of samples)
-static int decode_audio(struct audio_buffer *audio_buf, std::vector<s16> &data)
+static int open_audio_decoder(AVFormatContext *fmt_ctx, int *stream_index_out,
+			      AVCodecContext **codec_out, struct SwrContext **swr_out,
+			      bool keep_channels = false, struct resampler_16k *rs = NULL)
 {
-    LOG("decode_audio: input size: %d\n", audio_buf->size);
-	AVFormatContext *fmt_ctx = NULL;
-	AVIOContext *avio_ctx = NULL;
 	AVCodecContext *codec = NULL;
-	AVPacket *packet = NULL;
-	AVFrame *frame = NULL;
 	struct SwrContext *swr = NULL;
-	u8 *avio_ctx_buffer = NULL;
 	int stream_index = -1;
 	int err;
-    const size_t errbuffsize = 1024;
-    char errbuff[errbuffsize];
-
-    fmt_ctx = avformat_alloc_context();
-    avio_ctx_buffer = (u8*)av_malloc(AVIO_CTX_BUF_SZ);
-    LOG("Creating an avio context: AVIO_CTX_BUF_SZ=%d\n", AVIO_CTX_BUF_SZ);
-    avio_ctx = avio_alloc_context(avio_ctx_buffer, AVIO_CTX_BUF_SZ, 0, audio_buf, &read_packet, NULL, NULL);
-	fmt_ctx->pb = avio_ctx;
-
-    // open the input stream and read header
-	err = avformat_open_input(&fmt_ctx, NULL, NULL, NULL);
-	if (err) {
-        LOG("Could not read audio buffer: %d: %s\n", err, av_make_error_string(errbuff, errbuffsize, err));
-        return err;
-	}
 
 	err = avformat_find_stream_info(fmt_ctx, NULL);
 	if (err < 0) {
         LOG("Could not retrieve stream info from audio buffer: %d\n", err);
-        avformat_close_input(&fmt_ctx);
         return err;
 	}
 
@@ -234,7 +458,6 @@ static int decode_audio(struct audio_buffer *audio_buf, std::vector<s16> &data)
 
 	if (stream_index == -1) {
         LOG("Could not retrieve audio stream from buffer\n");
-        avformat_close_input(&fmt_ctx);
 		return -1;
 	}
 
@@ -242,7 +465,6 @@ static int decode_audio(struct audio_buffer *audio_buf, std::vector<s16> &data)
     const AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
     if (!decoder) {
         LOG("Failed to find decoder for stream #%d\n", stream_index);
-        avformat_close_input(&fmt_ctx);
         return -1;
     }
 
@@ -252,35 +474,55 @@ static int decode_audio(struct audio_buffer *audio_buf, std::vector<s16> &data)
 	if (err) {
         LOG("Failed to open decoder for stream #%d in audio buffer\n", stream_index);
         avcodec_free_context(&codec);
-        avformat_close_input(&fmt_ctx);
         return err;
 	}
 
+	bool native_rate = false;
+	if (rs) {
+		rs->in_rate = 0;
+		native_rate = !keep_channels && resampler_16k_init(*rs, codec->sample_rate);
+	}
+	const int out_rate = native_rate ? codec->sample_rate : WAVE_SAMPLE_RATE;
+
+	/* reuse the resampler of the previous file if it has the same input format */
+	struct swr_key key;
+	swr_key_from_codec(codec, keep_channels, native_rate, &key);
+	swr = swr_cache_take(&key);
+	swr_key_free(&key);
+	if (swr) {
+		*stream_index_out = stream_index;
+		*codec_out = codec;
+		*swr_out = swr;
+		return 0;
+	}
+
 	/* prepare resampler */
 	swr = swr_alloc();
 
 #if LIBAVCODEC_VERSION_MAJOR >= 59
 	AVChannelLayout in_ch_layout = codec->ch_layout;
 	AVChannelLayout out_ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_MONO;
+	if (keep_channels)
+		out_ch_layout = in_ch_layout;
 
 	/* Set the source audio layout as-is */
 	av_opt_set_chlayout(swr, "in_chlayout", &in_ch_layout, 0);
 	av_opt_set_int(swr, "in_sample_rate", codec->sample_rate, 0);
 	av_opt_set_sample_fmt(swr, "in_sample_fmt", codec->sample_fmt, 0);
 
-	/* Convert it into 16khz Mono */
+	/* Convert it into 16khz Mono, or planar with the input channels */
 	av_opt_set_chlayout(swr, "out_chlayout", &out_ch_layout, 0);
-	av_opt_set_int(swr, "out_sample_rate", WAVE_SAMPLE_RATE, 0);
-	av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+	av_opt_set_int(swr, "out_sample_rate", out_rate, 0);
+	av_opt_set_sample_fmt(swr, "out_sample_fmt", keep_channels ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT, 0);
 #else
 	av_opt_set_int(swr, "in_channel_count", codec->channels, 0);
-	av_opt_set_int(swr, "out_channel_count", 1, 0);
+	av_opt_set_int(swr, "out_channel_count", keep_channels ? codec->channels : 1, 0);
 	av_opt_set_int(swr, "in_channel_layout", codec->channel_layout, 0);
-	av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
+	av_opt_set_int(swr, "out_channel_layout", keep_channels ? codec->channel_layout : AV_CH_LAYOUT_MONO, 0);
 	av_opt_set_int(swr, "in_sample_rate", codec->sample_rate, 0);
-	av_opt_set_int(swr, "out_sample_rate", WAVE_SAMPLE_RATE, 0);
+	av_opt_set_int(swr, "out_sample_rate", out_rate, 0);
 	av_opt_set_sample_fmt(swr, "in_sample_fmt", codec->sample_fmt, 0);
-	av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+	av_opt_set_sample_fmt(swr, "out_sample_fmt", keep_channels ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT, 0);
 #endif
 
 	swr_init(swr);
@@ -288,88 +530,1278 @@ static int decode_audio(struct audio_buffer *audio_buf, std::vector<s16> &data)
         LOG("Resampler has not been properly initialized\n");
         swr_free(&swr);
         avcodec_free_context(&codec);
-        avformat_close_input(&fmt_ctx);
 		return -1;
 	}
 
-	packet = av_packet_alloc();
-	frame = av_frame_alloc();
+	*stream_index_out = stream_index;
+	*codec_out = codec;
+	*swr_out = swr;
+
+	return 0;
+}
+
+// Return non zero on error, 0 on success
+// audio_buffer: input memory
+// data: decoded output audio data (vector of samples)
+// cb: when set, data is drained in chunks of n_chunk samples as soon as they
+//     are decoded, so only about one chunk is held in memory at a time
+// channels: when set, the audio is decoded into it, one vector per channel of
+//     the input, instead of being mixed down into data
+static int decode_audio(struct audio_buffer *audio_buf, std::vector<float> &data,
+			size_t n_chunk = 0, const std::function<bool(const float *, size_t)> *cb = NULL,
+			std::vector<std::vector<float>> *channels = NULL)
+{
+    LOG("decode_audio: input size: %zu%s\n", audio_buf->size, audio_buf->base ? "" : " (stream)");
+	AVFormatContext *fmt_ctx = NULL;
+	AVIOContext *avio_ctx = NULL;
+	AVCodecContext *codec = NULL;
+	AVPacket *packet = NULL;
+	AVFrame *frame = NULL;
+	struct SwrContext *swr = NULL;
+	u8 *avio_ctx_buffer = NULL;
+	int stream_index = -1;
+	int err;
+    const size_t errbuffsize = 1024;
+    char errbuff[errbuffsize];
+
+    const int avio_buf_size = avio_buffer_size();
+    fmt_ctx = avformat_alloc_context();
+    avio_ctx_buffer = (u8*)av_malloc(avio_buf_size);
+    LOG("Creating an avio context: buffer size=%d\n", avio_buf_size);
+    avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_buf_size, 0, audio_buf, &read_packet, NULL,
+                                  audio_buf->base ? &seek_packet : NULL);
+	fmt_ctx->pb = avio_ctx;
+
+    // open the input stream and read header
+	err = avformat_open_input(&fmt_ctx, NULL, NULL, NULL);
+	if (err) {
+        LOG("Could not read audio buffer: %d: %s\n", err, av_make_error_string(errbuff, errbuffsize, err));
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        return err;
+	}
+
+	struct resampler_16k *rs = &g_decoder_cache.resampler;
+	err = open_audio_decoder(fmt_ctx, &stream_index, &codec, &swr, channels != NULL, rs);
+	if (err) {
+        avformat_close_input(&fmt_ctx);
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        return err;
+	}
+
+	if (rs->in_rate > 0) {
+        resample_note_path(rs->path);
+	} else {
+        rs = NULL;
+        resample_note_path(codec->sample_rate == WAVE_SAMPLE_RATE ? "1:1" : "swr");
+	}
+
+	if (channels) {
+        /* keep the capacity of vectors reused from a previous file */
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+        channels->resize(codec->ch_layout.nb_channels);
+#else
+        channels->resize(codec->channels);
+#endif
+        for (std::vector<float> &channel : *channels)
+            channel.clear();
+        if (fmt_ctx->duration != AV_NOPTS_VALUE) {
+            for (std::vector<float> &channel : *channels) {
+                channel.reserve(av_rescale(fmt_ctx->duration, WAVE_SAMPLE_RATE, AV_TIME_BASE) + WAVE_SAMPLE_RATE);
+            }
+        }
+	}
+
+	decoder_cache_get(&packet, &frame);
 
 	/* iterate through frames */
+    bool keep_going = true;
     data.clear();
-    data.reserve(audio_buf->size / 2); // heuristic
-	while (av_read_frame(fmt_ctx, packet) >= 0) {
+    if (cb) {
+        data.reserve(n_chunk * 2);
+    } else if (fmt_ctx->duration != AV_NOPTS_VALUE) {
+        /* one extra second for the resampler and inaccurate durations */
+        data.reserve(av_rescale(fmt_ctx->duration, WAVE_SAMPLE_RATE, AV_TIME_BASE) + WAVE_SAMPLE_RATE);
+    }
+	while (keep_going && av_read_frame(fmt_ctx, packet) >= 0) {
         if (packet->stream_index == stream_index) {
 		    avcodec_send_packet(codec, packet);
 
 		    while (avcodec_receive_frame(codec, frame) == 0) {
-		        convert_frame(swr, codec, frame, data, false);
+		        if (channels)
+		            convert_frame_planar(swr, codec, frame, *channels, false);
+		        else
+		            convert_frame(swr, codec, frame, data, false, rs);
+            }
+            if (cb) {
+                keep_going = drain_chunks(data, n_chunk, *cb, false);
             }
         }
         av_packet_unref(packet);
 	}
-	/* Flush any remaining conversion buffers... */
-	convert_frame(swr, codec, frame, data, true);
+	if (keep_going) {
+	    /* Flush any remaining conversion buffers... */
+	    if (channels)
+	        convert_frame_planar(swr, codec, frame, *channels, true);
+	    else
+	        convert_frame(swr, codec, frame, data, true, rs);
+	    if (cb) {
+	        drain_chunks(data, n_chunk, *cb, true);
+	    }
+	}
 
-	av_packet_free(&packet);
-	av_frame_free(&frame);
-	swr_free(&swr);
+	decoder_cache_put(packet, frame);
+	swr_cache_put(swr, codec, channels != NULL, rs != NULL);
 	avcodec_free_context(&codec);
 	avformat_close_input(&fmt_ctx);
 
 	if (avio_ctx) {
 		av_freep(&avio_ctx->buffer);
-		av_freep(&avio_ctx);
+		avio_context_free(&avio_ctx);
 	}
 
 	return 0;
 }
 
-// in mem decoding/conversion/resampling:
-// ifname: input file path
-// owav_data: in mem wav file. Can be forwarded as it to whisper/drwav
-// return 0 on success
-int ffmpeg_decode_audio(const std::string &ifname, std::vector<uint8_t>& owav_data) {
-    LOG("ffmpeg_decode_audio: %s\n", ifname.c_str());
+// run decode_audio over ifname, see decode_audio for the arguments
+// regular files are mapped and seekable, anything else (pipes, "-" for stdin)
+// is read front to back from the descriptor and copied to tee_fd if set
+static int decode_file(const std::string &ifname, std::vector<float> &odata,
+		       size_t n_chunk, const std::function<bool(const float *, size_t)> *cb,
+		       std::vector<std::vector<float>> *channels = NULL, int tee_fd = -1)
+{
+    struct audio_buffer inaudio_buf = { NULL, 0, 0, -1, tee_fd };
+
+    if (ifname == "-") {
+        inaudio_buf.fd = STDIN_FILENO;
+        return decode_audio(&inaudio_buf, odata, n_chunk, cb, channels);
+    }
+
     int ifd = open(ifname.c_str(), O_RDONLY);
     if (ifd == -1) {
         fprintf(stderr, "Couldn't open input file %s\n", ifname.c_str());
         return -1;
     }
-    u8 *ibuf = NULL;
+
+    struct stat sb;
+    if (fstat(ifd, &sb) == -1) {
+        fprintf(stderr, "Couldn't stat input file %s\n", ifname.c_str());
+        close(ifd);
+        return -1;
+    }
+
+    if (!S_ISREG(sb.st_mode)) {
+        LOG("Reading %s as a stream\n", ifname.c_str());
+        inaudio_buf.fd = ifd;
+        int err = decode_audio(&inaudio_buf, odata, n_chunk, cb, channels);
+        close(ifd);
+        return err;
+    }
+
+    const u8 *ibuf = NULL;
     size_t ibuf_size;
     int err = map_file(ifd, &ibuf, &ibuf_size);
+    close(ifd);
     if (err) {
         LOG("Couldn't map input file %s\n", ifname.c_str());
-        close(ifd);
         return err;
     }
     LOG("Mapped input file size: %zu\n", ibuf_size);
-    struct audio_buffer inaudio_buf;
-    inaudio_buf.ptr = ibuf;
+    inaudio_buf.base = ibuf;
     inaudio_buf.size = ibuf_size;
 
-    std::vector<s16> odata;
+    err = decode_audio(&inaudio_buf, odata, n_chunk, cb, channels);
+    munmap((void *)ibuf, ibuf_size);
 
-    err = decode_audio(&inaudio_buf, odata);
-    munmap(ibuf, ibuf_size);
-    close(ifd);
+    return err;
+}
+
+// streaming decoding/conversion/resampling:
+// ifname: input file path
+// n_chunk: number of 16 kHz mono samples handed to cb per call (the last call may be shorter)
+// cb: receives the decoded samples, returns false to stop decoding
+// tee_fd: when ifname is a stream, everything read from it is also written to tee_fd
+// return 0 on success
+int ffmpeg_decode_audio_chunked(const std::string &ifname, size_t n_chunk,
+				const std::function<bool(const float *, size_t)> &cb, int tee_fd) {
+    LOG("ffmpeg_decode_audio_chunked: %s\n", ifname.c_str());
+    if (n_chunk == 0) {
+        return -1;
+    }
+
+    std::vector<float> &odata = g_decoder_cache.chunk_data;
+
+    int err = decode_file(ifname, odata, n_chunk, &cb, NULL, tee_fd);
+    LOG("decode_audio returned %d \n", err);
+
+    return err;
+}
+
+// in mem decoding/conversion/resampling:
+// ifname: input file path
+// pcmf32: decoded mono 16 kHz float samples, written by the resampler directly
+// return 0 on success
+int ffmpeg_decode_audio(const std::string &ifname, std::vector<float> &pcmf32) {
+    LOG("ffmpeg_decode_audio: %s\n", ifname.c_str());
+
+    int err = decode_file(ifname, pcmf32, 0, NULL);
 
     LOG("decode_audio returned %d \n", err);
     if (err != 0) {
         LOG("decode_audio failed\n");
         return err;
     }
-    LOG("decode_audio output samples: %zu\n", odata.size());
+    LOG("decode_audio output samples: %zu\n", pcmf32.size());
+
+    return 0;
+}
+
+// in mem decoding/conversion/resampling keeping the channels apart:
+// ifname: input file path
+// channels: one vector of 16 kHz float samples per channel of the input
+// return 0 on success
+int ffmpeg_decode_audio_channels(const std::string &ifname, std::vector<std::vector<float>> &channels) {
+    LOG("ffmpeg_decode_audio_channels: %s\n", ifname.c_str());
+    std::vector<float> unused;
 
-    wave_hdr wh;
-    const size_t outdatasize = odata.size() * sizeof(s16);
-    set_wave_hdr(wh, outdatasize);
-    owav_data.resize(sizeof(wave_hdr) + outdatasize);
-    // header:
-    memcpy(owav_data.data(), &wh, sizeof(wave_hdr));
-    // the data:
-    memcpy(owav_data.data() + sizeof(wave_hdr), odata.data(), outdatasize);
+    int err = decode_file(ifname, unused, 0, NULL, &channels);
+
+    LOG("decode_audio returned %d \n", err);
+    if (err != 0) {
+        LOG("decode_audio failed\n");
+        return err;
+    }
+    LOG("decode_audio output channels: %zu, samples: %zu\n", channels.size(), channels.empty() ? (size_t)0 : channels[0].size());
 
     return 0;
 }
+
+/*
+ * Seekable reader used to decode only parts of a file, e.g. a window at the
+ * head and one at the tail. The input is opened through libavformat's own
+ * file protocol so that av_seek_frame() works.
+ */
+struct ffmpeg_audio_reader {
+	AVFormatContext *fmt_ctx;
+	AVCodecContext *codec;
+	struct SwrContext *swr;
+	AVPacket *packet;
+	AVFrame *frame;
+	int stream_index;
+	s64 start_pts; /* pts of the first sample, in stream time base */
+	std::vector<float> data;
+};
+
+ffmpeg_audio_reader *ffmpeg_reader_open(const std::string &ifname)
+{
+	LOG("ffmpeg_reader_open: %s\n", ifname.c_str());
+	AVFormatContext *fmt_ctx = NULL;
+	int err;
+
+	err = avformat_open_input(&fmt_ctx, ifname.c_str(), NULL, NULL);
+	if (err) {
+		LOG("Could not open %s: %d\n", ifname.c_str(), err);
+		return NULL;
+	}
+
+	ffmpeg_audio_reader *reader = new ffmpeg_audio_reader();
+	reader->fmt_ctx = fmt_ctx;
+
+	err = open_audio_decoder(fmt_ctx, &reader->stream_index, &reader->codec, &reader->swr);
+	if (err) {
+		avformat_close_input(&fmt_ctx);
+		delete reader;
+		return NULL;
+	}
+
+	AVStream *stream = fmt_ctx->streams[reader->stream_index];
+	reader->start_pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+	reader->packet = av_packet_alloc();
+	reader->frame = av_frame_alloc();
+
+	return reader;
+}
+
+void ffmpeg_reader_close(ffmpeg_audio_reader *reader)
+{
+	if (!reader)
+		return;
+
+	av_packet_free(&reader->packet);
+	av_frame_free(&reader->frame);
+	swr_free(&reader->swr);
+	avcodec_free_context(&reader->codec);
+	avformat_close_input(&reader->fmt_ctx);
+	delete reader;
+}
+
+// duration of the audio stream in seconds, negative if the container doesn't know it
+double ffmpeg_reader_duration(const ffmpeg_audio_reader *reader)
+{
+	const AVStream *stream = reader->fmt_ctx->streams[reader->stream_index];
+
+	if (stream->duration != AV_NOPTS_VALUE)
+		return stream->duration * av_q2d(stream->time_base);
+	if (reader->fmt_ctx->duration != AV_NOPTS_VALUE)
+		return reader->fmt_ctx->duration / (double)AV_TIME_BASE;
+
+	return -1.0;
+}
+
+// decode the [t0, t1) seconds range as 16 kHz mono, t1 < 0 reads until the end of the stream
+// pcmf32: output samples, shorter than requested if the stream ends early
+// pcmf32[0] is always at t0: if the seek lands after it, the front is padded with zeros
+// return 0 on success
+int ffmpeg_reader_read_range(ffmpeg_audio_reader *reader, double t0, double t1, std::vector<float> &pcmf32)
+{
+	LOG("ffmpeg_reader_read_range: %.3f - %.3f\n", t0, t1);
+	AVStream *stream = reader->fmt_ctx->streams[reader->stream_index];
+	const s64 first = (s64)(t0 * WAVE_SAMPLE_RATE);
+	const s64 last = t1 < 0 ? INT64_MAX : (s64)(t1 * WAVE_SAMPLE_RATE);
+	/* start decoding a bit early so the decoder has converged at t0 */
+	const double preroll = 0.1;
+	s64 pos = -1; /* absolute 16 kHz sample index of data[0] */
+	int err;
+
+	pcmf32.clear();
+
+	s64 ts = reader->start_pts + av_rescale_q((s64)(std::max(0.0, t0 - preroll) * AV_TIME_BASE),
+						  AV_TIME_BASE_Q, stream->time_base);
+	err = av_seek_frame(reader->fmt_ctx, reader->stream_index, ts, AVSEEK_FLAG_BACKWARD);
+	if (err < 0) {
+		LOG("Seek failed (%d), decoding from the start\n", err);
+		err = av_seek_frame(reader->fmt_ctx, reader->stream_index, reader->start_pts, AVSEEK_FLAG_BACKWARD);
+		if (err < 0)
+			return err;
+		pos = 0;
+	}
+	avcodec_flush_buffers(reader->codec);
+	/* drop whatever the resampler buffered before the seek */
+	swr_init(reader->swr);
+
+	std::vector<float> &data = reader->data;
+	data.clear();
+
+	bool done = false;
+	while (!done && av_read_frame(reader->fmt_ctx, reader->packet) >= 0) {
+		if (reader->packet->stream_index == reader->stream_index) {
+			avcodec_send_packet(reader->codec, reader->packet);
+
+			while (avcodec_receive_frame(reader->codec, reader->frame) == 0) {
+				if (pos < 0) {
+					s64 pts = reader->frame->best_effort_timestamp;
+					pts = pts != AV_NOPTS_VALUE ? pts - reader->start_pts : 0;
+					pos = av_rescale_q(pts, stream->time_base, AVRational{ 1, WAVE_SAMPLE_RATE });
+				}
+				convert_frame(reader->swr, reader->codec, reader->frame, data, false);
+			}
+
+			/* drop what lies before the window as we go */
+			if (pos >= 0 && pos + (s64)data.size() <= first) {
+				pos += data.size();
+				data.clear();
+			}
+			done = pos >= 0 && pos + (s64)data.size() >= last;
+		}
+		av_packet_unref(reader->packet);
+	}
+	if (!done)
+		convert_frame(reader->swr, reader->codec, reader->frame, data, true);
+	if (pos < 0)
+		pos = first;
+
+	const s64 begin = std::max(first, pos);
+	const s64 end = std::min(last, pos + (s64)data.size());
+	if (end > begin) {
+		/* the seek landed after t0, pad up to the first decoded sample so the callers' timestamps hold */
+		if (pos > first) {
+			LOG("Seek landed %lld samples after the window, padding with zeros\n", (long long)(pos - first));
+			pcmf32.assign(std::min(pos, last) - first, 0.0f);
+		}
+		pcmf32.insert(pcmf32.end(), data.begin() + (begin - pos), data.begin() + (end - pos));
+	}
+	LOG("ffmpeg_reader_read_range: %zu samples from %lld\n", pcmf32.size(), (long long)first);
+
+	return 0;
+}
+
+/*
+ * Packet activity: only the sizes and timestamps of the packets are read,
+ * nothing is decoded, see ffmpeg-transcode.h
+ */
+int ffmpeg_packet_activity(const std::string &ifname, double min_gap, std::vector<ffmpeg_time_range> &active, double &duration)
+{
+	LOG("ffmpeg_packet_activity: %s\n", ifname.c_str());
+	AVFormatContext *fmt_ctx = NULL;
+	AVPacket *packet = NULL;
+	int stream_index = -1;
+	int err;
+
+	struct packet_info {
+		double t0;
+		double t1;
+		int size;
+	};
+	std::vector<packet_info> packets;
+
+	active.clear();
+	duration = 0.0;
+
+	err = avformat_open_input(&fmt_ctx, ifname.c_str(), NULL, NULL);
+	if (err) {
+		fprintf(stderr, "Couldn't open input file %s\n", ifname.c_str());
+		return err;
+	}
+
+	err = avformat_find_stream_info(fmt_ctx, NULL);
+	if (err < 0) {
+		LOG("Could not retrieve stream info from %s: %d\n", ifname.c_str(), err);
+		avformat_close_input(&fmt_ctx);
+		return err;
+	}
+
+	for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+		if (stream_index == -1 && is_audio_stream(fmt_ctx->streams[i]))
+			stream_index = i;
+		else
+			fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+	}
+	if (stream_index == -1) {
+		LOG("Could not retrieve audio stream from %s\n", ifname.c_str());
+		avformat_close_input(&fmt_ctx);
+		return -1;
+	}
+	const AVStream *stream = fmt_ctx->streams[stream_index];
+	const double tb = av_q2d(stream->time_base);
+	const s64 start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+	packet = av_packet_alloc();
+	while (av_read_frame(fmt_ctx, packet) >= 0) {
+		if (packet->stream_index == stream_index && packet->pts != AV_NOPTS_VALUE) {
+			const double t = (packet->pts - start) * tb;
+			/* a packet without a duration lasts until the next one */
+			if (!packets.empty() && packets.back().t1 <= packets.back().t0)
+				packets.back().t1 = t;
+			packet_info info;
+			info.t0 = t;
+			info.t1 = packet->duration > 0 ? t + packet->duration * tb : t;
+			info.size = packet->size;
+			packets.push_back(info);
+		}
+		av_packet_unref(packet);
+	}
+	av_packet_free(&packet);
+	avformat_close_input(&fmt_ctx);
+
+	if (packets.empty()) {
+		LOG("No packets in %s\n", ifname.c_str());
+		return -1;
+	}
+	if (packets.size() > 1 && packets.back().t1 <= packets.back().t0) {
+		const packet_info &prev = packets[packets.size() - 2];
+		packets.back().t1 = packets.back().t0 + (prev.t1 - prev.t0);
+	}
+
+	std::vector<float> rates;
+	rates.reserve(packets.size());
+	for (const packet_info &p : packets) {
+		if (p.t1 > p.t0)
+			rates.push_back((float)(p.size / (p.t1 - p.t0)));
+	}
+	float quiet_rate = 0.0f;
+	if (!rates.empty()) {
+		std::vector<float>::iterator p95 = rates.begin() + (rates.size() - 1) * 95 / 100;
+		std::nth_element(rates.begin(), p95, rates.end());
+		quiet_rate = 0.25f * *p95;
+	}
+
+	size_t n_quiet = 0;
+	for (const packet_info &p : packets) {
+		duration = std::max(duration, p.t1);
+		const bool quiet = p.size <= 2 || (p.t1 > p.t0 && p.size / (p.t1 - p.t0) < quiet_rate);
+		if (quiet) {
+			n_quiet++;
+			continue;
+		}
+		if (!active.empty() && p.t0 - active.back().t1 < min_gap)
+			active.back().t1 = std::max(active.back().t1, p.t1);
+		else
+			active.push_back({ p.t0, p.t1 });
+	}
+	LOG("ffmpeg_packet_activity: %zu of %zu packets quiet, %zu active ranges, %.3f s\n",
+	    n_quiet, packets.size(), active.size(), duration);
+
+	return 0;
+}
+
+/*
+ * A smart cut decodes the packets a cut falls inside of and encodes the part
+ * of them that is kept again with the codec of the input, every other packet
+ * is stream copied. The re-encoded samples only splice with the copied packets
+ * without a gap or an overlap if the encoder can end a packet on any sample
+ * and adds no priming samples in front, so that is required of it.
+ */
+struct smart_cut {
+	AVCodecContext *dec;
+	const AVCodec *encoder;
+	AVFormatContext *ofmt_ctx;
+	AVStream *in_stream;
+	AVStream *out_stream;
+	AVFrame *frame;
+	AVPacket *out_packet;
+	/* the packet before the current one, decoded first as preroll */
+	AVPacket *prev;
+	s64 offset;
+};
+
+static int codec_channels(const AVCodecContext *codec)
+{
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	return codec->ch_layout.nb_channels;
+#else
+	return codec->channels;
+#endif
+}
+
+// return NULL if the encoder can't take the samples of the decoder as they are
+static AVCodecContext *open_cut_encoder(const struct smart_cut *sc)
+{
+	AVCodecContext *enc = avcodec_alloc_context3(sc->encoder);
+	if (!enc)
+		return NULL;
+
+	enc->sample_rate = sc->dec->sample_rate;
+	enc->sample_fmt = sc->dec->sample_fmt;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+	av_channel_layout_copy(&enc->ch_layout, &sc->dec->ch_layout);
+#else
+	enc->channels = sc->dec->channels;
+	enc->channel_layout = sc->dec->channel_layout;
+#endif
+	enc->bit_rate = sc->in_stream->codecpar->bit_rate;
+	enc->bits_per_raw_sample = sc->dec->bits_per_raw_sample;
+	enc->time_base = (AVRational){ 1, sc->dec->sample_rate };
+
+	if (avcodec_open2(enc, sc->encoder, NULL) < 0) {
+		avcodec_free_context(&enc);
+		return NULL;
+	}
+
+	return enc;
+}
+
+static void smart_cut_close(struct smart_cut *sc)
+{
+	avcodec_free_context(&sc->dec);
+	av_frame_free(&sc->frame);
+	av_packet_free(&sc->out_packet);
+	av_packet_free(&sc->prev);
+}
+
+// Set up the decoder and check that the codec has an encoder a cut can be
+// spliced with, see struct smart_cut.
+// Return 0 if smart cuts are possible
+static int smart_cut_open(struct smart_cut *sc)
+{
+	const AVCodecParameters *par = sc->in_stream->codecpar;
+	const AVCodec *decoder = avcodec_find_decoder(par->codec_id);
+	sc->encoder = avcodec_find_encoder(par->codec_id);
+	if (!decoder || !sc->encoder) {
+		LOG("No decoder and encoder for %s\n", avcodec_get_name(par->codec_id));
+		return -1;
+	}
+
+	sc->dec = avcodec_alloc_context3(decoder);
+	avcodec_parameters_to_context(sc->dec, par);
+	sc->dec->pkt_timebase = sc->in_stream->time_base;
+	if (avcodec_open2(sc->dec, decoder, NULL) < 0) {
+		LOG("Failed to open the %s decoder\n", decoder->name);
+		smart_cut_close(sc);
+		return -1;
+	}
+
+	AVCodecContext *enc = open_cut_encoder(sc);
+	if (!enc) {
+		LOG("The %s encoder doesn't take the samples of the decoder\n", sc->encoder->name);
+		smart_cut_close(sc);
+		return -1;
+	}
+	const bool any_length = enc->frame_size == 0 ||
+		(sc->encoder->capabilities & (AV_CODEC_CAP_VARIABLE_FRAME_SIZE | AV_CODEC_CAP_SMALL_LAST_FRAME));
+	const bool splices = any_length && enc->initial_padding == 0;
+	avcodec_free_context(&enc);
+	if (!splices) {
+		LOG("The %s encoder has a fixed frame size or an encoder delay\n", sc->encoder->name);
+		smart_cut_close(sc);
+		return -1;
+	}
+
+	sc->frame = av_frame_alloc();
+	sc->out_packet = av_packet_alloc();
+	sc->prev = av_packet_alloc();
+
+	return 0;
+}
+
+static int write_encoded(struct smart_cut *sc, AVCodecContext *enc)
+{
+	int err;
+	while ((err = avcodec_receive_packet(enc, sc->out_packet)) >= 0) {
+		av_packet_rescale_ts(sc->out_packet, enc->time_base, sc->out_stream->time_base);
+		sc->out_packet->stream_index = sc->out_stream->index;
+		err = av_interleaved_write_frame(sc->ofmt_ctx, sc->out_packet);
+		if (err < 0)
+			return err;
+	}
+	return err == AVERROR(EAGAIN) || err == AVERROR_EOF ? 0 : err;
+}
+
+static int send_cut_frame(struct smart_cut *sc, AVCodecContext *enc, AVFrame *out)
+{
+	int err = avcodec_send_frame(enc, out);
+	av_frame_unref(out);
+	if (err < 0)
+		return err;
+	return write_encoded(sc, enc);
+}
+
+// Decode packet and encode its samples in the [from, to) range of the stream
+// time base again, in place of the packet.
+// Return non zero on error, 0 on success
+static int smart_cut_packet(struct smart_cut *sc, const AVPacket *packet, s64 from, s64 to)
+{
+	const AVRational tb = sc->in_stream->time_base;
+	const AVRational sample_tb = { 1, sc->dec->sample_rate };
+	const int n_channels = codec_channels(sc->dec);
+	const s64 n_total = av_rescale_q(to - from, tb, sample_tb);
+
+	AVCodecContext *enc = open_cut_encoder(sc);
+	if (!enc)
+		return -1;
+	const int frame_size = enc->frame_size > 0 ? enc->frame_size : (int)std::max<s64>(n_total, 1);
+
+	AVFrame *out = av_frame_alloc();
+	s64 n_sent = 0;
+	int filled = 0;
+	int err = 0;
+
+	/* a fresh decoder state, primed with the packet before */
+	avcodec_flush_buffers(sc->dec);
+	if (sc->prev->data)
+		avcodec_send_packet(sc->dec, sc->prev);
+	avcodec_send_packet(sc->dec, packet);
+	avcodec_send_packet(sc->dec, NULL);
+
+	while (err >= 0 && avcodec_receive_frame(sc->dec, sc->frame) >= 0) {
+		AVFrame *frame = sc->frame;
+		if (frame->pts == AV_NOPTS_VALUE || frame->format != enc->sample_fmt) {
+			av_frame_unref(frame);
+			continue;
+		}
+		/* the samples of the frame that fall inside of the range */
+		int a = (int)std::max<s64>(0, av_rescale_q(from - frame->pts, tb, sample_tb));
+		const int b = (int)std::min<s64>(frame->nb_samples, av_rescale_q(to - frame->pts, tb, sample_tb));
+		while (a < b && n_sent + filled < n_total) {
+			if (filled == 0) {
+				out->format = enc->sample_fmt;
+				out->sample_rate = enc->sample_rate;
+				out->nb_samples = frame_size;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+				av_channel_layout_copy(&out->ch_layout, &enc->ch_layout);
+#else
+				out->channels = enc->channels;
+				out->channel_layout = enc->channel_layout;
+#endif
+				err = av_frame_get_buffer(out, 0);
+				if (err < 0)
+					break;
+			}
+			const int n = std::min(b - a, frame_size - filled);
+			av_samples_copy(out->extended_data, frame->extended_data, filled, a, n, n_channels, enc->sample_fmt);
+			filled += n;
+			a += n;
+			if (filled == frame_size) {
+				out->pts = av_rescale_q(from - sc->offset, tb, enc->time_base) + n_sent;
+				n_sent += filled;
+				filled = 0;
+				err = send_cut_frame(sc, enc, out);
+			}
+		}
+		av_frame_unref(frame);
+	}
+
+	if (err >= 0 && filled > 0) {
+		/* the short last frame, which ends right where the copied packets go on */
+		out->nb_samples = filled;
+		out->pts = av_rescale_q(from - sc->offset, tb, enc->time_base) + n_sent;
+		n_sent += filled;
+		err = send_cut_frame(sc, enc, out);
+	}
+	if (err >= 0)
+		err = avcodec_send_frame(enc, NULL);
+	if (err >= 0)
+		err = write_encoded(sc, enc);
+	LOG("smart cut: re-encoded %lld of %lld samples\n", (long long)n_sent, (long long)n_total);
+
+	av_frame_free(&out);
+	avcodec_free_context(&enc);
+
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Whether a cut of a packet codec (whose encoder can't be spliced, see
+ * smart_cut_open()) can be made sample accurate by marking the samples
+ * outside of it to be dropped instead, see trim_discard(). That takes a
+ * container that carries a start padding of any length and the length of the
+ * last packet to the decoder: Opus in Matroska, WebM, MP4 and Ogg, and AAC in
+ * MP4, where the padding becomes an edit list.
+ */
+static bool discard_cut_supported(const AVFormatContext *ofmt_ctx, const AVCodecParameters *par)
+{
+	const char *name = ofmt_ctx->oformat->name;
+	const bool mp4 = !strcmp(name, "mp4") || !strcmp(name, "mov") || !strcmp(name, "ipod");
+	const bool mkv = !strcmp(name, "matroska") || !strcmp(name, "webm");
+	const bool ogg = !strcmp(name, "ogg") || !strcmp(name, "oga") || !strcmp(name, "opus");
+
+	if (par->sample_rate <= 0)
+		return false;
+	if (par->codec_id == AV_CODEC_ID_OPUS)
+		return mp4 || mkv || ogg;
+	if (par->codec_id == AV_CODEC_ID_AAC)
+		return mp4;
+	return false;
+}
+
+/* the samples at the end of packet the decoder drops, as AV_PKT_DATA_SKIP_SAMPLES */
+static int mark_end_discard(AVPacket *packet, s64 n_samples)
+{
+	u8 *side = av_packet_new_side_data(packet, AV_PKT_DATA_SKIP_SAMPLES, 10);
+	if (!side)
+		return AVERROR(ENOMEM);
+	memset(side, 0, 10);
+	for (int i = 0; i < 4; i++)
+		side[4 + i] = (u8)((u32)n_samples >> (8 * i));
+	return 0;
+}
+
+/*
+ * The stream starts with n_samples the decoder drops. The OpusHead of Opus
+ * carries it as the pre-skip, which the Ogg and MP4 muxers write out as is.
+ */
+static void set_start_padding(AVStream *out_stream, int n_samples)
+{
+	AVCodecParameters *par = out_stream->codecpar;
+	par->initial_padding = n_samples;
+	if (par->codec_id == AV_CODEC_ID_OPUS && par->extradata_size >= 19 && !memcmp(par->extradata, "OpusHead", 8)) {
+		par->extradata[10] = (u8)(n_samples & 0xff);
+		par->extradata[11] = (u8)(n_samples >> 8);
+	}
+}
+
+/*
+ * The sample accurate cut of the packet codecs: the packets around the cuts are
+ * copied as they are and the samples outside of [first, last), in the stream
+ * time base, are dropped by the decoder. Nothing is re-encoded, so the audio
+ * stays bit exact. At the head the packet with first, and seek_preroll samples
+ * of packets before it for the decoder to settle, go out with timestamps
+ * before zero and the stream declares them as its start padding. At the tail
+ * the packet with last is shortened to end there and marks the rest with
+ * AV_PKT_DATA_SKIP_SAMPLES. A cut within tol of a packet boundary moves there.
+ * The muxer is set up but its header not written yet, the padding goes in it.
+ * return 0 on success
+ */
+static int trim_discard(AVFormatContext *ifmt_ctx, int stream_index, AVFormatContext *ofmt_ctx, AVStream *out_stream,
+			s64 first, s64 last, s64 tol, bool seek)
+{
+	AVStream *in_stream = ifmt_ctx->streams[stream_index];
+	const AVCodecParameters *par = in_stream->codecpar;
+	const AVRational tb = in_stream->time_base;
+	const AVRational sample_tb = { 1, par->sample_rate };
+	const s64 preroll = av_rescale_q(std::max(par->seek_preroll, par->frame_size > 0 ? par->frame_size : 1024), sample_tb, tb);
+	/* the packets from the preroll up to the one with first, held until the padding is known */
+	std::vector<AVPacket *> head;
+	AVPacket *packet = av_packet_alloc();
+	s64 offset = AV_NOPTS_VALUE;
+	bool done = false;
+	int err = 0;
+
+	if (!packet)
+		return AVERROR(ENOMEM);
+	if (seek && av_seek_frame(ifmt_ctx, stream_index, first - preroll, AVSEEK_FLAG_BACKWARD) < 0)
+		LOG("Seek failed, reading from the start\n");
+
+	/* shift a packet to the output timeline and write it, shortened if last falls inside of it */
+	auto write = [&](AVPacket *p) {
+		const s64 pts = p->pts != AV_NOPTS_VALUE ? p->pts : p->dts;
+		if (pts != AV_NOPTS_VALUE && pts >= last - tol) {
+			done = true;
+			return 0;
+		}
+		if (pts != AV_NOPTS_VALUE && p->duration > 0 && pts + p->duration - last > tol) {
+			const s64 cut = pts + p->duration - last;
+			int ret = mark_end_discard(p, av_rescale_q(cut, tb, sample_tb));
+			if (ret < 0)
+				return ret;
+			p->duration -= cut;
+			done = true;
+		}
+		if (p->pts != AV_NOPTS_VALUE)
+			p->pts -= offset;
+		if (p->dts != AV_NOPTS_VALUE)
+			p->dts -= offset;
+		av_packet_rescale_ts(p, tb, out_stream->time_base);
+		p->stream_index = out_stream->index;
+		p->pos = -1;
+		return av_interleaved_write_frame(ofmt_ctx, p);
+	};
+
+	while (!done && err >= 0 && av_read_frame(ifmt_ctx, packet) >= 0) {
+		if (packet->stream_index != stream_index) {
+			av_packet_unref(packet);
+			continue;
+		}
+		if (offset != AV_NOPTS_VALUE) {
+			err = write(packet);
+			av_packet_unref(packet);
+			continue;
+		}
+
+		const s64 pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+		const s64 end = pts != AV_NOPTS_VALUE && packet->duration > 0 ? pts + packet->duration : pts;
+		if (pts == AV_NOPTS_VALUE || end <= first - preroll) {
+			av_packet_unref(packet);
+			continue;
+		}
+		if (pts >= last - tol) {
+			av_packet_unref(packet);
+			break;
+		}
+		AVPacket *held = av_packet_clone(packet);
+		av_packet_unref(packet);
+		if (!held) {
+			err = AVERROR(ENOMEM);
+			break;
+		}
+		head.push_back(held);
+		/* a packet that ends right after first is preroll as well */
+		if (end <= first + tol)
+			continue;
+
+		s64 padding = 0;
+		if (first - pts <= tol) {
+			/* the cut moves to the start of this packet, the preroll isn't needed */
+			for (size_t i = 0; i + 1 < head.size(); i++)
+				av_packet_free(&head[i]);
+			head.erase(head.begin(), head.end() - 1);
+			offset = pts;
+		} else {
+			offset = first;
+			s64 head_pts = head.front()->pts != AV_NOPTS_VALUE ? head.front()->pts : head.front()->dts;
+			padding = av_rescale_q(first - head_pts, tb, sample_tb);
+			/* the OpusHead pre-skip has 16 bits */
+			while (padding > UINT16_MAX && head.size() > 1) {
+				av_packet_free(&head.front());
+				head.erase(head.begin());
+				head_pts = head.front()->pts != AV_NOPTS_VALUE ? head.front()->pts : head.front()->dts;
+				padding = av_rescale_q(first - head_pts, tb, sample_tb);
+			}
+			set_start_padding(out_stream, (int)padding);
+		}
+		LOG("discard cut: %lld samples of padding\n", (long long)padding);
+
+		err = avformat_write_header(ofmt_ctx, NULL);
+		if (err < 0) {
+			fprintf(stderr, "Couldn't write the header of the output\n");
+			break;
+		}
+		for (size_t i = 0; i < head.size() && err >= 0 && !done; i++)
+			err = write(head[i]);
+	}
+
+	for (AVPacket *held : head)
+		av_packet_free(&held);
+	av_packet_free(&packet);
+
+	/* nothing in the range, the output is as empty as that of a copy */
+	if (err >= 0 && offset == AV_NOPTS_VALUE)
+		err = avformat_write_header(ofmt_ctx, NULL);
+	if (err < 0) {
+		fprintf(stderr, "Couldn't write a packet of the output\n");
+		return err;
+	}
+	return av_write_trailer(ofmt_ctx);
+}
+
+/* open ifname for a stream copy and find its first audio stream */
+static int open_copy_input(const std::string &ifname, AVFormatContext **ifmt_ctx, int *stream_index)
+{
+	int err = avformat_open_input(ifmt_ctx, ifname.c_str(), NULL, NULL);
+	if (err) {
+		fprintf(stderr, "Couldn't open input file %s\n", ifname.c_str());
+		return err;
+	}
+
+	err = avformat_find_stream_info(*ifmt_ctx, NULL);
+	if (err < 0) {
+		LOG("Could not retrieve stream info from %s: %d\n", ifname.c_str(), err);
+		avformat_close_input(ifmt_ctx);
+		return err;
+	}
+
+	*stream_index = -1;
+	for (unsigned int i = 0; i < (*ifmt_ctx)->nb_streams; i++) {
+		if (is_audio_stream((*ifmt_ctx)->streams[i])) {
+			*stream_index = i;
+			break;
+		}
+	}
+	if (*stream_index == -1) {
+		LOG("Could not retrieve audio stream from %s\n", ifname.c_str());
+		avformat_close_input(ifmt_ctx);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create the muxer of ofname with one stream taking the packets of in_stream as
+ * they are. The container is chosen from the extension of ofname or is the
+ * input one. On error *ofmt_ctx may still have to be freed.
+ */
+static int open_copy_output(AVFormatContext *ifmt_ctx, AVStream *in_stream, const std::string &ofname,
+			    AVFormatContext **ofmt_ctx, AVStream **out_stream)
+{
+	avformat_alloc_output_context2(ofmt_ctx, NULL, NULL, ofname.c_str());
+	if (!*ofmt_ctx) {
+		/* no usable extension, fall back to the container of the input */
+		const std::string names = ifmt_ctx->iformat->name;
+		const std::string format_name = names.substr(0, names.find(','));
+		avformat_alloc_output_context2(ofmt_ctx, NULL, format_name.c_str(), ofname.c_str());
+	}
+	if (!*ofmt_ctx) {
+		fprintf(stderr, "Couldn't find an output format for %s\n", ofname.c_str());
+		return -1;
+	}
+
+	*out_stream = avformat_new_stream(*ofmt_ctx, NULL);
+	if (!*out_stream)
+		return AVERROR(ENOMEM);
+	int err = avcodec_parameters_copy((*out_stream)->codecpar, in_stream->codecpar);
+	if (err < 0)
+		return err;
+	/* let the muxer pick the tag that fits the output container */
+	(*out_stream)->codecpar->codec_tag = 0;
+	(*out_stream)->time_base = in_stream->time_base;
+	av_dict_copy(&(*ofmt_ctx)->metadata, ifmt_ctx->metadata, 0);
+	av_dict_copy(&(*out_stream)->metadata, in_stream->metadata, 0);
+	return 0;
+}
+
+static int open_copy_file(AVFormatContext *ofmt_ctx, const std::string &ofname)
+{
+	if (ofmt_ctx->oformat->flags & AVFMT_NOFILE)
+		return 0;
+	int err = avio_open(&ofmt_ctx->pb, ofname.c_str(), AVIO_FLAG_WRITE);
+	if (err < 0)
+		fprintf(stderr, "Couldn't open output file %s\n", ofname.c_str());
+	return err;
+}
+
+static void close_copy(AVFormatContext **ifmt_ctx, AVFormatContext *ofmt_ctx)
+{
+	if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&ofmt_ctx->pb);
+	avformat_free_context(ofmt_ctx);
+	avformat_close_input(ifmt_ctx);
+}
+
+/*
+ * The [t0, t1) seconds range of the first audio stream of ifname into ofname.
+ * With tolerance < 0 every packet is stream copied, otherwise a cut more than
+ * tolerance seconds from a packet boundary is a smart cut, or a discard cut for
+ * the codecs that can't be spliced, and one within it moves to that boundary.
+ * Where neither is possible it warns and cuts on packets.
+ * return 0 on success
+ */
+static int trim_file(const std::string &ifname, const std::string &ofname, double t0, double t1, double tolerance)
+{
+	AVFormatContext *ifmt_ctx = NULL;
+	AVFormatContext *ofmt_ctx = NULL;
+	AVStream *out_stream = NULL;
+	AVPacket *packet = NULL;
+	struct smart_cut sc = {};
+	bool smart = false;
+	bool discard = false;
+	int stream_index = -1;
+	int err;
+
+	err = open_copy_input(ifname, &ifmt_ctx, &stream_index);
+	if (err)
+		return err;
+	AVStream *in_stream = ifmt_ctx->streams[stream_index];
+
+	err = open_copy_output(ifmt_ctx, in_stream, ofname, &ofmt_ctx, &out_stream);
+	if (err < 0)
+		goto out;
+
+	if (tolerance >= 0) {
+		sc.ofmt_ctx = ofmt_ctx;
+		sc.in_stream = in_stream;
+		sc.out_stream = out_stream;
+		smart = smart_cut_open(&sc) == 0;
+		discard = !smart && discard_cut_supported(ofmt_ctx, in_stream->codecpar);
+		if (!smart && !discard)
+			fprintf(stderr, "Warning: no sample accurate cut for %s in %s, cutting %s on packets\n",
+				avcodec_get_name(in_stream->codecpar->codec_id), ofmt_ctx->oformat->name, ifname.c_str());
+	}
+
+	err = open_copy_file(ofmt_ctx, ofname);
+	if (err < 0)
+		goto out;
+
+	{
+		const s64 in_start = in_stream->start_time != AV_NOPTS_VALUE ? in_stream->start_time : 0;
+		const s64 first = in_start + av_rescale_q((s64)(t0 * AV_TIME_BASE), AV_TIME_BASE_Q, in_stream->time_base);
+		const s64 last = t1 < 0 ? INT64_MAX : in_start + av_rescale_q((s64)(t1 * AV_TIME_BASE), AV_TIME_BASE_Q, in_stream->time_base);
+		const s64 tol = smart || discard ? av_rescale_q((s64)(tolerance * AV_TIME_BASE), AV_TIME_BASE_Q, in_stream->time_base) : 0;
+		s64 offset = AV_NOPTS_VALUE;
+
+		if (discard) {
+			err = trim_discard(ifmt_ctx, stream_index, ofmt_ctx, out_stream, first, last, tol, t0 > 0);
+			if (err < 0)
+				fprintf(stderr, "Couldn't cut %s\n", ifname.c_str());
+			goto out;
+		}
+
+		if (t0 > 0 && av_seek_frame(ifmt_ctx, stream_index, first, AVSEEK_FLAG_BACKWARD) < 0)
+			LOG("Seek failed, reading %s from the start\n", ifname.c_str());
+
+		err = avformat_write_header(ofmt_ctx, NULL);
+		if (err < 0) {
+			fprintf(stderr, "Couldn't write the header of %s\n", ofname.c_str());
+			goto out;
+		}
+
+		packet = av_packet_alloc();
+		while (av_read_frame(ifmt_ctx, packet) >= 0) {
+			if (packet->stream_index != stream_index) {
+				av_packet_unref(packet);
+				continue;
+			}
+			const s64 pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+			const bool timed = pts != AV_NOPTS_VALUE && packet->duration > 0;
+			const s64 end = timed ? pts + packet->duration : pts;
+			/* with a smart cut, a cut within the tolerance of the end of a packet moves there */
+			if (pts != AV_NOPTS_VALUE && pts >= last - (smart && timed ? tol : 0)) {
+				av_packet_unref(packet);
+				break;
+			}
+			/* skip packets that end before the cut */
+			if (timed && end <= first + (smart ? tol : 0)) {
+				if (smart) {
+					av_packet_unref(sc.prev);
+					av_packet_ref(sc.prev, packet);
+				}
+				av_packet_unref(packet);
+				continue;
+			}
+
+			/* a cut inside of the packet, farther than the tolerance from both of its ends */
+			const bool head_cut = smart && timed && first - pts > tol;
+			const bool tail_cut = smart && timed && end - last > tol;
+			if (head_cut || tail_cut) {
+				if (offset == AV_NOPTS_VALUE)
+					offset = head_cut ? first : pts;
+				sc.offset = offset;
+				err = smart_cut_packet(&sc, packet, head_cut ? first : pts, tail_cut ? last : end);
+				if (err < 0) {
+					fprintf(stderr, "Couldn't re-encode the cut of %s\n", ifname.c_str());
+					goto out;
+				}
+				av_packet_unref(sc.prev);
+				av_packet_ref(sc.prev, packet);
+				av_packet_unref(packet);
+				if (tail_cut)
+					break;
+				continue;
+			}
+
+			if (smart) {
+				av_packet_unref(sc.prev);
+				av_packet_ref(sc.prev, packet);
+			}
+			if (offset == AV_NOPTS_VALUE)
+				offset = pts != AV_NOPTS_VALUE ? pts : 0;
+
+			if (packet->pts != AV_NOPTS_VALUE)
+				packet->pts -= offset;
+			if (packet->dts != AV_NOPTS_VALUE)
+				packet->dts -= offset;
+			av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+			packet->stream_index = out_stream->index;
+			packet->pos = -1;
+
+			err = av_interleaved_write_frame(ofmt_ctx, packet);
+			if (err < 0) {
+				fprintf(stderr, "Couldn't write a packet to %s\n", ofname.c_str());
+				goto out;
+			}
+		}
+
+		err = av_write_trailer(ofmt_ctx);
+	}
+
+out:
+	if (smart)
+		smart_cut_close(&sc);
+	av_packet_free(&packet);
+	close_copy(&ifmt_ctx, ofmt_ctx);
+
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Stream copy the [t0, t1) seconds range of the first audio stream of ifname
+ * into ofname, like `ffmpeg -ss t0 -i ifname -to (t1 - t0) -c copy ofname`.
+ * The container of ofname is chosen from its extension, or is the input one
+ * if that gives no muxer, and the output timestamps start at zero. Packets
+ * are never re-encoded, so the cut lands on the packet that contains t0.
+ * t1 < 0 copies until the end of the stream.
+ * return 0 on success
+ */
+int ffmpeg_trim_copy(const std::string &ifname, const std::string &ofname, double t0, double t1)
+{
+	LOG("ffmpeg_trim_copy: %s -> %s [%.3f, %.3f)\n", ifname.c_str(), ofname.c_str(), t0, t1);
+	return trim_file(ifname, ofname, t0, t1, -1.0);
+}
+
+/*
+ * Like ffmpeg_trim_copy(), but sample accurate: a cut that lands more than
+ * tolerance seconds away from a packet boundary re-encodes the packet it falls
+ * in and stream copies the rest. Codecs whose encoder can't be spliced, with a
+ * fixed frame size or an encoder delay, drop the samples outside of the cut
+ * where the container allows it (see trim_discard()) and are cut on packets as
+ * by ffmpeg_trim_copy() otherwise.
+ * return 0 on success
+ */
+int ffmpeg_trim_smart(const std::string &ifname, const std::string &ofname, double t0, double t1, double tolerance)
+{
+	LOG("ffmpeg_trim_smart: %s -> %s [%.3f, %.3f) within %.3f\n", ifname.c_str(), ofname.c_str(), t0, t1, tolerance);
+	return trim_file(ifname, ofname, t0, t1, std::max(0.0, tolerance));
+}
+
+/*
+ * Stream copy the ranges, in seconds and in order, of the first audio stream of
+ * ifname into ofname one after the other, like the concat demuxer with an
+ * inpoint and outpoint for every range of the same file. The packets between
+ * the ranges are dropped and the timestamps of the following ones move back by
+ * the time dropped, so the output plays without gaps. A packet is kept if it
+ * overlaps a range, the cuts land on packet boundaries.
+ * return 0 on success
+ */
+int ffmpeg_concat_ranges(const std::string &ifname, const std::string &ofname, const std::vector<ffmpeg_time_range> &ranges)
+{
+	AVFormatContext *ifmt_ctx = NULL;
+	AVFormatContext *ofmt_ctx = NULL;
+	AVStream *out_stream = NULL;
+	AVPacket *packet = NULL;
+	int stream_index = -1;
+	int err;
+
+	LOG("ffmpeg_concat_ranges: %s -> %s, %zu ranges\n", ifname.c_str(), ofname.c_str(), ranges.size());
+	if (ranges.empty())
+		return -1;
+
+	err = open_copy_input(ifname, &ifmt_ctx, &stream_index);
+	if (err)
+		return err;
+	AVStream *in_stream = ifmt_ctx->streams[stream_index];
+
+	err = open_copy_output(ifmt_ctx, in_stream, ofname, &ofmt_ctx, &out_stream);
+	if (err < 0)
+		goto out;
+	err = open_copy_file(ofmt_ctx, ofname);
+	if (err < 0)
+		goto out;
+
+	{
+		const s64 in_start = in_stream->start_time != AV_NOPTS_VALUE ? in_stream->start_time : 0;
+		auto to_stream = [&](double t) {
+			return in_start + av_rescale_q((s64)(t * AV_TIME_BASE), AV_TIME_BASE_Q, in_stream->time_base);
+		};
+		std::vector<s64> firsts, lasts;
+		for (const ffmpeg_time_range &range : ranges) {
+			firsts.push_back(to_stream(range.t0));
+			lasts.push_back(range.t1 < 0 ? INT64_MAX : to_stream(range.t1));
+		}
+		/* time cut out before the packet being written, and where the last one written ends */
+		s64 dropped = AV_NOPTS_VALUE;
+		s64 written_end = AV_NOPTS_VALUE;
+		bool keeping = false;
+		size_t r = 0;
+
+		if (ranges[0].t0 > 0 && av_seek_frame(ifmt_ctx, stream_index, firsts[0], AVSEEK_FLAG_BACKWARD) < 0)
+			LOG("Seek failed, reading %s from the start\n", ifname.c_str());
+
+		err = avformat_write_header(ofmt_ctx, NULL);
+		if (err < 0) {
+			fprintf(stderr, "Couldn't write the header of %s\n", ofname.c_str());
+			goto out;
+		}
+
+		packet = av_packet_alloc();
+		while (av_read_frame(ifmt_ctx, packet) >= 0) {
+			if (packet->stream_index != stream_index) {
+				av_packet_unref(packet);
+				continue;
+			}
+			const s64 pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+			if (pts != AV_NOPTS_VALUE) {
+				const s64 end = pts + std::max<s64>(packet->duration, 0);
+				while (r < ranges.size() && pts >= lasts[r])
+					r++;
+				if (r == ranges.size()) {
+					av_packet_unref(packet);
+					break;
+				}
+				keeping = end > firsts[r] || (packet->duration <= 0 && pts >= firsts[r]);
+				if (keeping) {
+					if (dropped == AV_NOPTS_VALUE)
+						dropped = pts;
+					else if (pts > written_end)
+						dropped += pts - written_end;
+					written_end = std::max(end, written_end);
+				}
+			}
+			/* packets without timestamps go with the one before */
+			if (!keeping || dropped == AV_NOPTS_VALUE) {
+				av_packet_unref(packet);
+				continue;
+			}
+
+			if (packet->pts != AV_NOPTS_VALUE)
+				packet->pts -= dropped;
+			if (packet->dts != AV_NOPTS_VALUE)
+				packet->dts -= dropped;
+			av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+			packet->stream_index = out_stream->index;
+			packet->pos = -1;
+
+			err = av_interleaved_write_frame(ofmt_ctx, packet);
+			if (err < 0) {
+				fprintf(stderr, "Couldn't write a packet to %s\n", ofname.c_str());
+				goto out;
+			}
+		}
+
+		err = av_write_trailer(ofmt_ctx);
+	}
+
+out:
+	av_packet_free(&packet);
+	close_copy(&ifmt_ctx, ofmt_ctx);
+
+	return err < 0 ? err : 0;
+}
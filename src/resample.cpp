@@ -0,0 +1,194 @@
+#include "resample.h"
+
+#include "common-simd.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+
+#define RESAMPLE_OUT_RATE 16000
+// phases of the table, enough for every common rate: 22.05 kHz needs 320
+#define RESAMPLE_MAX_PHASES 640
+// taps per output sample at 1:1, the filter gets longer with the decimation ratio
+#define RESAMPLE_TAPS 32
+// Kaiser window beta, about 70 dB of stopband attenuation
+#define RESAMPLE_BETA 7.0
+
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 64; k++) {
+        const double t = x / (2.0*k);
+        term *= t*t;
+        sum += term;
+        if (term < 1e-12*sum) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// closest down/up to in_rate/16000 with at most RESAMPLE_MAX_PHASES phases
+static void closest_ratio(int in_rate, int & up, int & down) {
+    const double ratio = (double)in_rate / RESAMPLE_OUT_RATE;
+    double best = INFINITY;
+    for (int l = 1; l <= RESAMPLE_MAX_PHASES; l++) {
+        const int m = std::max(1, (int)lround(l*ratio));
+        const double err = fabs((double)m/l - ratio);
+        if (err < best) {
+            best = err;
+            up = l;
+            down = m;
+        }
+    }
+}
+
+bool resampler_16k_init(resampler_16k & rs, int in_rate) {
+    if (in_rate <= 0) {
+        return false;
+    }
+
+    // keep the capacity of the buffers of the previous stream
+    rs.in_rate = in_rate;
+    rs.buf.clear();
+    rs.k = 0;
+    rs.n_in = 0;
+    rs.n_out = 0;
+
+    if (in_rate == RESAMPLE_OUT_RATE) {
+        rs.up = rs.down = 1;
+        rs.n_taps = 0;
+        snprintf(rs.path, sizeof(rs.path), "1:1");
+        return true;
+    }
+
+    const int g = std::gcd(in_rate, RESAMPLE_OUT_RATE);
+    int up = RESAMPLE_OUT_RATE / g;
+    int down = in_rate / g;
+    const bool exact = up <= RESAMPLE_MAX_PHASES;
+    if (!exact) {
+        closest_ratio(in_rate, up, down);
+        const int gg = std::gcd(up, down);
+        up /= gg;
+        down /= gg;
+    }
+    snprintf(rs.path, sizeof(rs.path), "%d:%d%s", down, up, exact ? "" : "~");
+
+    // the design only changes with the ratio, files of one source share it
+    if (up != rs.up || down != rs.down || rs.taps.empty()) {
+        rs.up = up;
+        rs.down = down;
+        rs.n_taps = (int)ceil(RESAMPLE_TAPS * std::max(1.0, (double)down / up));
+        rs.n_taps += rs.n_taps & 1;
+        rs.delay = rs.n_taps / 2;
+
+        // windowed sinc at the rate of the input upsampled by up, cut off a bit below
+        // the lower of the two Nyquist frequencies and centered on delay input samples,
+        // so that every phase delays by the same whole number of samples
+        const int n = rs.n_taps * up;
+        const double center = (double)rs.delay * up;
+        const double fc = 0.45 / std::max(up, down);
+        const double i0_beta = bessel_i0(RESAMPLE_BETA);
+        std::vector<double> h(n);
+        for (int m = 0; m < n; m++) {
+            const double x = m - center;
+            const double sinc = x == 0.0 ? 1.0 : sin(2.0*M_PI*fc*x) / (2.0*M_PI*fc*x);
+            const double r = x / (0.5*n);
+            const double w = r*r < 1.0 ? bessel_i0(RESAMPLE_BETA*sqrt(1.0 - r*r)) / i0_beta : 0.0;
+            h[m] = 2.0*fc*sinc*w;
+        }
+
+        // split into phases, each reversed and scaled to unit gain at DC
+        rs.taps.resize((size_t)up*rs.n_taps);
+        rs.phase.resize(up);
+        rs.step.resize(up);
+        for (int p = 0; p < up; p++) {
+            double sum = 0.0;
+            for (int j = 0; j < rs.n_taps; j++) {
+                sum += h[p + j*up];
+            }
+            for (int j = 0; j < rs.n_taps; j++) {
+                rs.taps[(size_t)p*rs.n_taps + j] = (float)(h[p + (rs.n_taps - 1 - j)*up] / sum);
+            }
+        }
+        for (int k = 0; k < up; k++) {
+            const long long pos = (long long)k*down;
+            rs.phase[k] = (int)(pos % up);
+            rs.step[k] = (int)((pos + down)/up - pos/up);
+        }
+    }
+
+    // output 0 is centered on input sample 0, with zeros before it
+    rs.buf.assign(rs.n_taps - 1, 0.0f);
+    rs.next = rs.n_taps - 1 + rs.delay;
+
+    return true;
+}
+
+// produce outputs while the input they need is in buf, up to a total of limit
+static void resample_run(resampler_16k & rs, std::vector<float> & out, unsigned long long limit) {
+    const size_t end = rs.buf.size();
+    const size_t history = rs.n_taps - 1;
+    const float * buf = rs.buf.data();
+
+    if (rs.up == 1) {
+        // integer decimation, a single phase
+        const float * taps = rs.taps.data();
+        while (rs.next < end && rs.n_out < limit) {
+            out.push_back(simd_dot(taps, buf + rs.next - history, rs.n_taps));
+            rs.next += rs.down;
+            rs.n_out++;
+        }
+    } else {
+        while (rs.next < end && rs.n_out < limit) {
+            out.push_back(simd_dot(rs.taps.data() + (size_t)rs.phase[rs.k]*rs.n_taps, buf + rs.next - history, rs.n_taps));
+            rs.next += rs.step[rs.k];
+            rs.k = rs.k + 1 == rs.up ? 0 : rs.k + 1;
+            rs.n_out++;
+        }
+    }
+
+    // keep only the history of the next output
+    const size_t drop = std::min(rs.next - history, end);
+    rs.buf.erase(rs.buf.begin(), rs.buf.begin() + drop);
+    rs.next -= drop;
+}
+
+void resampler_16k_process(resampler_16k & rs, const float * in, size_t n, std::vector<float> & out) {
+    rs.n_in += n;
+    if (rs.n_taps == 0) {
+        out.insert(out.end(), in, in + n);
+        rs.n_out += n;
+        return;
+    }
+
+    out.reserve(out.size() + (size_t)((unsigned long long)n*rs.up/rs.down) + 1);
+    rs.buf.insert(rs.buf.end(), in, in + n);
+    resample_run(rs, out, ULLONG_MAX);
+}
+
+void resampler_16k_flush(resampler_16k & rs, std::vector<float> & out) {
+    if (rs.n_taps == 0 || rs.in_rate <= 0) {
+        return;
+    }
+
+    // the outputs of the last delay input samples need that many more after them
+    const unsigned long long expected = (rs.n_in*RESAMPLE_OUT_RATE + rs.in_rate - 1) / rs.in_rate;
+    while (rs.n_out < expected) {
+        rs.buf.insert(rs.buf.end(), rs.delay + rs.n_taps, 0.0f);
+        resample_run(rs, out, expected);
+    }
+}
+
+static thread_local char g_last_path[32] = "";
+
+void resample_note_path(const char * path) {
+    snprintf(g_last_path, sizeof(g_last_path), "%s", path);
+}
+
+const char * resample_last_path() {
+    return g_last_path;
+}
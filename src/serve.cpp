@@ -0,0 +1,742 @@
+#include "serve.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//
+// JSON
+//
+
+std::string json_escape(const std::string & str) {
+    std::string out;
+    for (const char c : str) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}std::string string_printf(const char * fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    const int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return "";
+    }
+    if ((size_t)n < sizeof(buf)) {
+        return std::string(buf, n);
+    }
+    std::string out(n, '\0');
+    va_start(args, fmt);
+    vsnprintf(&out[0], n + 1, fmt, args);
+    va_end(args);
+    return out;
+}
+
+static void skip_json_space(const std::string & text, size_t & pos) {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) {
+        ++pos;
+    }
+}
+
+static void append_utf8(std::string & out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+static bool is_json_hex4(const std::string & text, size_t pos) {
+    if (pos + 4 > text.size()) {
+        return false;
+    }
+    for (size_t i = pos; i < pos + 4; ++i) {
+        if (!isxdigit((unsigned char)text[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parse the JSON string starting at the quote at text[pos], pos ends after the closing quote
+static bool parse_json_string(const std::string & text, size_t & pos, std::string & out) {
+    ++pos;
+    while (pos < text.size()) {
+        const char c = text[pos++];
+        if (c == '"') {
+            return true;
+        }
+        // control characters have to be escaped
+        if ((unsigned char)c < 0x20) {
+            return false;
+        }
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (pos >= text.size()) {
+            return false;
+        }
+        const char e = text[pos++];
+        switch (e) {
+            case '"':  out += '"';  break;
+            case '\\': out += '\\'; break;
+            case '/':  out += '/';  break;
+            case 'b':  out += '\b'; break;
+            case 'f':  out += '\f'; break;
+            case 'n':  out += '\n'; break;
+            case 'r':  out += '\r'; break;
+            case 't':  out += '\t'; break;
+            case 'u': {
+                if (!is_json_hex4(text, pos)) {
+                    return false;
+                }
+                unsigned cp = (unsigned)strtoul(text.substr(pos, 4).c_str(), nullptr, 16);
+                pos += 4;
+                // surrogate pair
+                if (cp >= 0xd800 && cp < 0xdc00 && pos + 6 <= text.size() && text[pos] == '\\' && text[pos + 1] == 'u' &&
+                    is_json_hex4(text, pos + 2)) {
+                    const unsigned lo = (unsigned)strtoul(text.substr(pos + 2, 4).c_str(), nullptr, 16);
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        pos += 6;
+                    }
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+// Parse a JSON number, true, false or null starting at text[pos], pos ends after it
+static bool parse_json_literal(const std::string & text, size_t & pos) {
+    for (const char * word : { "true", "false", "null" }) {
+        if (text.compare(pos, strlen(word), word) == 0) {
+            pos += strlen(word);
+            return true;
+        }
+    }
+
+    auto digits = [&]() {
+        const size_t start = pos;
+        while (pos < text.size() && isdigit((unsigned char)text[pos])) {
+            ++pos;
+        }
+        return pos > start;
+    };
+    if (pos < text.size() && text[pos] == '-') {
+        ++pos;
+    }
+    if (pos < text.size() && text[pos] == '0') {
+        ++pos;
+    } else if (!digits()) {
+        return false;
+    }
+    if (pos < text.size() && text[pos] == '.') {
+        ++pos;
+        if (!digits()) {
+            return false;
+        }
+    }
+    if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+        ++pos;
+        if (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) {
+            ++pos;
+        }
+        if (!digits()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parse a flat JSON object, see serve.h
+bool parse_json_object(const std::string & text, std::map<std::string, json_value> & fields) {
+    size_t pos = 0;
+    skip_json_space(text, pos);
+    if (pos >= text.size() || text[pos] != '{') {
+        return false;
+    }
+    ++pos;
+    skip_json_space(text, pos);
+    if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+    } else {
+        while (true) {
+            skip_json_space(text, pos);
+            std::string key;
+            if (pos >= text.size() || text[pos] != '"' || !parse_json_string(text, pos, key)) {
+                return false;
+            }
+            skip_json_space(text, pos);
+            if (pos >= text.size() || text[pos] != ':') {
+                return false;
+            }
+            ++pos;
+            skip_json_space(text, pos);
+            if (pos >= text.size()) {
+                return false;
+            }
+            json_value value;
+            const size_t start = pos;
+            if (text[pos] == '"') {
+                value.is_string = true;
+                if (!parse_json_string(text, pos, value.str)) {
+                    return false;
+                }
+            } else if (!parse_json_literal(text, pos)) {
+                return false;
+            }
+            value.raw = text.substr(start, pos - start);
+            fields[key] = value;
+            skip_json_space(text, pos);
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+                continue;
+            }
+            if (pos < text.size() && text[pos] == '}') {
+                ++pos;
+                break;
+            }
+            return false;
+        }
+    }
+    skip_json_space(text, pos);
+    return pos == text.size();
+}
+
+//
+// jobs
+//
+
+// Where the results of the jobs of one client go. The descriptor is closed with the
+// last reference, i.e. when the client has hung up and all its jobs are done.
+struct serve_client {
+    int fd;
+    bool is_socket;
+    std::mutex mutex;
+
+    serve_client(int fd, bool is_socket) : fd(fd), is_socket(is_socket) {}
+    serve_client(const serve_client &) = delete;
+    serve_client & operator=(const serve_client &) = delete;
+
+    ~serve_client() {
+        if (is_socket) {
+            close(fd);
+        }
+    }
+
+    // write one line, a client that went away just doesn't get it
+    void send_line(const std::string & line) {
+        const std::string data = line + "\n";
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t off = 0;
+        while (off < data.size()) {
+            const ssize_t n = is_socket ? ::send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL)
+                                        : write(fd, data.data() + off, data.size() - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+    }
+};
+
+// A job waiting for a worker, with where its result goes
+struct queued_job {
+    serve_job job;
+    std::shared_ptr<serve_client> client;
+};
+
+static std::string serve_error(const std::string & id, const std::string & error) {
+    return "{\"id\": " + id + ", \"result\": \"failed\", \"error\": \"" + json_escape(error) + "\"}";
+}
+
+// Read jobs line by line from fd until EOF and queue them. The queue is bounded, so a
+// client sending faster than the workers keep up is held back by its socket buffer.
+// Once the queue is stopped the job that didn't fit gets an error and reading ends.
+static void read_serve_jobs(
+        int fd,
+        const std::shared_ptr<serve_client> & client,
+        const serve_parse_fn & parse,
+        bounded_queue<queued_job> & queue) {
+    std::string pending;
+    std::vector<char> buf(64 * 1024);
+    bool eof = false;
+    while (!eof) {
+        const ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            eof = true;
+            if (pending.empty()) {
+                break;
+            }
+            pending += '\n';
+        } else {
+            pending.append(buf.data(), n);
+        }
+
+        size_t start = 0;
+        size_t nl;
+        while ((nl = pending.find('\n', start)) != std::string::npos) {
+            std::string line = pending.substr(start, nl - start);
+            start = nl + 1;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            queued_job queued;
+            std::string error;
+            if (!parse(line, queued.job, error)) {
+                client->send_line(serve_error(queued.job.id, error));
+                continue;
+            }
+            queued.client = client;
+            const std::string id = queued.job.id;
+            if (!queue.push(std::move(queued))) {
+                client->send_line(serve_error(id, "the server is shutting down"));
+                return;
+            }
+        }
+        pending.erase(0, start);
+    }
+}
+
+//
+// metrics
+//
+
+// A Prometheus histogram with fixed bucket bounds
+struct metrics_histogram {
+    std::vector<double> bounds;
+    std::vector<uint64_t> counts; // per bucket, the last one is +Inf
+    double sum = 0.0;
+    uint64_t count = 0;
+
+    explicit metrics_histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    void observe(double value) {
+        counts[std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()]++;
+        sum += value;
+        count++;
+    }
+};
+
+// What --metrics exports: the --stats of every job of --serve summed up since the start,
+// rendered in the Prometheus text format. The gauges are read when a scrape comes in.
+struct serve_metrics {
+    std::mutex mutex;
+    std::vector<std::string> result_names;
+    std::vector<uint64_t> jobs; // by result
+    phase_time phases[5]; // hash, decode, vad, trim, replace as in the --stats lines
+    double audio_seconds = 0.0;
+    uint64_t samples_decoded = 0;
+    uint64_t samples_inferred = 0;
+    uint64_t samples_pregated = 0;
+    uint64_t samples_not_decoded = 0;
+    uint64_t vad_calls = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+
+    metrics_histogram job_seconds    { { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300 } };
+    metrics_histogram decode_seconds { { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 } };
+    metrics_histogram remux_seconds  { { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 } };
+    // seconds per second of audio, so the buckets hold for any file length
+    metrics_histogram vad_rtf        { { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1 } };
+    metrics_histogram job_rtf        { { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1 } };
+
+    std::atomic<int> busy_workers{0};
+
+    explicit serve_metrics(const std::vector<std::string> & result_names) : result_names(result_names), jobs(result_names.size(), 0) {}
+
+    void record(const serve_result & report) {
+        const run_stats & st = report.stats;
+        const double audio = report.failed ? 0.0 : report.audio_seconds;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (report.result >= 0 && (size_t)report.result < jobs.size()) {
+            jobs[report.result]++;
+        }
+        const phase_time * job_phases[] = { &st.hash, &st.decode, &st.vad, &st.trim, &st.replace };
+        for (int i = 0; i < 5; ++i) {
+            phases[i].wall += job_phases[i]->wall;
+            phases[i].cpu += job_phases[i]->cpu;
+        }
+        samples_decoded += st.samples_decoded;
+        samples_inferred += st.samples_inferred;
+        samples_pregated += st.samples_pregated;
+        vad_calls += st.vad_calls;
+        cache_hits += st.cache_hits;
+        cache_misses += st.cache_misses;
+
+        job_seconds.observe(report.wall);
+        if (report.failed) {
+            return;
+        }
+        decode_seconds.observe(st.decode.wall);
+        if (report.trimmed) {
+            remux_seconds.observe(st.trim.wall + st.replace.wall);
+        }
+        if (audio > 0.0) {
+            audio_seconds += audio;
+            vad_rtf.observe(st.vad.wall / audio);
+            job_rtf.observe(report.wall / audio);
+        }
+        // what --probe, --packet-hints and -s never decoded, a cache hit decodes nothing by design
+        const uint64_t n_audio = (uint64_t)(audio * WHISPER_SAMPLE_RATE);
+        if (report.duration_known && st.cache_hits == 0 && n_audio > st.samples_decoded) {
+            samples_not_decoded += n_audio - st.samples_decoded;
+        }
+    }
+
+    std::string render(size_t queue_depth, size_t queue_capacity, size_t n_workers) {
+        std::string out;
+        auto head = [&](const char * name, const char * type, const char * help) {
+            out += string_printf("# HELP detect_speech_%s %s\n# TYPE detect_speech_%s %s\n", name, help, name, type);
+        };
+        auto counter = [&](const char * name, const char * help, double value) {
+            head(name, "counter", help);
+            out += string_printf("detect_speech_%s %.9g\n", name, value);
+        };
+        auto gauge = [&](const char * name, const char * help, double value) {
+            head(name, "gauge", help);
+            out += string_printf("detect_speech_%s %.9g\n", name, value);
+        };
+        auto histogram = [&](const char * name, const char * help, const metrics_histogram & h) {
+            head(name, "histogram", help);
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < h.bounds.size(); ++i) {
+                cumulative += h.counts[i];
+                out += string_printf("detect_speech_%s_bucket{le=\"%g\"} %llu\n", name, h.bounds[i], (unsigned long long)cumulative);
+            }
+            out += string_printf("detect_speech_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h.count);
+            out += string_printf("detect_speech_%s_sum %.9g\n", name, h.sum);
+            out += string_printf("detect_speech_%s_count %llu\n", name, (unsigned long long)h.count);
+        };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        head("jobs_total", "counter", "Jobs finished, by result.");
+        for (size_t r = 0; r < jobs.size(); ++r) {
+            out += string_printf("detect_speech_jobs_total{result=\"%s\"} %llu\n", result_names[r].c_str(), (unsigned long long)jobs[r]);
+        }
+        head("phase_seconds_total", "counter", "Time spent in every phase of the jobs, by wall and CPU clock.");
+        const char * phase_names[] = { "hash", "decode", "vad", "trim", "replace" };
+        for (int i = 0; i < 5; ++i) {
+            out += string_printf("detect_speech_phase_seconds_total{phase=\"%s\",clock=\"wall\"} %.9g\n", phase_names[i], phases[i].wall);
+            out += string_printf("detect_speech_phase_seconds_total{phase=\"%s\",clock=\"cpu\"} %.9g\n", phase_names[i], phases[i].cpu);
+        }
+        counter("audio_seconds_total", "Seconds of audio in the files of the jobs.", audio_seconds);
+        counter("samples_decoded_total", "Samples decoded at 16 kHz.", (double)samples_decoded);
+        counter("samples_inferred_total", "Samples run through the VAD, the overlap context included.", (double)samples_inferred);
+        counter("samples_pregated_total", "Samples skipped by the energy pre-gate without inference.", (double)samples_pregated);
+        counter("samples_not_decoded_total", "Samples never decoded because the scan seeked past them or stopped early.", (double)samples_not_decoded);
+        counter("vad_calls_total", "Calls into the VAD.", (double)vad_calls);
+        counter("cache_hits_total", "Jobs answered from the VAD cache.", (double)cache_hits);
+        counter("cache_misses_total", "Jobs that missed the VAD cache and stored a new entry.", (double)cache_misses);
+        gauge("cache_hit_ratio", "Share of the VAD cache lookups that hit since the start.",
+              cache_hits + cache_misses > 0 ? (double)cache_hits / (double)(cache_hits + cache_misses) : 0.0);
+        histogram("job_seconds", "Wall time of a job.", job_seconds);
+        histogram("decode_seconds", "Wall time a job spent decoding and resampling.", decode_seconds);
+        histogram("remux_seconds", "Wall time a trimming job spent writing and renaming the output.", remux_seconds);
+        histogram("vad_seconds_per_audio_second", "Wall time of the VAD per second of audio of a job.", vad_rtf);
+        histogram("realtime_factor", "Wall time of a job per second of its audio.", job_rtf);
+        gauge("queue_depth", "Jobs waiting for a worker.", (double)queue_depth);
+        gauge("queue_capacity", "Jobs that can wait before clients are held back.", (double)queue_capacity);
+        gauge("workers", "Workers, each with its own VAD context.", (double)n_workers);
+        gauge("workers_busy", "Workers running a job.", (double)busy_workers.load());
+        return out;
+    }
+};
+
+// Open a TCP socket listening on addr, "port", "host:port" or "[v6 host]:port".
+// Returns -1 on error.
+static int open_metrics_listener(const std::string & addr) {
+    std::string host;
+    std::string port = addr;
+    const size_t colon = addr.rfind(':');
+    if (colon != std::string::npos) {
+        host = addr.substr(0, colon);
+        port = addr.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo * res = nullptr;
+    const int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Error: Invalid metrics address %s: %s\n", addr.c_str(), gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo * ai = res; ai != nullptr && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        const int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 16) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to listen for metrics on %s: %s\n", addr.c_str(), strerror(errno));
+    }
+    return fd;
+}
+
+// Answer the scrapes on listen_fd one connection at a time until it is shut down.
+// GET /metrics gets the text format, anything else a 404; every connection is closed
+// after one response.
+static void serve_metrics_http(int listen_fd, const std::function<std::string()> & render) {
+    while (true) {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        // a client that never finishes its request doesn't hold up the next scrape for long
+        struct timeval timeout = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            request.append(buf, n);
+        }
+
+        const std::string path = "GET /metrics";
+        std::string response;
+        if (request.compare(0, path.size(), path) == 0 && request.size() > path.size() &&
+            (request[path.size()] == ' ' || request[path.size()] == '?')) {
+            const std::string body = render();
+            response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                       "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        } else {
+            response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+
+        size_t off = 0;
+        while (off < response.size()) {
+            const ssize_t n = ::send(fd, response.data() + off, response.size() - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+        close(fd);
+    }
+}
+
+//
+// server
+//
+
+int serve_run(const serve_config & config, const serve_parse_fn & parse) {
+    bounded_queue<queued_job> queue;
+    queue.capacity = std::max(1, config.queue_capacity);
+    const size_t n_workers = std::max((size_t)1, config.n_workers);
+
+    serve_metrics metrics(config.result_names);
+    const int metrics_fd = config.metrics_addr.empty() ? -1 : open_metrics_listener(config.metrics_addr);
+    if (!config.metrics_addr.empty() && metrics_fd == -1) {
+        return 1;
+    }
+    std::thread metrics_thread;
+    if (metrics_fd != -1) {
+        fprintf(stderr, "Serving metrics on %s\n", config.metrics_addr.c_str());
+        metrics_thread = std::thread(serve_metrics_http, metrics_fd, std::function<std::string()>([&]() {
+            return metrics.render(queue.size(), queue.capacity, n_workers);
+        }));
+    }
+
+    auto worker = [&](size_t i) {
+        queued_job queued;
+        while (queue.pop(queued)) {
+            metrics.busy_workers++;
+            // the metrics are built from the stats
+            const serve_result result = queued.job.run(i, metrics_fd != -1);
+            metrics.busy_workers--;
+
+            if (metrics_fd != -1) {
+                metrics.record(result);
+            }
+            queued.client->send_line(result.line);
+            queued = queued_job();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < n_workers; ++i) {
+        workers.emplace_back(worker, i);
+    }
+
+    // the reader of one socket client, joined once it has hung up or at shutdown
+    struct serve_connection {
+        std::thread thread;
+        std::weak_ptr<serve_client> client;
+        std::shared_ptr<std::atomic<bool>> finished;
+    };
+    std::vector<serve_connection> connections;
+    auto join_finished = [&]() {
+        for (size_t i = 0; i < connections.size(); ) {
+            if (*connections[i].finished) {
+                connections[i].thread.join();
+                connections.erase(connections.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    };
+
+    const std::string & socket_path = config.socket_path;
+    int ret = 0;
+    if (socket_path.empty()) {
+        fprintf(stderr, "Serving jobs from stdin with %zu workers\n", n_workers);
+        read_serve_jobs(STDIN_FILENO, std::make_shared<serve_client>(STDOUT_FILENO, false), parse, queue);
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Socket path %s is too long\n", socket_path.c_str());
+            ret = 1;
+        }
+        const int listen_fd = ret == 0 ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        if (ret == 0 && listen_fd == -1) {
+            fprintf(stderr, "Error: Failed to create socket: %s\n", strerror(errno));
+            ret = 1;
+        }
+        if (ret == 0) {
+            memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+            // a socket file left by a previous server
+            unlink(socket_path.c_str());
+            if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+                fprintf(stderr, "Error: Failed to listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+                ret = 1;
+            }
+        }
+        if (ret == 0) {
+            fprintf(stderr, "Serving jobs on %s with %zu workers\n", socket_path.c_str(), n_workers);
+            while (true) {
+                const int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    fprintf(stderr, "Error: Failed to accept a connection: %s\n", strerror(errno));
+                    ret = 1;
+                    // the connections still open give up on their next job
+                    for (queued_job & queued : queue.stop()) {
+                        queued.client->send_line(serve_error(queued.job.id, "the server is shutting down"));
+                    }
+                    break;
+                }
+                join_finished();
+                serve_connection conn;
+                std::shared_ptr<serve_client> client = std::make_shared<serve_client>(fd, true);
+                std::shared_ptr<std::atomic<bool>> finished = std::make_shared<std::atomic<bool>>(false);
+                conn.client = client;
+                conn.finished = finished;
+                conn.thread = std::thread([client, finished, &parse, &queue]() {
+                    read_serve_jobs(client->fd, client, parse, queue);
+                    *finished = true;
+                });
+                connections.push_back(std::move(conn));
+            }
+        }
+        // wake up the clients blocked in read(), their results can still be sent
+        for (serve_connection & conn : connections) {
+            if (std::shared_ptr<serve_client> client = conn.client.lock()) {
+                shutdown(client->fd, SHUT_RD);
+            }
+        }
+        for (serve_connection & conn : connections) {
+            conn.thread.join();
+        }
+        if (listen_fd != -1) {
+            close(listen_fd);
+            unlink(socket_path.c_str());
+        }
+    }
+
+    queue.finish();
+    for (std::thread & t : workers) {
+        t.join();
+    }
+    if (metrics_fd != -1) {
+        // wakes up the accept() of the metrics thread
+        shutdown(metrics_fd, SHUT_RDWR);
+        metrics_thread.join();
+        close(metrics_fd);
+    }
+
+    return ret;
+}
+
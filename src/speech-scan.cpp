@@ -0,0 +1,1162 @@
+#include "speech-scan.h"
+#include "common.h"
+#include "common-whisper.h"
+#include "ffmpeg-transcode.h"
+#include "resample.h"
+#include "vad-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double thread_cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Speech found in one window, in seconds from the start of the file
+struct window_speech {
+    bool  has_speech = false;
+    float t0 = 0.0f; // onset of the first segment
+    float t1 = 0.0f; // offset of the last segment
+    bool  failed = false; // the inference failed, the window says nothing about speech
+};
+
+// Find the part of samples that isn't obviously silent, only used with the pre-gate on
+static bool pregate_bounds(const scan_params & sp, const float * samples, size_t n_samples, size_t & first, size_t & last) {
+    return vad_energy_gate(samples, n_samples, WHISPER_SAMPLE_RATE, 30, sp.pregate_thold, 0.4f, 100.0f, first, last);
+}
+
+static bool pregate_silent(const scan_params & sp, const float * samples, int n_samples) {
+    size_t first, last;
+    return sp.pregate && !pregate_bounds(sp, samples, n_samples, first, last);
+}
+
+// Run the VAD over one window. The samples go through the network once:
+// whisper_vad_detect_speech() leaves the per-frame probabilities in vctx and both
+// edges are derived from them with a single whisper_vad_segments_from_probs().
+// The n_context samples before samples[0] are inferred along with the window; they
+// only warm up the LSTM, so timestamps are still relative to the start of the file.
+static window_speech vad_window(
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        const float * samples,
+        int n_samples,
+        double offset_seconds,
+        int n_context = 0) {
+    window_speech ws;
+    phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+
+    if (n_samples <= 0) {
+        return ws;
+    }
+    if (pregate_silent(sp, samples, n_samples)) {
+        if (sp.stats) {
+            sp.stats->samples_pregated += n_samples;
+        }
+        return ws;
+    }
+    if (sp.stats) {
+        sp.stats->samples_inferred += n_context + n_samples;
+        sp.stats->vad_calls++;
+    }
+
+    if (!whisper_vad_detect_speech(vctx, samples - n_context, n_context + n_samples)) {
+        fprintf(stderr, "%s: whisper_vad_detect_speech failed on %d samples\n", __func__, n_context + n_samples);
+        ws.failed = true;
+        return ws;
+    }
+    offset_seconds -= (double)n_context / WHISPER_SAMPLE_RATE;
+
+    struct whisper_vad_segments * segments = whisper_vad_segments_from_probs(vctx, sp.vad_params);
+    if (segments) {
+        int n_seg = whisper_vad_segments_n_segments(segments);
+        if (n_seg > 0) {
+            ws.has_speech = true;
+            ws.t0 = (float)offset_seconds + whisper_vad_segments_get_segment_t0(segments, 0) * 0.01f;
+            ws.t1 = (float)offset_seconds + whisper_vad_segments_get_segment_t1(segments, n_seg - 1) * 0.01f;
+        }
+        whisper_vad_free_segments(segments);
+    }
+
+    return ws;
+}
+
+// Scan a fully decoded file: forward from the start for the first speech onset,
+// then backward from the end for the last speech offset. Both scans start with a
+// small window that grows geometrically while no speech is found. The backward
+// scan stops where the window with the onset ends and falls back to its result,
+// so no sample is inferred twice (apart from the overlap context).
+bool detect_speech_in_memory(
+        const float * pcmf32,
+        size_t n_samples,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges) {
+    const int n_total = (int)n_samples;
+
+    edges.total_duration_seconds = (float)n_total / (float)WHISPER_SAMPLE_RATE;
+    edges.final_end_seconds = edges.total_duration_seconds;
+
+    auto infer = [&](int i, int n_samples) {
+        const int n_context = std::min(sp.overlap_samples, i);
+        return vad_window(vctx, sp, pcmf32 + i, n_samples, (double)i / WHISPER_SAMPLE_RATE, n_context);
+    };
+
+    // everything before head_end has been inferred by the forward scan, everything
+    // after tail_end by the backward one
+    int head_end = 0;
+    int tail_end = n_total;
+    window_speech head_speech;
+
+    if (sp.pregate) {
+        size_t first, last;
+        if (!pregate_bounds(sp, pcmf32, n_samples, first, last)) {
+            if (sp.stats) {
+                sp.stats->samples_pregated += n_samples;
+            }
+            return true;
+        }
+        // only the audio between the first and last non silent frames can hold speech
+        const int margin = WHISPER_SAMPLE_RATE / 4;
+        head_end = std::max(0, (int)first - margin);
+        tail_end = std::min(n_total, (int)last + 1 + margin);
+        if (sp.stats) {
+            sp.stats->samples_pregated += head_end + (n_total - tail_end);
+        }
+    }
+
+    if (sp.call_trim_start) {
+        int window_samples = sp.min_window_samples;
+        while (head_end < tail_end) {
+            const int i = head_end;
+            const int n_samples = std::min(window_samples, tail_end - i);
+            head_speech = infer(i, n_samples);
+            head_end = i + n_samples;
+            if (head_speech.failed) {
+                return false;
+            }
+            if (head_speech.has_speech) {
+                edges.final_start_seconds = std::max(0.0f, head_speech.t0 - 0.5f);
+                edges.speech_detected = true;
+                break;
+            }
+            window_samples = std::min(2 * window_samples, sp.max_window_samples);
+        }
+    }
+
+    if (sp.call_trim_end && (edges.speech_detected || !sp.call_trim_start)) {
+        int window_samples = sp.min_window_samples;
+        int tail_start = tail_end;
+        bool found = false;
+        while (!found && tail_start > head_end) {
+            const int i = std::max(head_end, tail_start - window_samples);
+            const window_speech ws = infer(i, tail_start - i);
+            if (ws.failed) {
+                return false;
+            }
+            if (ws.has_speech) {
+                edges.final_end_seconds = std::min(edges.total_duration_seconds, ws.t1 + 0.5f);
+                edges.speech_detected = true;
+                found = true;
+            }
+            tail_start = i;
+            window_samples = std::min(2 * window_samples, sp.max_window_samples);
+        }
+        if (!found && head_speech.has_speech) {
+            edges.final_end_seconds = std::min(edges.total_duration_seconds, head_speech.t1 + 0.5f);
+        }
+    }
+
+    return true;
+}
+
+// One file of detect_speech_in_memory_batch(), the state of the scan of
+// detect_speech_in_memory() between two windows
+struct batch_scan {
+    enum phase_t { HEAD, TAIL, DONE };
+
+    const float * pcm = nullptr;
+    int n_total = 0;
+    speech_edges * edges = nullptr;
+    run_stats * stats = nullptr;
+
+    phase_t phase = DONE;
+    int head_end = 0;
+    int tail_end = 0;
+    int tail_start = 0;
+    int window_samples = 0;
+    window_speech head_speech;
+
+    // the window being inferred
+    int win_i = 0;
+    int win_n = 0;
+};
+
+static void batch_enter_tail(batch_scan & bs, const scan_params & sp) {
+    if (sp.call_trim_end && (bs.edges->speech_detected || !sp.call_trim_start)) {
+        bs.phase = batch_scan::TAIL;
+        bs.window_samples = sp.min_window_samples;
+        bs.tail_start = bs.tail_end;
+    } else {
+        bs.phase = batch_scan::DONE;
+    }
+}
+
+// Pick the next window of the scan, or finish it. Returns false once it is done.
+static bool batch_next_window(batch_scan & bs, const scan_params & sp) {
+    speech_edges & edges = *bs.edges;
+    if (bs.phase == batch_scan::HEAD && bs.head_end >= bs.tail_end) {
+        batch_enter_tail(bs, sp);
+    }
+    if (bs.phase == batch_scan::TAIL && bs.tail_start <= bs.head_end) {
+        if (bs.head_speech.has_speech) {
+            edges.final_end_seconds = std::min(edges.total_duration_seconds, bs.head_speech.t1 + 0.5f);
+        }
+        bs.phase = batch_scan::DONE;
+    }
+    if (bs.phase == batch_scan::HEAD) {
+        bs.win_i = bs.head_end;
+        bs.win_n = std::min(bs.window_samples, bs.tail_end - bs.win_i);
+    } else if (bs.phase == batch_scan::TAIL) {
+        bs.win_i = std::max(bs.head_end, bs.tail_start - bs.window_samples);
+        bs.win_n = bs.tail_start - bs.win_i;
+    }
+    return bs.phase != batch_scan::DONE;
+}
+
+// Advance the scan with the speech found in its window
+static void batch_apply(batch_scan & bs, const scan_params & sp, const window_speech & ws) {
+    speech_edges & edges = *bs.edges;
+    if (bs.phase == batch_scan::HEAD) {
+        bs.head_speech = ws;
+        bs.head_end = bs.win_i + bs.win_n;
+        if (ws.has_speech) {
+            edges.final_start_seconds = std::max(0.0f, ws.t0 - 0.5f);
+            edges.speech_detected = true;
+            batch_enter_tail(bs, sp);
+        } else {
+            bs.window_samples = std::min(2 * bs.window_samples, sp.max_window_samples);
+        }
+    } else if (bs.phase == batch_scan::TAIL) {
+        if (ws.has_speech) {
+            edges.final_end_seconds = std::min(edges.total_duration_seconds, ws.t1 + 0.5f);
+            edges.speech_detected = true;
+            bs.phase = batch_scan::DONE;
+        } else {
+            bs.tail_start = bs.win_i;
+            bs.window_samples = std::min(2 * bs.window_samples, sp.max_window_samples);
+        }
+    }
+}
+
+bool detect_speech_in_memory_batch(
+        const std::vector<const std::vector<float> *> & pcms,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        const std::vector<run_stats *> & stats,
+        std::vector<speech_edges> & edges) {
+    edges.assign(pcms.size(), speech_edges());
+    std::vector<batch_scan> scans(pcms.size());
+    // every file counts into its own stats
+    std::vector<scan_params> file_sp(pcms.size(), sp);
+    for (size_t f = 0; f < pcms.size(); ++f) {
+        batch_scan & bs = scans[f];
+        bs.pcm = pcms[f]->data();
+        bs.n_total = (int)pcms[f]->size();
+        bs.edges = &edges[f];
+        bs.stats = f < stats.size() ? stats[f] : nullptr;
+        file_sp[f].stats = bs.stats;
+        bs.edges->total_duration_seconds = (float)bs.n_total / (float)WHISPER_SAMPLE_RATE;
+        bs.edges->final_end_seconds = bs.edges->total_duration_seconds;
+        bs.tail_end = bs.n_total;
+
+        if (sp.pregate) {
+            size_t first, last;
+            if (!pregate_bounds(sp, bs.pcm, bs.n_total, first, last)) {
+                if (bs.stats) {
+                    bs.stats->samples_pregated += bs.n_total;
+                }
+                continue;
+            }
+            const int margin = WHISPER_SAMPLE_RATE / 4;
+            bs.head_end = std::max(0, (int)first - margin);
+            bs.tail_end = std::min(bs.n_total, (int)last + 1 + margin);
+            if (bs.stats) {
+                bs.stats->samples_pregated += bs.head_end + (bs.n_total - bs.tail_end);
+            }
+        }
+
+        if (sp.call_trim_start) {
+            bs.phase = batch_scan::HEAD;
+            bs.window_samples = sp.min_window_samples;
+        } else {
+            batch_enter_tail(bs, sp);
+        }
+    }
+
+    // every round runs the next window of every scan, each in a call of its own so the
+    // LSTM starts from a fresh state as in detect_speech_in_memory()
+    bool running = true;
+    while (running) {
+        running = false;
+        for (size_t f = 0; f < scans.size(); ++f) {
+            batch_scan & bs = scans[f];
+            if (!batch_next_window(bs, sp)) {
+                continue;
+            }
+            running = true;
+            const int n_context = std::min(sp.overlap_samples, bs.win_i);
+            const window_speech ws = vad_window(vctx, file_sp[f], bs.pcm + bs.win_i, bs.win_n,
+                                                (double)bs.win_i / WHISPER_SAMPLE_RATE, n_context);
+            if (ws.failed) {
+                return false;
+            }
+            batch_apply(bs, sp, ws);
+        }
+    }
+
+    return true;
+}
+
+// Scan the file while it is being decoded, holding at most one window of PCM at a time.
+// Until the onset is found the windows grow from sp.min_window_samples, after it every
+// window is sp.max_window_samples long. The start edge is taken from the first window
+// with speech, the end edge from the last one, so all the audio after the onset goes
+// through the VAD. Everything read from a "-" input is copied to tee_fd if it isn't -1.
+// With sp.decode_thread the decoder runs ahead of the inference on its own thread.
+bool detect_speech_streaming(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        int tee_fd) {
+    size_t n_decoded = 0;
+    float last_speech_end = -1.0f;
+    bool start_found = false;
+    // context from the previous window followed by the samples not inferred yet
+    std::vector<float> local_work;
+    std::vector<float> & work = sp.work_buffer ? *sp.work_buffer : local_work;
+    work.clear();
+    int n_context = 0;
+    size_t pending_start = 0;
+    int window_samples = sp.min_window_samples;
+    bool vad_failed = false;
+
+    auto need_vad = [&]() {
+        return (sp.call_trim_start && !start_found) || sp.call_trim_end;
+    };
+
+    // infer everything pending as one window
+    auto infer_pending = [&]() {
+        const int n_pending = (int)work.size() - n_context;
+        if (n_pending <= 0) {
+            return;
+        }
+        const bool need_start = sp.call_trim_start && !start_found;
+        const window_speech ws = vad_window(vctx, sp, work.data() + n_context, n_pending,
+                                            (double)pending_start / WHISPER_SAMPLE_RATE, n_context);
+        vad_failed = vad_failed || ws.failed;
+        if (ws.has_speech) {
+            if (need_start) {
+                edges.final_start_seconds = std::max(0.0f, ws.t0 - 0.5f);
+                start_found = true;
+            }
+            last_speech_end = ws.t1;
+            edges.speech_detected = true;
+        }
+        pending_start += n_pending;
+        work.erase(work.begin(), work.end() - std::min(work.size(), (size_t)sp.overlap_samples));
+        n_context = (int)work.size();
+        window_samples = start_found ? sp.max_window_samples : std::min(2 * window_samples, sp.max_window_samples);
+    };
+
+    // decoding and inference interleave, the decode time is what is left after the inference
+    const phase_time vad_before = sp.stats ? sp.stats->vad : phase_time();
+    const double wall0 = wall_seconds();
+    const double cpu0 = cpu_seconds();
+
+    bool stopped = false;
+    auto consume = [&](const float * samples, size_t n_samples) {
+        n_decoded += n_samples;
+        if (!need_vad()) {
+            return true;
+        }
+        work.insert(work.end(), samples, samples + n_samples);
+        if ((int)work.size() - n_context >= window_samples) {
+            infer_pending();
+        }
+        stopped = sp.stop_at_onset && !need_vad();
+        return !stopped && !vad_failed;
+    };
+
+    bool ok;
+    if (sp.decode_thread) {
+        bounded_queue<std::vector<float>> queue;
+        queue.capacity = std::max(1, sp.decode_queue_chunks);
+        bool decode_ok = false;
+        phase_time decode_time;
+        std::string decode_path;
+        decoder_thread local_decoder;
+        decoder_thread & decoder = sp.decoder ? *sp.decoder : local_decoder;
+        decoder.start([&]() {
+            const double dwall0 = wall_seconds();
+            const double dcpu0 = thread_cpu_seconds();
+            decode_ok = read_audio_data_chunked(audio_file, sp.min_window_samples, [&](const float * samples, size_t n_samples) {
+                return queue.push(std::vector<float>(samples, samples + n_samples));
+            }, tee_fd);
+            decode_path = resample_last_path();
+            decode_time.wall = wall_seconds() - dwall0;
+            decode_time.cpu = thread_cpu_seconds() - dcpu0;
+            queue.finish();
+        });
+        std::vector<float> chunk;
+        while (queue.pop(chunk)) {
+            if (!consume(chunk.data(), chunk.size())) {
+                queue.stop();
+                break;
+            }
+        }
+        decoder.wait();
+        ok = decode_ok;
+        if (sp.stats) {
+            // the decoder overlaps the inference, its own time is what it cost
+            sp.stats->decode.wall += decode_time.wall;
+            sp.stats->decode.cpu += decode_time.cpu;
+            sp.stats->resample_path = decode_path;
+        }
+    } else {
+        ok = read_audio_data_chunked(audio_file, sp.min_window_samples, consume, tee_fd);
+        if (sp.stats) {
+            sp.stats->decode.wall += wall_seconds() - wall0 - (sp.stats->vad.wall - vad_before.wall);
+            sp.stats->decode.cpu += cpu_seconds() - cpu0 - (sp.stats->vad.cpu - vad_before.cpu);
+            sp.stats->resample_path = resample_last_path();
+        }
+    }
+    if (ok && !vad_failed && need_vad()) {
+        infer_pending();
+    }
+
+    if (sp.stats) {
+        sp.stats->samples_decoded += n_decoded;
+    }
+
+    edges.total_duration_seconds = (float)n_decoded / (float)WHISPER_SAMPLE_RATE;
+    edges.final_end_seconds = edges.total_duration_seconds;
+    edges.duration_known = !stopped;
+    if (sp.call_trim_end && last_speech_end >= 0.0f) {
+        edges.final_end_seconds = std::min(edges.total_duration_seconds, last_speech_end + 0.5f);
+    }
+
+    return ok && !vad_failed;
+}
+
+// Seek to and decode only a window at the head and one at the tail of the file.
+// Windows start at sp.min_window_samples and double, up to sp.max_window_samples,
+// only when no speech was found in them. The tail scan stops where the head window
+// with the onset ends and falls back to its result.
+// Returns false if the file can't be probed, e.g. its duration is unknown.
+bool detect_speech_probing(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges) {
+    ffmpeg_audio_reader * reader = ffmpeg_reader_open(audio_file);
+    if (reader == nullptr) {
+        return false;
+    }
+
+    const double duration = ffmpeg_reader_duration(reader);
+    if (duration <= 0.0) {
+        ffmpeg_reader_close(reader);
+        return false;
+    }
+
+    std::vector<float> pcmf32;
+    bool ok = true;
+    bool eof_seen = false;
+
+    edges.total_duration_seconds = (float)duration;
+    edges.final_end_seconds = edges.total_duration_seconds;
+
+    // everything before head_end has been inferred by the head scan
+    double head_end = 0.0;
+    window_speech head_speech;
+
+    // decode [t0, t1) into pcmf32 along with up to sp.overlap_samples of context before it
+    int n_context = 0;
+    auto read_window = [&](double t0, double t1) {
+        phase_timer timer(sp.stats ? &sp.stats->decode : nullptr);
+        const double context_seconds = std::min(t0, (double)sp.overlap_samples / WHISPER_SAMPLE_RATE);
+        if (ffmpeg_reader_read_range(reader, t0 - context_seconds, t1, pcmf32) != 0) {
+            return false;
+        }
+        if (sp.stats) {
+            sp.stats->samples_decoded += pcmf32.size();
+        }
+        n_context = std::min((int)pcmf32.size(), (int)(context_seconds * WHISPER_SAMPLE_RATE + 0.5));
+        return true;
+    };
+
+    if (sp.call_trim_start) {
+        int window_samples = sp.min_window_samples;
+        while (head_end < duration) {
+            const double t0 = head_end;
+            const double t1 = t0 + (double)window_samples / WHISPER_SAMPLE_RATE;
+            if (!read_window(t0, t1)) {
+                ok = false;
+                break;
+            }
+            const int n_window = (int)pcmf32.size() - n_context;
+            head_end = t0 + (double)n_window / WHISPER_SAMPLE_RATE;
+            if (n_window + 1 < window_samples) {
+                // the stream ended inside the window, this is the real duration
+                edges.total_duration_seconds = (float)head_end;
+                edges.final_end_seconds = edges.total_duration_seconds;
+                eof_seen = true;
+            }
+            head_speech = vad_window(vctx, sp, pcmf32.data() + n_context, n_window, t0, n_context);
+            if (head_speech.failed) {
+                ok = false;
+                break;
+            }
+            if (head_speech.has_speech) {
+                edges.final_start_seconds = std::max(0.0f, head_speech.t0 - 0.5f);
+                edges.speech_detected = true;
+                break;
+            }
+            if (eof_seen) {
+                break;
+            }
+            window_samples = std::min(2 * window_samples, sp.max_window_samples);
+        }
+    }
+
+    if (ok && sp.call_trim_end && (edges.speech_detected || !sp.call_trim_start)) {
+        int window_samples = sp.min_window_samples;
+        double t1 = eof_seen ? head_end : duration;
+        bool found = false;
+        while (!found && t1 > head_end) {
+            const double t0 = std::max(head_end, t1 - (double)window_samples / WHISPER_SAMPLE_RATE);
+            // the first tail window runs to the real end of the stream, which also
+            // corrects the duration reported by the container
+            if (!read_window(t0, eof_seen ? t1 : -1.0)) {
+                ok = false;
+                break;
+            }
+            const int n_window = (int)pcmf32.size() - n_context;
+            if (!eof_seen) {
+                edges.total_duration_seconds = (float)(t0 + (double)n_window / WHISPER_SAMPLE_RATE);
+                edges.final_end_seconds = edges.total_duration_seconds;
+                eof_seen = true;
+            }
+            const window_speech ws = vad_window(vctx, sp, pcmf32.data() + n_context, n_window, t0, n_context);
+            if (ws.failed) {
+                ok = false;
+                break;
+            }
+            if (ws.has_speech) {
+                edges.final_end_seconds = std::min(edges.total_duration_seconds, ws.t1 + 0.5f);
+                edges.speech_detected = true;
+                found = true;
+            }
+            t1 = t0;
+            window_samples = std::min(2 * window_samples, sp.max_window_samples);
+        }
+        if (ok && !found && head_speech.has_speech) {
+            edges.final_end_seconds = std::min(edges.total_duration_seconds, head_speech.t1 + 0.5f);
+        }
+    }
+
+    ffmpeg_reader_close(reader);
+
+    return ok;
+}
+
+// seconds decoded around the active ranges of the packet scan, for the onset ramps
+// the VAD needs and frames at the edge of a range that were only almost quiet
+static const double HINT_MARGIN_SECONDS = 0.5;
+// active ranges closer than this are decoded as one
+static const double HINT_MIN_GAP_SECONDS = 1.0;
+
+bool detect_speech_hinted(
+        const std::string & audio_file,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges) {
+    std::vector<ffmpeg_time_range> active;
+    double duration = 0.0;
+    {
+        phase_timer timer(sp.stats ? &sp.stats->decode : nullptr);
+        if (ffmpeg_packet_activity(audio_file, HINT_MIN_GAP_SECONDS, active, duration) != 0 || duration <= 0.0) {
+            return false;
+        }
+    }
+
+    edges.total_duration_seconds = (float)duration;
+    edges.final_end_seconds = edges.total_duration_seconds;
+    if (active.empty()) {
+        // nothing but quiet packets
+        return true;
+    }
+
+    ffmpeg_audio_reader * reader = ffmpeg_reader_open(audio_file);
+    if (reader == nullptr) {
+        return false;
+    }
+
+    std::vector<float> pcmf32;
+    int n_context = 0;
+    // decode [t0, t1) into pcmf32 along with up to sp.overlap_samples of context before it
+    auto read_window = [&](double t0, double t1) {
+        phase_timer timer(sp.stats ? &sp.stats->decode : nullptr);
+        const double context_seconds = std::min(t0, (double)sp.overlap_samples / WHISPER_SAMPLE_RATE);
+        if (ffmpeg_reader_read_range(reader, t0 - context_seconds, t1, pcmf32) != 0) {
+            return false;
+        }
+        if (sp.stats) {
+            sp.stats->samples_decoded += pcmf32.size();
+        }
+        n_context = std::min((int)pcmf32.size(), (int)(context_seconds * WHISPER_SAMPLE_RATE + 0.5));
+        return true;
+    };
+    auto infer = [&](double t0) {
+        return vad_window(vctx, sp, pcmf32.data() + n_context, (int)pcmf32.size() - n_context, t0, n_context);
+    };
+
+    bool ok = true;
+    // everything before head_end has been inferred by the head scan
+    double head_end = 0.0;
+    window_speech head_speech;
+
+    if (sp.call_trim_start) {
+        for (size_t r = 0; ok && r < active.size() && !head_speech.has_speech; ++r) {
+            const double end = std::min(duration, active[r].t1 + HINT_MARGIN_SECONDS);
+            double t0 = std::max(head_end, active[r].t0 - HINT_MARGIN_SECONDS);
+            int window_samples = sp.min_window_samples;
+            while (t0 < end) {
+                const double t1 = std::min(end, t0 + (double)window_samples / WHISPER_SAMPLE_RATE);
+                if (!read_window(t0, t1)) {
+                    ok = false;
+                    break;
+                }
+                head_speech = infer(t0);
+                head_end = t1;
+                if (head_speech.failed) {
+                    ok = false;
+                    break;
+                }
+                if (head_speech.has_speech) {
+                    edges.final_start_seconds = std::max(0.0f, head_speech.t0 - 0.5f);
+                    edges.speech_detected = true;
+                    break;
+                }
+                t0 = t1;
+                window_samples = std::min(2 * window_samples, sp.max_window_samples);
+            }
+        }
+    }
+
+    if (ok && sp.call_trim_end && (edges.speech_detected || !sp.call_trim_start)) {
+        bool found = false;
+        for (size_t r = active.size(); ok && !found && r-- > 0; ) {
+            const double begin = std::max(head_end, active[r].t0 - HINT_MARGIN_SECONDS);
+            double t1 = std::min(duration, active[r].t1 + HINT_MARGIN_SECONDS);
+            int window_samples = sp.min_window_samples;
+            while (t1 > begin) {
+                const double t0 = std::max(begin, t1 - (double)window_samples / WHISPER_SAMPLE_RATE);
+                if (!read_window(t0, t1)) {
+                    ok = false;
+                    break;
+                }
+                const window_speech ws = infer(t0);
+                if (ws.failed) {
+                    ok = false;
+                    break;
+                }
+                if (ws.has_speech) {
+                    edges.final_end_seconds = std::min(edges.total_duration_seconds, ws.t1 + 0.5f);
+                    edges.speech_detected = true;
+                    found = true;
+                    break;
+                }
+                t1 = t0;
+                window_samples = std::min(2 * window_samples, sp.max_window_samples);
+            }
+        }
+        if (ok && !found && head_speech.has_speech) {
+            edges.final_end_seconds = std::min(edges.total_duration_seconds, head_speech.t1 + 0.5f);
+        }
+    }
+
+    ffmpeg_reader_close(reader);
+
+    return ok;
+}
+
+// Decode the whole file as mono, accounting the time to stats if set
+bool read_audio_timed(const std::string & audio_file, std::vector<float> & pcmf32, run_stats * stats) {
+    phase_timer timer(stats ? &stats->decode : nullptr);
+    std::vector<std::vector<float>> pcmf32s;
+    if (!read_audio_data(audio_file, pcmf32, pcmf32s, false)) {
+        return false;
+    }
+    if (stats) {
+        stats->samples_decoded += pcmf32.size();
+        stats->resample_path = resample_last_path();
+    }
+    return true;
+}
+
+// Set the edges from the speech segments of the whole file
+static void edges_from_segments(
+        const std::vector<vad_segment> & segments,
+        uint64_t n_samples,
+        const scan_params & sp,
+        speech_edges & edges) {
+    edges.total_duration_seconds = (float)n_samples / (float)WHISPER_SAMPLE_RATE;
+    edges.final_end_seconds = edges.total_duration_seconds;
+
+    if (segments.empty()) {
+        return;
+    }
+
+    edges.speech_detected = true;
+    if (sp.call_trim_start) {
+        edges.final_start_seconds = std::max(0.0f, segments.front().t0 - 0.5f);
+    }
+    if (sp.call_trim_end) {
+        edges.final_end_seconds = std::min(edges.total_duration_seconds, segments.back().t1 + 0.5f);
+    }
+}
+
+// Run the VAD over the whole file at once and keep every segment, for when the
+// full segment list is wanted and not only the edges
+bool detect_speech_segments(
+        const std::vector<float> & pcmf32,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments) {
+    segments.clear();
+    if (!pcmf32.empty()) {
+        phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+        if (sp.stats) {
+            sp.stats->samples_inferred += pcmf32.size();
+            sp.stats->vad_calls++;
+        }
+        struct whisper_vad_segments * vsegs = whisper_vad_segments_from_samples(vctx, sp.vad_params, pcmf32.data(), (int)pcmf32.size());
+        if (vsegs == nullptr) {
+            return false;
+        }
+        const int n_seg = whisper_vad_segments_n_segments(vsegs);
+        for (int i = 0; i < n_seg; ++i) {
+            segments.push_back({ whisper_vad_segments_get_segment_t0(vsegs, i) * 0.01f,
+                                 whisper_vad_segments_get_segment_t1(vsegs, i) * 0.01f });
+        }
+        whisper_vad_free_segments(vsegs);
+    }
+
+    edges_from_segments(segments, pcmf32.size(), sp, edges);
+
+    return true;
+}
+
+// Windows of the speech map not taken yet by the worker that owns them, [next, end)
+struct map_share {
+    std::mutex mutex;
+    size_t next = 0;
+    size_t end = 0;
+};
+
+// Next window for worker w: the front of its own share, or else the back half of the
+// largest share left, which becomes its own. false once every window is taken.
+static bool map_take_window(std::vector<map_share> & shares, size_t w, size_t & window) {
+    {
+        std::lock_guard<std::mutex> lock(shares[w].mutex);
+        if (shares[w].next < shares[w].end) {
+            window = shares[w].next++;
+            return true;
+        }
+    }
+    while (true) {
+        size_t victim = shares.size();
+        size_t most = 0;
+        for (size_t v = 0; v < shares.size(); ++v) {
+            std::lock_guard<std::mutex> lock(shares[v].mutex);
+            if (shares[v].end - shares[v].next > most) {
+                most = shares[v].end - shares[v].next;
+                victim = v;
+            }
+        }
+        if (victim == shares.size()) {
+            return false;
+        }
+        size_t first, last;
+        {
+            std::lock_guard<std::mutex> lock(shares[victim].mutex);
+            const size_t left = shares[victim].end - shares[victim].next;
+            if (left == 0) {
+                // taken since it was looked at
+                continue;
+            }
+            last = shares[victim].end;
+            first = last - (left + 1) / 2;
+            shares[victim].end = first;
+        }
+        std::lock_guard<std::mutex> lock(shares[w].mutex);
+        shares[w].next = first + 1;
+        shares[w].end = last;
+        window = first;
+        return true;
+    }
+}
+
+// Split the samples into windows of sp.max_window_samples and infer them on n_workers
+// contexts of ctxs at once. Every worker starts on an equal share of consecutive windows
+// and steals from the others once its own are done, so a slow context or a window
+// skipped by the pre-gate doesn't leave cores idle. A window is inferred with the
+// sp.overlap_samples before it as context and its probabilities are written to the
+// frames it covers in one array for the whole file. The segments come out of a single
+// pass over that array, so speech across a window boundary is one segment and no
+// boundary is reported twice.
+bool detect_speech_map(
+        const float * pcmf32,
+        size_t n_samples,
+        vad_contexts & ctxs,
+        int n_workers,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments) {
+    const size_t n_frame = VAD_CACHE_FRAME_SAMPLES;
+    // windows and context start on frames, so every probability lands on its own frame
+    const size_t n_window = std::max(n_frame, (size_t)sp.max_window_samples / n_frame * n_frame);
+    const size_t n_overlap = ((size_t)std::max(0, sp.overlap_samples) + n_frame - 1) / n_frame * n_frame;
+    const size_t n_windows = (n_samples + n_window - 1) / n_window;
+    const size_t n_probs = (n_samples + n_frame - 1) / n_frame;
+
+    segments.clear();
+    n_workers = (int)std::max<size_t>(1, std::min<size_t>(n_workers, n_windows));
+    for (int w = 0; w < n_workers; ++w) {
+        if (ctxs.get(w) == nullptr) {
+            return false;
+        }
+    }
+
+    std::vector<float> probs(n_probs, 0.0f);
+    std::vector<map_share> shares(n_workers);
+    for (int w = 0; w < n_workers; ++w) {
+        shares[w].next = n_windows * w / n_workers;
+        shares[w].end = n_windows * (w + 1) / n_workers;
+    }
+    std::vector<run_stats> worker_stats(n_workers);
+    std::atomic<bool> failed{false};
+
+    auto worker = [&](size_t w) {
+        struct whisper_vad_context * vctx = ctxs.vctxs[w];
+        run_stats & st = worker_stats[w];
+        size_t k;
+        while (!failed && map_take_window(shares, w, k)) {
+            const size_t i = k * n_window;
+            const size_t n = std::min(n_window, n_samples - i);
+            if (pregate_silent(sp, pcmf32 + i, (int)n)) {
+                st.samples_pregated += n;
+                continue;
+            }
+            const size_t n_context = std::min(n_overlap, i);
+            st.samples_inferred += n_context + n;
+            st.vad_calls++;
+            if (!whisper_vad_detect_speech(vctx, pcmf32 + i - n_context, (int)(n_context + n))) {
+                failed = true;
+                return;
+            }
+            const float * window_probs = whisper_vad_probs(vctx);
+            const size_t n_window_probs = (size_t)whisper_vad_n_probs(vctx);
+            const size_t frame0 = n_context / n_frame;
+            const size_t n_copy = std::min((n + n_frame - 1) / n_frame, n_window_probs > frame0 ? n_window_probs - frame0 : 0);
+            std::copy(window_probs + frame0, window_probs + frame0 + n_copy, probs.begin() + i / n_frame);
+        }
+    };
+
+    {
+        phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+        std::vector<std::thread> threads;
+        for (int w = 1; w < n_workers; ++w) {
+            threads.emplace_back(worker, (size_t)w);
+        }
+        worker(0);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        if (failed) {
+            return false;
+        }
+        vad_segments_from_probs_f32(probs.data(), probs.size(), sp.vad_params, segments);
+    }
+    if (sp.stats) {
+        for (const run_stats & ws : worker_stats) {
+            sp.stats->samples_inferred += ws.samples_inferred;
+            sp.stats->samples_pregated += ws.samples_pregated;
+            sp.stats->vad_calls += ws.vad_calls;
+        }
+    }
+
+    edges_from_segments(segments, n_samples, sp, edges);
+
+    return true;
+}
+
+void speech_keep_ranges(
+        const std::vector<vad_segment> & segments,
+        const speech_edges & edges,
+        float min_silence_seconds,
+        float margin_seconds,
+        std::vector<vad_segment> & keep) {
+    keep.clear();
+    if (segments.empty()) {
+        return;
+    }
+    // a gap is only dropped if something is left of it after the margins
+    const float min_gap = std::max(min_silence_seconds, 2.0f * margin_seconds);
+    vad_segment range = { edges.final_start_seconds, segments.front().t1 };
+    for (size_t i = 1; i < segments.size(); ++i) {
+        if (segments[i].t0 - range.t1 > min_gap) {
+            range.t1 += margin_seconds;
+            keep.push_back(range);
+            range.t0 = segments[i].t0 - margin_seconds;
+        }
+        range.t1 = std::max(range.t1, segments[i].t1);
+    }
+    range.t1 = edges.final_end_seconds;
+    keep.push_back(range);
+}
+
+// Derive the edges from the VAD probabilities of the whole file, cached in cache_dir
+// under the hash of the file content and the hash of the model. A hit skips decoding
+// and inference, only the segment thresholds are evaluated again. On a miss the whole
+// file is decoded and inferred in one go and the probabilities are stored.
+// Returns false if the file can't be read.
+bool detect_speech_cached(
+        const std::string & audio_file,
+        const std::string & cache_dir,
+        uint64_t model_hash,
+        struct whisper_vad_context * vctx,
+        const scan_params & sp,
+        speech_edges & edges,
+        std::vector<vad_segment> & segments) {
+    uint64_t content_hash;
+    {
+        phase_timer timer(sp.stats ? &sp.stats->hash : nullptr);
+        if (!vad_hash_file(audio_file, content_hash)) {
+            fprintf(stderr, "Error: Failed to read %s\n", audio_file.c_str());
+            return false;
+        }
+    }
+
+    const std::string path = vad_cache_path(cache_dir, content_hash, model_hash);
+
+    vad_cache_entry entry;
+    if (vad_cache_open(path, content_hash, model_hash, entry)) {
+        if (sp.stats) {
+            sp.stats->cache_hits++;
+        }
+        phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+        vad_segments_from_probs_u8(entry.probs, entry.n_probs, sp.vad_params, segments);
+        edges_from_segments(segments, entry.n_samples, sp, edges);
+        vad_cache_close(entry);
+        return true;
+    }
+
+    if (sp.stats) {
+        sp.stats->cache_misses++;
+    }
+    std::vector<float> pcmf32;
+    if (!read_audio_timed(audio_file, pcmf32, sp.stats)) {
+        fprintf(stderr, "Error: Failed to read audio data from %s\n", audio_file.c_str());
+        return false;
+    }
+
+    phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+    std::vector<uint8_t> probs_q;
+    if (!pcmf32.empty()) {
+        if (sp.stats) {
+            sp.stats->samples_inferred += pcmf32.size();
+            sp.stats->vad_calls++;
+        }
+        if (!whisper_vad_detect_speech(vctx, pcmf32.data(), (int)pcmf32.size())) {
+            fprintf(stderr, "Error: Failed to run the VAD on %s\n", audio_file.c_str());
+            return false;
+        }
+        vad_quantize_probs(whisper_vad_probs(vctx), whisper_vad_n_probs(vctx), probs_q);
+    }
+
+    if (!vad_cache_store(path, content_hash, model_hash, pcmf32.size(), probs_q)) {
+        fprintf(stderr, "Warning: Failed to write VAD cache entry %s\n", path.c_str());
+    }
+
+    // the quantized probabilities are used on a miss too, so a hit gives the same edges
+    vad_segments_from_probs_u8(probs_q.data(), probs_q.size(), sp.vad_params, segments);
+    edges_from_segments(segments, pcmf32.size(), sp, edges);
+
+    return true;
+}
+
+static void trim_buffer(std::vector<float> & buf, size_t max_samples) {
+    if (buf.capacity() > max_samples) {
+        std::vector<float>().swap(buf);
+    }
+}
+
+void vad_contexts::trim_buffers(size_t max_samples) {
+    trim_buffer(pcm, max_samples);
+    trim_buffer(work, max_samples);
+    for (std::vector<float> & channel : channels) {
+        trim_buffer(channel, max_samples);
+    }
+    for (std::vector<float> & b : batch) {
+        trim_buffer(b, max_samples);
+    }
+}
+
+decoder_thread::~decoder_thread() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        cond.notify_all();
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void decoder_thread::start(std::function<void()> fn) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!thread.joinable()) {
+        thread = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cond.wait(lock, [&]() { return quit || job; });
+                if (!job) {
+                    return;
+                }
+                std::function<void()> current = std::move(job);
+                job = nullptr;
+                lock.unlock();
+                current();
+                lock.lock();
+                busy = false;
+                cond.notify_all();
+            }
+        });
+    }
+    cond.wait(lock, [&]() { return !busy; });
+    job = std::move(fn);
+    busy = true;
+    cond.notify_all();
+}
+
+void decoder_thread::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&]() { return !busy; });
+}
+
+struct whisper_vad_context * vad_contexts::get(size_t i) {
+    while (vctxs.size() <= i) {
+        struct whisper_vad_context * vctx = vad_model_init(model_path, vparams);
+        if (vctx == nullptr) {
+            fprintf(stderr, "Error: Failed to initialize VAD context using model from %s\n", model_path.c_str());
+            return nullptr;
+        }
+        vctxs.push_back(vctx);
+    }
+    return vctxs[i];
+}
+
+// Scan every channel on its own, concurrently and each with its own VAD context,
+// and merge the edges so the kept range covers the speech of every channel. A quiet
+// speaker on one channel can't be masked by a louder one on the other, as in the mix.
+bool detect_speech_per_channel(
+        const std::vector<std::vector<float>> & channels,
+        vad_contexts & ctxs,
+        const scan_params & sp,
+        speech_edges & edges) {
+    for (size_t c = 0; c < channels.size(); ++c) {
+        if (ctxs.get(c) == nullptr) {
+            return false;
+        }
+    }
+
+    // every channel counts into its own stats, the inference time is that of all of them together
+    std::vector<speech_edges> channel_edges(channels.size());
+    std::vector<run_stats> channel_stats(channels.size());
+    std::vector<scan_params> channel_sp(channels.size(), sp);
+    // not std::vector<bool>, the threads write their own entries concurrently
+    std::vector<char> channel_ok(channels.size(), 0);
+    for (size_t c = 0; c < channels.size(); ++c) {
+        channel_sp[c].stats = sp.stats ? &channel_stats[c] : nullptr;
+    }
+    {
+        phase_timer timer(sp.stats ? &sp.stats->vad : nullptr);
+        std::vector<std::thread> threads;
+        for (size_t c = 1; c < channels.size(); ++c) {
+            threads.emplace_back([&, c]() {
+                channel_ok[c] = detect_speech_in_memory(channels[c].data(), channels[c].size(), ctxs.vctxs[c], channel_sp[c], channel_edges[c]);
+            });
+        }
+        channel_ok[0] = detect_speech_in_memory(channels[0].data(), channels[0].size(), ctxs.vctxs[0], channel_sp[0], channel_edges[0]);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+    }
+    if (std::find(channel_ok.begin(), channel_ok.end(), 0) != channel_ok.end()) {
+        return false;
+    }
+    if (sp.stats) {
+        for (const run_stats & cs : channel_stats) {
+            sp.stats->samples_inferred += cs.samples_inferred;
+            sp.stats->samples_pregated += cs.samples_pregated;
+            sp.stats->vad_calls += cs.vad_calls;
+        }
+    }
+
+    edges = speech_edges();
+    for (const speech_edges & ce : channel_edges) {
+        edges.total_duration_seconds = std::max(edges.total_duration_seconds, ce.total_duration_seconds);
+    }
+    edges.final_start_seconds = edges.total_duration_seconds;
+    edges.final_end_seconds = 0.0f;
+    for (const speech_edges & ce : channel_edges) {
+        if (ce.speech_detected) {
+            edges.final_start_seconds = std::min(edges.final_start_seconds, ce.final_start_seconds);
+            edges.final_end_seconds = std::max(edges.final_end_seconds, ce.final_end_seconds);
+            edges.speech_detected = true;
+        }
+    }
+    if (!edges.speech_detected) {
+        edges.final_start_seconds = 0.0f;
+        edges.final_end_seconds = edges.total_duration_seconds;
+    }
+
+    return true;
+}
+
+bool speech_edges_has_silence(const speech_edges & edges) {
+    return edges.final_start_seconds > 0.01f ||
+           (edges.duration_known && edges.final_end_seconds < edges.total_duration_seconds - 0.01f);
+}
@@ -0,0 +1,419 @@
+#include "vad-cache.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// XXH64
+//
+
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t * p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc  = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t vad_hash_bytes(const void * data, size_t size, uint64_t seed) {
+    const uint8_t * p   = (const uint8_t *) data;
+    const uint8_t * end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        const uint8_t * limit = end - 32;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));      p += 8;
+            v2 = xxh_round(v2, xxh_read64(p));      p += 8;
+            v3 = xxh_round(v3, xxh_read64(p));      p += 8;
+            v4 = xxh_round(v4, xxh_read64(p));      p += 8;
+        } while (p <= limit);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += (uint64_t) size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h  = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) xxh_read32(p) * XXH_PRIME64_1;
+        h  = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h  = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+bool vad_hash_file(const std::string & path, uint64_t & hash) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        hash = vad_hash_bytes(nullptr, 0);
+        return true;
+    }
+
+    void * data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    hash = vad_hash_bytes(data, size);
+    munmap(data, size);
+
+    return true;
+}
+
+void vad_quantize_probs(const float * probs, size_t n_probs, std::vector<uint8_t> & probs_q) {
+    probs_q.resize(n_probs);
+    for (size_t i = 0; i < n_probs; i++) {
+        const float p = std::min(1.0f, std::max(0.0f, probs[i]));
+        probs_q[i] = (uint8_t) lrintf(p * 255.0f);
+    }
+}
+
+//
+// segments
+//
+
+// A port of the segmenter of whisper_vad_segments_from_probs(), see vad-cache.h for where
+// it differs. prob_at(i) is the probability of frame i in [0, 1]
+template <typename prob_fn>
+static void segments_from_probs(
+        prob_fn prob_at,
+        size_t n_probs,
+        const struct whisper_vad_params & params,
+        std::vector<vad_segment> & segments) {
+    const int n_window    = VAD_CACHE_FRAME_SAMPLES;
+    const int sample_rate = WHISPER_SAMPLE_RATE;
+
+    const float threshold     = params.threshold;
+    const float neg_threshold = std::max(0.01f, threshold - 0.15f);
+
+    const int min_speech_samples  = sample_rate * params.min_speech_duration_ms  / 1000;
+    const int min_silence_samples = sample_rate * params.min_silence_duration_ms / 1000;
+    const int speech_pad_samples  = sample_rate * params.speech_pad_ms           / 1000;
+    const int audio_length_samples = (int) n_probs * n_window;
+
+    int max_speech_samples = INT_MAX / 2;
+    if (params.max_speech_duration_s <= 100000.0f) {
+        const int64_t n = (int64_t) sample_rate * (int64_t) params.max_speech_duration_s - n_window - 2 * speech_pad_samples;
+        if (n >= 0 && n <= INT_MAX) {
+            max_speech_samples = (int) n;
+        }
+    }
+    // a silence this long inside an overlong segment is where it gets split
+    const int min_silence_samples_at_max_speech = sample_rate * 98 / 1000;
+
+    struct speech { int start; int end; };
+    std::vector<speech> speeches;
+
+    bool is_speech   = false;
+    bool has_speech  = false;
+    int temp_end     = 0;
+    int prev_end     = 0;
+    int next_start   = 0;
+    int speech_start = 0;
+
+    for (size_t i = 0; i < n_probs; i++) {
+        const float prob = prob_at(i);
+        const int sample = n_window * (int) i;
+
+        if (prob >= threshold && temp_end) {
+            temp_end = 0;
+            if (next_start < prev_end) {
+                next_start = sample;
+            }
+        }
+
+        if (prob >= threshold && !is_speech) {
+            is_speech    = true;
+            has_speech   = true;
+            speech_start = sample;
+            continue;
+        }
+
+        if (is_speech && sample - speech_start > max_speech_samples) {
+            if (prev_end) {
+                speeches.push_back({ speech_start, prev_end });
+                if (next_start < prev_end) {
+                    is_speech  = false;
+                    has_speech = false;
+                } else {
+                    speech_start = next_start;
+                }
+                prev_end = next_start = temp_end = 0;
+            } else {
+                speeches.push_back({ speech_start, sample });
+                prev_end = next_start = temp_end = 0;
+                is_speech  = false;
+                has_speech = false;
+                continue;
+            }
+        }
+
+        if (prob < neg_threshold && is_speech) {
+            if (!temp_end) {
+                temp_end = sample;
+            }
+            if (sample - temp_end > min_silence_samples_at_max_speech) {
+                prev_end = temp_end;
+            }
+            if (sample - temp_end < min_silence_samples) {
+                continue;
+            }
+            if (temp_end - speech_start > min_speech_samples) {
+                speeches.push_back({ speech_start, temp_end });
+            }
+            prev_end = next_start = temp_end = 0;
+            is_speech  = false;
+            has_speech = false;
+        }
+    }
+
+    if (has_speech && audio_length_samples - speech_start > min_speech_samples) {
+        speeches.push_back({ speech_start, audio_length_samples });
+    }
+
+    // merge segments separated by very short gaps
+    const int merge_samples = sample_rate / 5;
+    for (size_t i = 0; i + 1 < speeches.size(); ) {
+        if (speeches[i + 1].start - speeches[i].end < merge_samples) {
+            speeches[i].end = speeches[i + 1].end;
+            speeches.erase(speeches.begin() + i + 1);
+        } else {
+            i++;
+        }
+    }
+
+    // pad, splitting gaps shorter than twice the padding between both sides
+    for (size_t i = 0; i < speeches.size(); i++) {
+        if (i == 0) {
+            speeches[i].start = std::max(0, speeches[i].start - speech_pad_samples);
+        }
+        if (i + 1 < speeches.size()) {
+            const int silence = speeches[i + 1].start - speeches[i].end;
+            if (silence < 2 * speech_pad_samples) {
+                speeches[i].end       += silence / 2;
+                speeches[i + 1].start  = std::max(0, speeches[i + 1].start - silence / 2);
+            } else {
+                speeches[i].end       = std::min(audio_length_samples, speeches[i].end + speech_pad_samples);
+                speeches[i + 1].start = std::max(0, speeches[i + 1].start - speech_pad_samples);
+            }
+        } else {
+            speeches[i].end = std::min(audio_length_samples, speeches[i].end + speech_pad_samples);
+        }
+    }
+
+    segments.clear();
+    for (const speech & s : speeches) {
+        segments.push_back({ (float) s.start / sample_rate, (float) s.end / sample_rate });
+    }
+}
+
+void vad_segments_from_probs_u8(
+        const uint8_t * probs_q,
+        size_t n_probs,
+        const struct whisper_vad_params & params,
+        std::vector<vad_segment> & segments) {
+    segments_from_probs([probs_q](size_t i) { return probs_q[i] * (1.0f / 255.0f); }, n_probs, params, segments);
+}
+
+void vad_segments_from_probs_f32(
+        const float * probs,
+        size_t n_probs,
+        const struct whisper_vad_params & params,
+        std::vector<vad_segment> & segments) {
+    segments_from_probs([probs](size_t i) { return probs[i]; }, n_probs, params, segments);
+}
+
+//
+// cache entries
+//
+
+// file layout: the header followed by n_probs u8 probabilities
+struct vad_cache_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t frame_samples;
+    uint32_t reserved;
+    uint64_t content_hash;
+    uint64_t model_hash;
+    uint64_t n_samples;
+    uint64_t n_probs;
+};
+
+static const char     VAD_CACHE_MAGIC[4] = { 'V', 'A', 'D', 'P' };
+static const uint32_t VAD_CACHE_VERSION  = 1;
+
+std::string vad_cache_path(const std::string & dir, uint64_t content_hash, uint64_t model_hash) {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%016llx.vadp", (unsigned long long) content_hash, (unsigned long long) model_hash);
+
+    if (dir.empty() || dir.back() == '/') {
+        return dir + name;
+    }
+    return dir + "/" + name;
+}
+
+bool vad_cache_open(const std::string & path, uint64_t content_hash, uint64_t model_hash, vad_cache_entry & entry) {
+    entry = vad_cache_entry();
+
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(vad_cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    void * map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    vad_cache_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, VAD_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != VAD_CACHE_VERSION ||
+        hdr.frame_samples != VAD_CACHE_FRAME_SAMPLES ||
+        hdr.content_hash != content_hash ||
+        hdr.model_hash != model_hash ||
+        hdr.n_probs != size - sizeof(hdr)) {
+        munmap(map, size);
+        return false;
+    }
+
+    entry.n_samples = hdr.n_samples;
+    entry.probs     = (const uint8_t *) map + sizeof(hdr);
+    entry.n_probs   = (size_t) hdr.n_probs;
+    entry.map       = map;
+    entry.map_size  = size;
+
+    return true;
+}
+
+void vad_cache_close(vad_cache_entry & entry) {
+    if (entry.map) {
+        munmap(entry.map, entry.map_size);
+    }
+    entry = vad_cache_entry();
+}
+
+bool vad_cache_store(
+        const std::string & path,
+        uint64_t content_hash,
+        uint64_t model_hash,
+        uint64_t n_samples,
+        const std::vector<uint8_t> & probs_q) {
+    vad_cache_header hdr;
+    memcpy(hdr.magic, VAD_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version       = VAD_CACHE_VERSION;
+    hdr.frame_samples = VAD_CACHE_FRAME_SAMPLES;
+    hdr.reserved      = 0;
+    hdr.content_hash  = content_hash;
+    hdr.model_hash    = model_hash;
+    hdr.n_samples     = n_samples;
+    hdr.n_probs       = probs_q.size();
+
+    // write next to the entry and rename, so a concurrent reader never maps a partial file
+    std::string tmp = path + ".XXXXXX";
+    const int fd = mkstemp(&tmp[0]);
+    if (fd == -1) {
+        return false;
+    }
+
+    FILE * f = fdopen(fd, "wb");
+    if (f == nullptr) {
+        close(fd);
+        remove(tmp.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && !probs_q.empty()) {
+        ok = fwrite(probs_q.data(), 1, probs_q.size(), f) == probs_q.size();
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
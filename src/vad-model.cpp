@@ -0,0 +1,144 @@
+#include "vad-model.h"
+#include "vad-cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef DETECT_SPEECH_EMBEDDED_MODEL
+// defined by the assembly generated from src/vad-model-embed.S.in
+extern "C" const unsigned char detect_speech_model_start[];
+extern "C" const unsigned char detect_speech_model_end[];
+#endif
+
+// A model image in memory, either mapped from a file or linked into the binary
+struct vad_model_image {
+    const uint8_t * data = nullptr;
+    size_t size = 0;
+};
+
+// The file mappings are made once per process and kept until it exits, so creating
+// contexts later, e.g. for more channels, doesn't touch the file again
+static std::mutex g_images_mutex;
+static std::map<std::string, vad_model_image> g_images;
+
+static bool map_model(const std::string & path, vad_model_image & image) {
+    std::lock_guard<std::mutex> lock(g_images_mutex);
+
+    auto it = g_images.find(path);
+    if (it != g_images.end()) {
+        image = it->second;
+        return true;
+    }
+
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: %s is empty or can't be read\n", __func__, path.c_str());
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    void * data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map %s\n", __func__, path.c_str());
+        return false;
+    }
+    // the loader reads the file front to back, once
+    madvise(data, size, MADV_WILLNEED);
+
+    image.data = (const uint8_t *) data;
+    image.size = size;
+    g_images[path] = image;
+
+    return true;
+}
+
+static bool get_image(const std::string & path, vad_model_image & image) {
+    if (!path.empty()) {
+        return map_model(path, image);
+    }
+#ifdef DETECT_SPEECH_EMBEDDED_MODEL
+    image.data = detect_speech_model_start;
+    image.size = (size_t)(detect_speech_model_end - detect_speech_model_start);
+    return true;
+#else
+    fprintf(stderr, "%s: no model path given and no model embedded in the binary\n", __func__);
+    return false;
+#endif
+}
+
+bool vad_model_embedded() {
+#ifdef DETECT_SPEECH_EMBEDDED_MODEL
+    return true;
+#else
+    return false;
+#endif
+}
+
+//
+// whisper_model_loader over an image
+//
+
+struct image_reader {
+    const uint8_t * data;
+    size_t size;
+    size_t pos;
+};
+
+static size_t image_read(void * ctx, void * output, size_t read_size) {
+    image_reader * reader = (image_reader *) ctx;
+    const size_t n = std::min(read_size, reader->size - reader->pos);
+    memcpy(output, reader->data + reader->pos, n);
+    reader->pos += n;
+    return n;
+}
+
+static bool image_eof(void * ctx) {
+    image_reader * reader = (image_reader *) ctx;
+    return reader->pos >= reader->size;
+}
+
+static void image_close(void * ctx) {
+    (void) ctx;
+}
+
+struct whisper_vad_context * vad_model_init(const std::string & path, struct whisper_vad_context_params params) {
+    vad_model_image image;
+    if (!get_image(path, image)) {
+        return nullptr;
+    }
+
+    image_reader reader = { image.data, image.size, 0 };
+
+    whisper_model_loader loader;
+    loader.context = &reader;
+    loader.read = image_read;
+    loader.eof = image_eof;
+    loader.close = image_close;
+
+    return whisper_vad_init_with_params(&loader, params);
+}
+
+bool vad_model_hash(const std::string & path, uint64_t & hash) {
+    vad_model_image image;
+    if (!get_image(path, image)) {
+        return false;
+    }
+    hash = vad_hash_bytes(image.data, image.size);
+    return true;
+}
@@ -0,0 +1,102 @@
+// Tests of the JSON parser the --serve jobs go through, see include/serve.h
+
+#include "serve.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+static int n_failed = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            n_failed++; \
+        } \
+    } while (0)
+
+static bool parses(const std::string & text) {
+    std::map<std::string, json_value> fields;
+    return parse_json_object(text, fields);
+}
+
+static void test_scalars() {
+    std::map<std::string, json_value> fields;
+    CHECK(parse_json_object(" { \"file\": \"a b.opus\", \"id\" : 12, \"replace\": true, \"x\": false, \"n\": null, \"f\": -0.5e+3 } ", fields));
+    CHECK(fields.size() == 6);
+    CHECK(fields["file"].is_string && fields["file"].str == "a b.opus");
+    CHECK(!fields["id"].is_string && fields["id"].raw == "12");
+    CHECK(fields["replace"].raw == "true");
+    CHECK(fields["x"].raw == "false");
+    CHECK(fields["n"].raw == "null");
+    CHECK(fields["f"].raw == "-0.5e+3");
+
+    CHECK(parses("{}"));
+    CHECK(parses("{ }"));
+    CHECK(parses("{\"a\": 0}"));
+    CHECK(parses("{\"a\": 1.25E-2}"));
+}
+
+static void test_strings() {
+    std::map<std::string, json_value> fields;
+    CHECK(parse_json_object("{\"s\": \"q\\\"b\\\\s\\/n\\nt\\tu\\u00e9\\ud83d\\ude00\"}", fields));
+    CHECK(fields["s"].str == "q\"b\\s/n\nt\tu\xc3\xa9\xf0\x9f\x98\x80");
+
+    // the id of a job goes back out escaped
+    CHECK(json_escape("a\"b\\c\nd\x01") == "a\\\"b\\\\c\\nd\\u0001");
+    CHECK(parse_json_object("{\"s\": \"" + json_escape("a\"b\\c\nd\x01") + "\"}", fields));
+    CHECK(fields["s"].str == "a\"b\\c\nd\x01");
+}
+
+static void test_rejected() {
+    // bare words and broken literals
+    CHECK(!parses("{\"id\": foo\"bar, \"file\": \"x\"}"));
+    CHECK(!parses("{\"trim_start\": yes}"));
+    CHECK(!parses("{\"a\": truex}"));
+    CHECK(!parses("{\"a\": nul}"));
+    CHECK(!parses("{\"a\": True}"));
+    // numbers JSON doesn't have
+    CHECK(!parses("{\"a\": 01}"));
+    CHECK(!parses("{\"a\": +1}"));
+    CHECK(!parses("{\"a\": 1.}"));
+    CHECK(!parses("{\"a\": .5}"));
+    CHECK(!parses("{\"a\": 1e}"));
+    CHECK(!parses("{\"a\": -}"));
+    CHECK(!parses("{\"a\": 0x10}"));
+    CHECK(!parses("{\"a\": NaN}"));
+    // nested values
+    CHECK(!parses("{\"a\": {}}"));
+    CHECK(!parses("{\"a\": [1]}"));
+    // broken strings
+    CHECK(!parses("{\"a\": \"abc}"));
+    CHECK(!parses("{\"a\": \"\\x\"}"));
+    CHECK(!parses("{\"a\": \"\\u12\"}"));
+    CHECK(!parses("{\"a\": \"\\u12g4\"}"));
+    CHECK(!parses("{\"a\": \"tab\there\"}"));
+    CHECK(!parses("{\"a\": \"new\nline\"}"));
+    // broken objects
+    CHECK(!parses(""));
+    CHECK(!parses("[]"));
+    CHECK(!parses("{"));
+    CHECK(!parses("{\"a\"}"));
+    CHECK(!parses("{\"a\": }"));
+    CHECK(!parses("{\"a\": 1,}"));
+    CHECK(!parses("{\"a\": 1 \"b\": 2}"));
+    CHECK(!parses("{a: 1}"));
+    CHECK(!parses("{\"a\": 1} x"));
+    CHECK(!parses("{\"a\": 1}{}"));
+}
+
+int main() {
+    test_scalars();
+    test_strings();
+    test_rejected();
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}